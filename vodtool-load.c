@@ -0,0 +1,885 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+/*
+ * Load generator for vodtool's HTTP server. It either replays an access log at the recorded
+ * (or a scaled) rate, or simulates viewers whose playback and seeks are modelled on the
+ * assets in the log. It reports throughput and latency per request type and can compare
+ * them against a saved baseline.
+ *
+ * Access log lines are "<seconds> <asset> <type> <number>", type being one of playlist, ts,
+ * mp4 or thumb. number is the segment, or the thumbnail time in seconds. Blank lines and
+ * lines starting with # are skipped.
+ */
+
+enum request_type {
+    TYPE_PLAYLIST,
+    TYPE_TS,
+    TYPE_MP4,
+    TYPE_THUMB,
+    TYPE_COUNT,
+};
+
+static const char* const type_names[TYPE_COUNT] = { "playlist", "ts", "mp4", "thumb" };
+
+struct log_entry {
+    int64_t time;   /* microseconds from the start of the log */
+    char* asset;
+    enum request_type type;
+    int64_t number;
+};
+
+struct asset {
+    char* name;
+    int64_t segments;   /* one past the highest segment seen */
+    int64_t requests;
+};
+
+/* Latencies of one request type, in microseconds */
+struct latencies {
+    pthread_mutex_t lock;
+    int64_t* values;
+    size_t count;
+    size_t size;
+    int64_t errors;
+    int64_t bytes;
+};
+
+struct load {
+    const char* host;
+    const char* port;
+    double speed;
+    int connections;
+    int sessions;
+    double run_time;
+    double segment_duration;
+    double seek_probability;
+    int burst;
+    int thumbs;
+    double watch;
+
+    struct log_entry* entries;
+    size_t nb_entries;
+    atomic_size_t next_entry;
+    struct asset* assets;
+    size_t nb_assets;
+    /* Open addressed index into assets by name, -1 for empty slots; only used while reading */
+    int* asset_index;
+    size_t asset_index_size;
+
+    int64_t start;
+    struct latencies results[TYPE_COUNT];
+};
+
+/* An HTTP/1.1 connection that is reopened whenever the server closes it */
+struct client {
+    struct load* load;
+    int fd;
+    char buf[16384];
+    size_t len;
+    uint64_t seed;
+};
+
+static int64_t now_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sleep_until(int64_t deadline) {
+    int64_t delay = deadline - now_us();
+
+    if (delay > 0) {
+        struct timespec ts = { delay / 1000000, delay % 1000000 * 1000 };
+
+        nanosleep(&ts, NULL);
+    }
+}
+
+/* xorshift64*, one state per thread */
+static uint64_t next_random(uint64_t* state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dULL;
+}
+
+static double random_unit(uint64_t* state) {
+    return (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void usage(char* cmd_name) {
+    fprintf(stderr, "usage: %s [options] --http [host]:port logfile\n", cmd_name);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Replays an access log against vodtool serve, or simulates viewers of its assets\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "\t    --http\tThe server address.\n");
+    fprintf(stderr, "\t    --speed\tReplay rate relative to the log.\tDefault Value: 1\n");
+    fprintf(stderr, "\t    --connections\tThe number of connections replaying the log.\tDefault Value: 64\n");
+    fprintf(stderr, "\t    --sessions\tSimulate this many concurrent viewers instead of replaying.\tDefault Value: 0\n");
+    fprintf(stderr, "\t    --time\tSeconds to simulate viewers for.\tDefault Value: 60\n");
+    fprintf(stderr, "\t-d, --segment-duration\tSeconds of playback per segment.\tDefault Value: 5\n");
+    fprintf(stderr, "\t    --seek-prob\tChance a viewer seeks instead of playing the next segment.\tDefault Value: 0.05\n");
+    fprintf(stderr, "\t    --burst\tSegments fetched back to back on start and after a seek.\tDefault Value: 3\n");
+    fprintf(stderr, "\t    --thumbs\tThumbnails fetched while scrubbing to a seek target.\tDefault Value: 3\n");
+    fprintf(stderr, "\t    --watch\tMean segments watched per session.\tDefault Value: 60\n");
+    fprintf(stderr, "\t    --save-baseline\tWrite the results to the given file.\n");
+    fprintf(stderr, "\t    --baseline\tCompare the results against the given file.\n");
+    fprintf(stderr, "\t    --tolerance\tPercent a latency may grow, or throughput drop, before the comparison fails.\tDefault Value: 10\n");
+    fprintf(stderr, "\t--speed applies to replay, the session options to --sessions.\n");
+
+    exit(1);
+}
+
+static int parse_type(const char* name) {
+    for (int i = 0; i < TYPE_COUNT; i++) {
+        if (!strcmp(name, type_names[i])) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static uint64_t hash_name(const char* name) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    while (*name) {
+        hash = (hash ^ (uint8_t)*name++) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/* Slot in the index holding name, or the empty slot it would go in */
+static int* find_asset(struct load* load, const char* name) {
+    size_t mask = load->asset_index_size - 1;
+
+    for (size_t i = hash_name(name) & mask;; i = (i + 1) & mask) {
+        int* slot = &load->asset_index[i];
+
+        if (*slot < 0 || !strcmp(load->assets[*slot].name, name)) {
+            return slot;
+        }
+    }
+}
+
+/* Keep the index at most half full */
+static int grow_asset_index(struct load* load) {
+    size_t size = load->asset_index_size ? load->asset_index_size * 2 : 1024;
+    int* index = malloc(size * sizeof(*index));
+
+    if (!index) {
+        return -1;
+    }
+    memset(index, -1, size * sizeof(*index));
+    free(load->asset_index);
+    load->asset_index = index;
+    load->asset_index_size = size;
+    for (size_t i = 0; i < load->nb_assets; i++) {
+        *find_asset(load, load->assets[i].name) = i;
+    }
+    return 0;
+}
+
+/**
+ * Read the access log, and tally the assets in it for the session model.
+ */
+static int read_log(struct load* load, const char* filename) {
+    FILE* f = fopen(filename, "r");
+    size_t entries_size = 0;
+    size_t assets_size = 0;
+    char line[4096];
+    int line_number = 0;
+
+    if (!f) {
+        fprintf(stderr, "Could not open %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        char asset_name[4096];
+        char type_name[16];
+        struct log_entry* entry;
+        struct asset* asset;
+        int* slot;
+        double seconds;
+        int64_t number;
+        int type;
+
+        line_number++;
+        if (line[strspn(line, " \t\r\n")] == 0 || line[strspn(line, " \t")] == '#') {
+            continue;
+        }
+        if (sscanf(line, "%lf %4095s %15s %" SCNd64, &seconds, asset_name, type_name, &number) != 4 ||
+            (type = parse_type(type_name)) < 0 || number < 0) {
+            fprintf(stderr, "%s:%d: expected <seconds> <asset> <type> <number>\n", filename, line_number);
+            fclose(f);
+            return -1;
+        }
+
+        if (load->nb_assets * 2 >= load->asset_index_size && grow_asset_index(load) < 0) {
+            goto oom;
+        }
+        if (*(slot = find_asset(load, asset_name)) < 0) {
+            if (load->nb_assets == assets_size) {
+                assets_size = assets_size ? assets_size * 2 : 64;
+                if (!(load->assets = realloc(load->assets, assets_size * sizeof(*load->assets)))) {
+                    goto oom;
+                }
+            }
+            load->assets[load->nb_assets] = (struct asset){ .name = strdup(asset_name) };
+            if (!load->assets[load->nb_assets].name) {
+                goto oom;
+            }
+            *slot = load->nb_assets++;
+        }
+        asset = &load->assets[*slot];
+        asset->requests++;
+        if ((type == TYPE_TS || type == TYPE_MP4) && number >= asset->segments) {
+            asset->segments = number + 1;
+        }
+
+        if (load->nb_entries == entries_size) {
+            entries_size = entries_size ? entries_size * 2 : 1024;
+            if (!(load->entries = realloc(load->entries, entries_size * sizeof(*load->entries)))) {
+                goto oom;
+            }
+        }
+        entry = &load->entries[load->nb_entries++];
+        *entry = (struct log_entry){ (int64_t)(seconds * 1000000), asset->name, type, number };
+    }
+    fclose(f);
+    free(load->asset_index);
+    load->asset_index = NULL;
+
+    if (!load->nb_entries) {
+        fprintf(stderr, "%s has no requests\n", filename);
+        return -1;
+    }
+    return 0;
+
+oom:
+    fprintf(stderr, "Out of memory reading %s\n", filename);
+    fclose(f);
+    return -1;
+}
+
+static int compare_entries(const void* a, const void* b) {
+    int64_t ta = ((const struct log_entry*)a)->time;
+    int64_t tb = ((const struct log_entry*)b)->time;
+
+    return ta < tb ? -1 : ta > tb;
+}
+
+static void client_close(struct client* client) {
+    if (client->fd >= 0) {
+        close(client->fd);
+        client->fd = -1;
+    }
+    client->len = 0;
+}
+
+static int client_connect(struct client* client) {
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo* res;
+    struct addrinfo* ai;
+    int one = 1;
+    int ret;
+
+    if ((ret = getaddrinfo(client->load->host, client->load->port, &hints, &res)) != 0) {
+        fprintf(stderr, "Could not resolve %s: %s\n", client->load->host, gai_strerror(ret));
+        return -1;
+    }
+    for (ai = res; ai; ai = ai->ai_next) {
+        if ((client->fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol)) < 0) {
+            continue;
+        }
+        if (connect(client->fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            break;
+        }
+        close(client->fd);
+        client->fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (client->fd < 0) {
+        fprintf(stderr, "Could not connect to %s:%s: %s\n", client->load->host, client->load->port, strerror(errno));
+        return -1;
+    }
+    setsockopt(client->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    client->len = 0;
+
+    return 0;
+}
+
+/* Make at least one more byte available in buf */
+static int client_fill(struct client* client) {
+    ssize_t n;
+
+    if (client->len == sizeof(client->buf)) {
+        return -1;
+    }
+    do {
+        n = read(client->fd, client->buf + client->len, sizeof(client->buf) - client->len);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+        return -1;
+    }
+    client->len += n;
+    return 0;
+}
+
+static void client_consume(struct client* client, size_t n) {
+    memmove(client->buf, client->buf + n, client->len - n);
+    client->len -= n;
+}
+
+/* Read and discard size bytes of body */
+static int client_skip(struct client* client, int64_t size) {
+    while (size > 0) {
+        size_t n;
+
+        if (!client->len && client_fill(client) < 0) {
+            return -1;
+        }
+        n = size < (int64_t)client->len ? (size_t)size : client->len;
+        client_consume(client, n);
+        size -= n;
+    }
+    return 0;
+}
+
+/* Read a CRLF terminated line into line, without the CRLF */
+static int client_line(struct client* client, char* line, size_t size) {
+    char* end;
+
+    while (!(end = memmem(client->buf, client->len, "\r\n", 2))) {
+        if (client_fill(client) < 0) {
+            return -1;
+        }
+    }
+    if ((size_t)(end - client->buf) >= size) {
+        return -1;
+    }
+    memcpy(line, client->buf, end - client->buf);
+    line[end - client->buf] = 0;
+    client_consume(client, end - client->buf + 2);
+    return 0;
+}
+
+/**
+ * Send one GET and read the whole response. Returns the HTTP status, or -1 if the connection
+ * failed; *bytes is set to the body size.
+ */
+static int client_get(struct client* client, const char* path, const char* priority, int64_t* bytes) {
+    char request[4608];
+    char line[4096];
+    int64_t content_length = -1;
+    int chunked = 0;
+    int keep_alive = 1;
+    int status;
+    int len;
+
+    *bytes = 0;
+    if (client->fd < 0 && client_connect(client) < 0) {
+        return -1;
+    }
+
+    len = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: %s\r\n%s%s%s\r\n", path, client->load->host,
+                   priority ? "X-Priority: " : "", priority ? priority : "", priority ? "\r\n" : "");
+    if (len >= sizeof(request) || send(client->fd, request, len, MSG_NOSIGNAL) != len) {
+        client_close(client);
+        return -1;
+    }
+
+    if (client_line(client, line, sizeof(line)) < 0 || sscanf(line, "HTTP/1.%*d %d", &status) != 1) {
+        client_close(client);
+        return -1;
+    }
+    for (;;) {
+        if (client_line(client, line, sizeof(line)) < 0) {
+            client_close(client);
+            return -1;
+        }
+        if (!line[0]) {
+            break;
+        }
+        if (!strncasecmp(line, "Content-Length:", 15)) {
+            content_length = strtoll(line + 15, NULL, 10);
+        } else if (!strncasecmp(line, "Transfer-Encoding:", 18) && strcasestr(line + 18, "chunked")) {
+            chunked = 1;
+        } else if (!strncasecmp(line, "Connection:", 11) && strcasestr(line + 11, "close")) {
+            keep_alive = 0;
+        }
+    }
+
+    if (chunked) {
+        for (;;) {
+            int64_t size;
+
+            if (client_line(client, line, sizeof(line)) < 0) {
+                client_close(client);
+                return -1;
+            }
+            size = strtoll(line, NULL, 16);
+            if (client_skip(client, size + 2) < 0) {
+                client_close(client);
+                return -1;
+            }
+            if (!size) {
+                break;
+            }
+            *bytes += size;
+        }
+    } else if (content_length >= 0) {
+        if (client_skip(client, content_length) < 0) {
+            client_close(client);
+            return -1;
+        }
+        *bytes = content_length;
+    } else {
+        /* Body runs to the end of the connection */
+        while (client_fill(client) == 0 || client->len) {
+            *bytes += client->len;
+            client->len = 0;
+        }
+        keep_alive = 0;
+    }
+
+    if (!keep_alive) {
+        client_close(client);
+    }
+    return status;
+}
+
+static void latencies_add(struct latencies* l, int64_t value, int ok, int64_t bytes) {
+    pthread_mutex_lock(&l->lock);
+    if (!ok) {
+        l->errors++;
+    } else {
+        if (l->count == l->size) {
+            size_t size = l->size ? l->size * 2 : 4096;
+            int64_t* values = realloc(l->values, size * sizeof(*values));
+
+            if (!values) {
+                pthread_mutex_unlock(&l->lock);
+                return;
+            }
+            l->values = values;
+            l->size = size;
+        }
+        l->values[l->count++] = value;
+        l->bytes += bytes;
+    }
+    pthread_mutex_unlock(&l->lock);
+}
+
+/**
+ * Issue one request and record it. Latency is counted from when the request was due rather
+ * than when it could be sent, so a server that falls behind is not hidden by the client
+ * waiting for it.
+ */
+static void load_request(struct client* client, const char* asset, enum request_type type, int64_t number,
+                         const char* priority, int64_t due) {
+    char path[4200];
+    int64_t bytes;
+    int status;
+
+    switch (type) {
+        case TYPE_PLAYLIST:
+            snprintf(path, sizeof(path), "/%s/index.m3u8", asset);
+            break;
+        case TYPE_TS:
+        case TYPE_MP4:
+            snprintf(path, sizeof(path), "/%s/seg/%" PRId64 ".%s", asset, number, type == TYPE_TS ? "ts" : "mp4");
+            break;
+        default:
+            snprintf(path, sizeof(path), "/%s/thumb/%" PRId64 ".jpg", asset, number);
+            break;
+    }
+
+    status = client_get(client, path, priority, &bytes);
+    latencies_add(&client->load->results[type], now_us() - due, status == 200, bytes);
+}
+
+/**
+ * Replay worker: takes the next log entry, waits for its time, and requests it.
+ */
+static void* replay_thread(void* opaque) {
+    struct client client = { .load = opaque, .fd = -1 };
+    struct load* load = client.load;
+    size_t i;
+
+    while ((i = atomic_fetch_add(&load->next_entry, 1)) < load->nb_entries) {
+        struct log_entry* entry = &load->entries[i];
+        int64_t due = load->start + (int64_t)((entry->time - load->entries[0].time) / load->speed);
+
+        sleep_until(due);
+        load_request(&client, entry->asset, entry->type, entry->number, NULL, due);
+    }
+    client_close(&client);
+
+    return NULL;
+}
+
+/* Pick an asset with the probability it was requested in the log */
+static struct asset* pick_asset(struct load* load, uint64_t* seed) {
+    int64_t total = 0;
+    int64_t target;
+
+    for (size_t i = 0; i < load->nb_assets; i++) {
+        total += load->assets[i].requests;
+    }
+    target = random_unit(seed) * total;
+    for (size_t i = 0; i < load->nb_assets; i++) {
+        if ((target -= load->assets[i].requests) < 0) {
+            return &load->assets[i];
+        }
+    }
+    return &load->assets[load->nb_assets - 1];
+}
+
+/**
+ * One simulated viewer, restarting with a new asset whenever a session ends. A session loads
+ * the playlist, fetches the first segments back to back to fill the player's buffer, then
+ * plays in real time. Seeks scrub through a few thumbnails towards the target and refill the
+ * buffer from there.
+ */
+static void* session_thread(void* opaque) {
+    struct client client = { .load = opaque, .fd = -1 };
+    struct load* load = client.load;
+    int64_t end = load->start + (int64_t)(load->run_time * 1000000);
+    int64_t segment_us = load->segment_duration * 1000000;
+
+    client.seed = (uintptr_t)&client ^ now_us();
+
+    while (now_us() < end) {
+        struct asset* asset = pick_asset(load, &client.seed);
+        int64_t segments = asset->segments ? asset->segments : 1;
+        int64_t segment = 0;
+        int64_t due = now_us();
+        int buffered = 0;
+        const char* priority = NULL;
+
+        load_request(&client, asset->name, TYPE_PLAYLIST, 0, NULL, due);
+
+        /* Each segment ends the session with probability 1 / watch */
+        while (segment < segments && now_us() < end && random_unit(&client.seed) >= 1 / load->watch) {
+            if (buffered >= load->burst) {
+                /* Buffer full: the player asks for the next segment as one finishes playing */
+                due += segment_us;
+                sleep_until(due);
+                priority = NULL;
+            } else {
+                due = now_us();
+            }
+            load_request(&client, asset->name, TYPE_TS, segment, priority, due);
+            buffered++;
+            segment++;
+
+            if (random_unit(&client.seed) < load->seek_probability) {
+                int64_t target = random_unit(&client.seed) * segments;
+
+                for (int i = 1; i <= load->thumbs; i++) {
+                    int64_t t = segment + (target - segment) * i / load->thumbs;
+
+                    load_request(&client, asset->name, TYPE_THUMB, (int64_t)(t * load->segment_duration), "seek", now_us());
+                }
+                segment = target;
+                buffered = 0;
+                priority = "seek";
+            }
+        }
+    }
+    client_close(&client);
+
+    return NULL;
+}
+
+static int compare_int64(const void* a, const void* b) {
+    int64_t x = *(const int64_t*)a;
+    int64_t y = *(const int64_t*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_ms(const struct latencies* l, double p) {
+    size_t index;
+
+    if (!l->count) {
+        return 0;
+    }
+    index = (size_t)(p * l->count);
+    return l->values[index < l->count ? index : l->count - 1] / 1000.0;
+}
+
+/* What is compared against a baseline; lower is better except for throughput */
+enum result_field {
+    FIELD_RPS,
+    FIELD_P50,
+    FIELD_P90,
+    FIELD_P99,
+    FIELD_P999,
+    FIELD_MAX,
+    FIELD_COUNT,
+};
+
+static const char* const field_names[FIELD_COUNT] = { "rps", "p50_ms", "p90_ms", "p99_ms", "p999_ms", "max_ms" };
+
+static void result_fields(const struct latencies* l, double elapsed, double fields[FIELD_COUNT]) {
+    fields[FIELD_RPS] = l->count / elapsed;
+    fields[FIELD_P50] = percentile_ms(l, 0.5);
+    fields[FIELD_P90] = percentile_ms(l, 0.9);
+    fields[FIELD_P99] = percentile_ms(l, 0.99);
+    fields[FIELD_P999] = percentile_ms(l, 0.999);
+    fields[FIELD_MAX] = l->count ? l->values[l->count - 1] / 1000.0 : 0;
+}
+
+static void print_results(struct load* load, double elapsed, FILE* out) {
+    for (int type = 0; type < TYPE_COUNT; type++) {
+        struct latencies* l = &load->results[type];
+        double fields[FIELD_COUNT];
+
+        if (!l->count && !l->errors) {
+            continue;
+        }
+        result_fields(l, elapsed, fields);
+        fprintf(out, "type=%s;count=%zu;errors=%" PRId64 ";mbps=%.2f", type_names[type], l->count, l->errors,
+                l->bytes * 8 / elapsed / 1e6);
+        for (int f = 0; f < FIELD_COUNT; f++) {
+            fprintf(out, ";%s=%.3f", field_names[f], fields[f]);
+        }
+        fprintf(out, "\n");
+    }
+}
+
+/**
+ * Compare the results with a file written by --save-baseline. Returns the number of values
+ * that got worse by more than tolerance percent.
+ */
+static int compare_baseline(struct load* load, double elapsed, const char* filename, double tolerance) {
+    FILE* f = fopen(filename, "r");
+    char line[1024];
+    int regressions = 0;
+
+    if (!f) {
+        fprintf(stderr, "Could not open %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        double fields[FIELD_COUNT];
+        char type_name[16];
+        int type;
+
+        if (sscanf(line, "type=%15[^;]", type_name) != 1 || (type = parse_type(type_name)) < 0 ||
+            !load->results[type].count) {
+            continue;
+        }
+        result_fields(&load->results[type], elapsed, fields);
+
+        for (int field = 0; field < FIELD_COUNT; field++) {
+            char key[32];
+            char* value;
+            double base;
+            double change;
+            int worse;
+
+            snprintf(key, sizeof(key), ";%s=", field_names[field]);
+            if (!(value = strstr(line, key)) || (base = strtod(value + strlen(key), NULL)) <= 0) {
+                continue;
+            }
+            change = (fields[field] - base) / base * 100;
+            worse = field == FIELD_RPS ? change < -tolerance : change > tolerance;
+            regressions += worse;
+            fprintf(stderr, "type=%s;field=%s;baseline=%.3f;current=%.3f;change_pct=%+.1f%s\n", type_name,
+                    field_names[field], base, fields[field], change, worse ? ";regression=1" : "");
+        }
+    }
+    fclose(f);
+
+    return regressions;
+}
+
+/* Long-only options */
+enum {
+    OPT_HTTP = 256,
+    OPT_SPEED,
+    OPT_CONNECTIONS,
+    OPT_SESSIONS,
+    OPT_TIME,
+    OPT_SEEK_PROB,
+    OPT_BURST,
+    OPT_THUMBS,
+    OPT_WATCH,
+    OPT_SAVE_BASELINE,
+    OPT_BASELINE,
+    OPT_TOLERANCE,
+};
+
+int main(int argc, char** argv) {
+    struct load load = {
+        .speed = 1,
+        .connections = 64,
+        .run_time = 60,
+        .segment_duration = 5,
+        .seek_probability = 0.05,
+        .burst = 3,
+        .thumbs = 3,
+        .watch = 60,
+    };
+    const char* save_baseline = NULL;
+    const char* baseline = NULL;
+    double tolerance = 10;
+    char* address = NULL;
+    char* colon;
+    pthread_t* threads;
+    int nb_threads;
+    double elapsed;
+    int ret = 0;
+
+    static struct option long_options[] = {
+        {"http", required_argument, 0, OPT_HTTP},
+        {"speed", required_argument, 0, OPT_SPEED},
+        {"connections", required_argument, 0, OPT_CONNECTIONS},
+        {"sessions", required_argument, 0, OPT_SESSIONS},
+        {"time", required_argument, 0, OPT_TIME},
+        {"segment-duration", required_argument, 0, 'd'},
+        {"seek-prob", required_argument, 0, OPT_SEEK_PROB},
+        {"burst", required_argument, 0, OPT_BURST},
+        {"thumbs", required_argument, 0, OPT_THUMBS},
+        {"watch", required_argument, 0, OPT_WATCH},
+        {"save-baseline", required_argument, 0, OPT_SAVE_BASELINE},
+        {"baseline", required_argument, 0, OPT_BASELINE},
+        {"tolerance", required_argument, 0, OPT_TOLERANCE},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0},
+    };
+    int option;
+    while ((option = getopt_long(argc, argv, "d:h?", long_options, NULL)) != -1) {
+        switch (option) {
+            case OPT_HTTP:
+                address = optarg;
+                break;
+            case OPT_SPEED:
+                load.speed = atof(optarg);
+                break;
+            case OPT_CONNECTIONS:
+                load.connections = atoi(optarg);
+                break;
+            case OPT_SESSIONS:
+                load.sessions = atoi(optarg);
+                break;
+            case OPT_TIME:
+                load.run_time = atof(optarg);
+                break;
+            case 'd':
+                load.segment_duration = atof(optarg);
+                break;
+            case OPT_SEEK_PROB:
+                load.seek_probability = atof(optarg);
+                break;
+            case OPT_BURST:
+                load.burst = atoi(optarg);
+                break;
+            case OPT_THUMBS:
+                load.thumbs = atoi(optarg);
+                break;
+            case OPT_WATCH:
+                load.watch = atof(optarg);
+                break;
+            case OPT_SAVE_BASELINE:
+                save_baseline = optarg;
+                break;
+            case OPT_BASELINE:
+                baseline = optarg;
+                break;
+            case OPT_TOLERANCE:
+                tolerance = atof(optarg);
+                break;
+            case 'h':
+            case '?':
+                usage(argv[0]);
+                break;
+        }
+    }
+
+    if (argc - optind != 1 || !address || !(colon = strrchr(address, ':')) || load.speed <= 0 ||
+        load.connections < 1 || load.sessions < 0 || load.segment_duration <= 0 || load.thumbs < 1 || load.watch < 1) {
+        usage(argv[0]);
+    }
+    *colon = 0;
+    load.host = *address ? address : "127.0.0.1";
+    load.port = colon + 1;
+
+    if (read_log(&load, argv[optind]) < 0) {
+        return 1;
+    }
+    qsort(load.entries, load.nb_entries, sizeof(*load.entries), compare_entries);
+    for (int i = 0; i < TYPE_COUNT; i++) {
+        pthread_mutex_init(&load.results[i].lock, NULL);
+    }
+
+    nb_threads = load.sessions ? load.sessions : load.connections;
+    if (!(threads = calloc(nb_threads, sizeof(*threads)))) {
+        return 1;
+    }
+    if (load.sessions) {
+        fprintf(stderr, "simulating %d viewers of %zu assets for %.0fs\n", load.sessions, load.nb_assets, load.run_time);
+    } else {
+        fprintf(stderr, "replaying %zu requests at %gx over %d connections\n", load.nb_entries, load.speed,
+                load.connections);
+    }
+
+    load.start = now_us();
+    for (int i = 0; i < nb_threads; i++) {
+        if (pthread_create(&threads[i], NULL, load.sessions ? session_thread : replay_thread, &load) != 0) {
+            fprintf(stderr, "Could not start thread\n");
+            return 1;
+        }
+    }
+    for (int i = 0; i < nb_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    elapsed = (now_us() - load.start) / 1e6;
+
+    for (int i = 0; i < TYPE_COUNT; i++) {
+        qsort(load.results[i].values, load.results[i].count, sizeof(int64_t), compare_int64);
+    }
+    fprintf(stderr, "elapsed_s=%.3f\n", elapsed);
+    print_results(&load, elapsed, stderr);
+
+    if (save_baseline) {
+        FILE* f = fopen(save_baseline, "w");
+
+        if (!f) {
+            fprintf(stderr, "Could not open %s: %s\n", save_baseline, strerror(errno));
+            return 1;
+        }
+        print_results(&load, elapsed, f);
+        fclose(f);
+    }
+    if (baseline && (ret = compare_baseline(&load, elapsed, baseline, tolerance)) != 0) {
+        if (ret > 0) {
+            fprintf(stderr, "%d values regressed\n", ret);
+        }
+        ret = 1;
+    }
+
+    return ret;
+}
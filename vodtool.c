@@ -1,90 +1,7247 @@
+#define _GNU_SOURCE
 #include <libavformat/avformat.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/time.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <limits.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <linux/mempolicy.h>
+#include <linux/perf_event.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <stddef.h>
+
+#ifdef ALLOC_STATS
+/*
+ * Allocation tracking build (make alloc-stats). The allocator entry points are interposed so
+ * that allocations made inside libavformat and libavcodec are counted as well; av_malloc()
+ * ends up in posix_memalign().
+ */
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t nmemb, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+extern void* __libc_memalign(size_t alignment, size_t size);
+
+static atomic_uint_fast64_t alloc_count;
+
+void* malloc(size_t size) {
+    atomic_fetch_add_explicit(&alloc_count, 1, memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t nmemb, size_t size) {
+    atomic_fetch_add_explicit(&alloc_count, 1, memory_order_relaxed);
+    return __libc_calloc(nmemb, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+    atomic_fetch_add_explicit(&alloc_count, 1, memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+
+void* memalign(size_t alignment, size_t size) {
+    atomic_fetch_add_explicit(&alloc_count, 1, memory_order_relaxed);
+    return __libc_memalign(alignment, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+int posix_memalign(void** memptr, size_t alignment, size_t size) {
+    void* ptr;
+
+    if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    if (!(ptr = memalign(alignment, size))) {
+        return ENOMEM;
+    }
+    *memptr = ptr;
+    return 0;
+}
+
+static inline uint64_t alloc_counter(void) {
+    return atomic_load_explicit(&alloc_count, memory_order_relaxed);
+}
+#else
+static inline uint64_t alloc_counter(void) {
+    return 0;
+}
+#endif
+
+/*
+ * USDT probes in the demux and decode path, for bpftrace and other uprobe tracers:
+ *
+ *   bpftrace -e 'usdt:./vodtool:vodtool:seek__landed { @miss = hist(arg0 - arg1); }'
+ *
+ * Each probe is a single nop until a tracer attaches, and the arguments are values already in
+ * hand. Without <sys/sdt.h> the probes compile to nothing.
+ *
+ *   open__start(filename)                     open__done(filename, ret)
+ *   seek__start(target)                       seek__done(target, ret)
+ *   seek__landed(target, first packet ts)     packet__read(stream, size, flags, pts)
+ *   decode__send(size, ret)                   decode__receive(pts, ret)
+ *   output__write(stream or -1 for a whole body, size, ret)
+ *
+ * Seek timestamps are in AV_TIME_BASE units; packet and frame pts are in the stream's time
+ * base.
+ */
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_SDT 1
+#endif
+#endif
+
+#ifdef HAVE_SDT
+#define PROBE1(name, a) DTRACE_PROBE1(vodtool, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(vodtool, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(vodtool, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(vodtool, name, a, b, c, d)
+#else
+#define PROBE1(name, a) ((void)(a))
+#define PROBE2(name, a, b) ((void)(a), (void)(b))
+#define PROBE3(name, a, b, c) ((void)(a), (void)(b), (void)(c))
+#define PROBE4(name, a, b, c, d) ((void)(a), (void)(b), (void)(c), (void)(d))
+#endif
+
+/**
+ * Counters for a single request. Allocations are only counted in ALLOC_STATS builds.
+ */
+struct request_stats {
+    int64_t packets_read;
+    int64_t packets_decoded;
+    int64_t frames_decoded;
+    uint64_t allocs_setup;
+    uint64_t allocs_loop;
+    int64_t mem_peak;
+    int64_t bytes_read;
+};
+
+/**
+ * Memory accounting for a single request. A limit of 0 means unlimited; usage is still
+ * tracked so it can be reported.
+ */
+struct mem_budget {
+    int64_t limit;
+    atomic_int_fast64_t used;
+    atomic_int_fast64_t peak;
+    atomic_int exceeded;
+};
+
+/* Worst case number of reference frames held by H.264/HEVC decoders */
+#define MAX_DPB_FRAMES 16
+
+/*
+ * Share of the budget charged up front for the demuxer, and used as its probesize. This only
+ * approximates the demuxer's memory: probesize bounds what is read while probing, but the
+ * packet queue filled by avformat_find_stream_info() and the AVIO buffer are not charged
+ * separately, so the probesize charge stands in for them.
+ */
+#define BUDGET_PROBESIZE_SHARE 16
+
+static int mem_budget_charge(struct mem_budget* budget, int64_t size) {
+    int64_t used = atomic_fetch_add(&budget->used, size) + size;
+    int64_t peak = atomic_load(&budget->peak);
+
+    if (budget->limit && used > budget->limit) {
+        atomic_fetch_sub(&budget->used, size);
+        atomic_store(&budget->exceeded, 1);
+        return AVERROR(ENOMEM);
+    }
+
+    while (used > peak && !atomic_compare_exchange_weak(&budget->peak, &peak, used));
+
+    return 0;
+}
+
+static void mem_budget_release(struct mem_budget* budget, int64_t size) {
+    atomic_fetch_sub(&budget->used, size);
+}
+
+/*
+ * Server metrics. Every thread that records metrics owns a shard and is the only writer to
+ * it, so recording is a plain load and store with no locked instructions. A scrape sums the
+ * shards. They live in one shared mapping, so in cluster mode any process can report for
+ * all of them. Threads without a shard (the CLI, the cluster router) record nothing.
+ *
+ * Histograms are log-linear in the style of HdrHistogram: 8 linear sub-buckets per power of
+ * two, which keeps every value within 12.5% of its bucket.
+ */
+
+#define HIST_SUB_BITS 3
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_MAX_EXPONENT 40
+#define HIST_BUCKETS ((HIST_MAX_EXPONENT - HIST_SUB_BITS + 2) * HIST_SUB_COUNT)
+
+enum metric_hist {
+    /* Time from admission to completion, per route; indexed by enum route - 1 */
+    HIST_PLAYLIST,
+    HIST_SEGMENT,
+    HIST_FMP4_SEGMENT,
+    HIST_THUMBNAIL,
+    /* Time spent per phase */
+    HIST_OPEN,
+    HIST_PROBE,
+    HIST_SEEK,
+    HIST_PREROLL,
+    HIST_OUTPUT,
+    /* Bytes read from the input per request */
+    HIST_READ_BYTES,
+    HIST_COUNT,
+};
+
+enum metric_counter {
+    METRIC_INPUT_CACHE_HITS,
+    METRIC_INPUT_CACHE_MISSES,
+    METRIC_DECODER_POOL_HITS,
+    METRIC_DECODER_POOL_MISSES,
+    METRIC_FRAMES_DECODED,
+    METRIC_FRAMES_RETURNED,
+    METRIC_REQUESTS_SHED,
+    /* Gauges, kept as per-shard deltas that sum to the current value */
+    METRIC_ACTIVE_INPUTS,
+    METRIC_ACTIVE_DECODERS,
+    METRIC_QUEUE_DEPTH,     /* one per priority class */
+    METRIC_COUNT = METRIC_QUEUE_DEPTH + 4,
+};
+
+struct metric_histogram {
+    _Atomic uint64_t buckets[HIST_BUCKETS];
+    _Atomic uint64_t sum;
+};
+
+struct metrics_shard {
+    _Alignas(64) struct metric_histogram hists[HIST_COUNT];
+    _Atomic int64_t counters[METRIC_COUNT];
+};
+
+struct metrics {
+    int shards_per_process;
+    int nb_shards;
+    struct metrics_shard shards[];
+};
+
+static __thread struct metrics_shard* metrics_shard;
+
+static int hist_bucket(uint64_t value) {
+    int exponent;
+
+    if (value < HIST_SUB_COUNT) {
+        return value;
+    }
+    exponent = 63 - __builtin_clzll(value);
+    if (exponent > HIST_MAX_EXPONENT) {
+        return HIST_BUCKETS - 1;
+    }
+    return (exponent - HIST_SUB_BITS + 1) * HIST_SUB_COUNT + ((value >> (exponent - HIST_SUB_BITS)) & (HIST_SUB_COUNT - 1));
+}
+
+/* Largest value that falls in bucket */
+static uint64_t hist_bucket_limit(int bucket) {
+    int exponent = bucket / HIST_SUB_COUNT + HIST_SUB_BITS - 1;
+
+    if (bucket < HIST_SUB_COUNT) {
+        return bucket;
+    }
+    return ((uint64_t)(HIST_SUB_COUNT + bucket % HIST_SUB_COUNT + 1) << (exponent - HIST_SUB_BITS)) - 1;
+}
+
+/* Only the owning thread writes to a shard, so a relaxed load and store is enough */
+static inline void metric_add(_Atomic uint64_t* counter, uint64_t value) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+static inline void metrics_count(enum metric_counter counter, int64_t value) {
+    if (metrics_shard) {
+        _Atomic int64_t* c = &metrics_shard->counters[counter];
+
+        atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + value, memory_order_relaxed);
+    }
+}
+
+static inline void metrics_observe(enum metric_hist hist, uint64_t value) {
+    if (metrics_shard) {
+        metric_add(&metrics_shard->hists[hist].buckets[hist_bucket(value)], 1);
+        metric_add(&metrics_shard->hists[hist].sum, value);
+    }
+}
+
+/**
+ * Record the time since start, in microseconds, in hist.
+ */
+static inline void metrics_observe_since(enum metric_hist hist, int64_t start) {
+    if (metrics_shard) {
+        metrics_observe(hist, av_gettime_relative() - start);
+    }
+}
+
+static struct metrics* metrics_create(int processes, int threads) {
+    struct metrics* metrics;
+    size_t size = sizeof(*metrics) + (size_t)processes * threads * sizeof(struct metrics_shard);
+
+    metrics = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (metrics == MAP_FAILED) {
+        fprintf(stderr, "Could not map metrics: %s\n", strerror(errno));
+        return NULL;
+    }
+    metrics->shards_per_process = threads;
+    metrics->nb_shards = processes * threads;
+
+    return metrics;
+}
+
+/*
+ * Timeline of a command line request (--trace), written as it happens in the Chrome Trace
+ * Event Format that chrome://tracing and Perfetto open. Events carry the id of the thread they
+ * happened on, so work the decoder does on its own threads shows up on separate tracks.
+ * Recording is off, and costs a pointer test, unless trace is set.
+ */
+#define TRACE_MAX_THREADS 64
+
+struct trace {
+    FILE* file;
+    pthread_mutex_t lock;
+    pid_t pid;
+    pid_t threads[TRACE_MAX_THREADS];
+    int nb_threads;
+};
+
+static struct trace* trace;
+
+static inline int64_t trace_now(void) {
+    return trace ? av_gettime_relative() : 0;
+}
+
+static struct trace* trace_open(const char* filename) {
+    struct trace* t = calloc(1, sizeof(*t));
+
+    if (!t || !(t->file = fopen(filename, "w"))) {
+        fprintf(stderr, "Could not open %s: %s\n", filename, strerror(errno));
+        free(t);
+        return NULL;
+    }
+    pthread_mutex_init(&t->lock, NULL);
+    t->pid = getpid();
+    fprintf(t->file, "{\"traceEvents\":[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"vodtool\"}}",
+            (int)t->pid);
+
+    return t;
+}
+
+static void trace_close(struct trace* t) {
+    fprintf(t->file, "\n]}\n");
+    if (fclose(t->file) != 0) {
+        fprintf(stderr, "Could not write trace: %s\n", strerror(errno));
+    }
+    pthread_mutex_destroy(&t->lock);
+    free(t);
+}
+
+/**
+ * Record a span from start (av_gettime_relative() time) to now on the calling thread. args,
+ * if given, is a printf format for the members of the event's args object.
+ */
+static void trace_event(const char* name, const char* category, int64_t start, const char* args, ...) {
+    pid_t tid = syscall(SYS_gettid);
+    int64_t now = av_gettime_relative();
+    int known = 0;
+    va_list ap;
+
+    pthread_mutex_lock(&trace->lock);
+    for (int i = 0; i < trace->nb_threads; i++) {
+        known |= trace->threads[i] == tid;
+    }
+    if (!known && trace->nb_threads < TRACE_MAX_THREADS) {
+        trace->threads[trace->nb_threads++] = tid;
+        fprintf(trace->file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                (int)trace->pid, (int)tid, tid == trace->pid ? "main" : "decoder");
+    }
+    fprintf(trace->file, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%" PRId64 ",\"dur\":%" PRId64
+            ",\"pid\":%d,\"tid\":%d", name, category, start, now - start, (int)trace->pid, (int)tid);
+    if (args) {
+        fprintf(trace->file, ",\"args\":{");
+        va_start(ap, args);
+        vfprintf(trace->file, args, ap);
+        va_end(ap);
+        fprintf(trace->file, "}");
+    }
+    fprintf(trace->file, "}");
+    pthread_mutex_unlock(&trace->lock);
+}
+
+/*
+ * Hardware counters per phase of a command line request (--perf-counters). The counters
+ * follow the calling thread and, through inherit, every thread it creates afterwards, so
+ * they have to be opened before the decoder starts its threads. Each phase is charged with
+ * what was counted since the previous one ended.
+ */
+enum perf_phase {
+    PERF_OPEN,      /* avformat_open_input() */
+    PERF_PROBE,     /* avformat_find_stream_info() */
+    PERF_SETUP,     /* opening the decoder */
+    PERF_SEEK,
+    PERF_PREROLL,   /* decoding the frames before the wanted one */
+    PERF_DECODE,    /* decoding the wanted frame */
+    PERF_WRITE,
+    PERF_PHASE_COUNT,
+};
+
+static const char* const perf_phase_names[PERF_PHASE_COUNT] = {
+    "open", "probe", "setup", "seek", "preroll", "decode", "write",
+};
+
+enum perf_counter {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_CACHE_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_COUNTER_COUNT,
+};
+
+static const uint64_t perf_counter_configs[PERF_COUNTER_COUNT] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+struct perf_counters {
+    int fds[PERF_COUNTER_COUNT];
+    uint64_t last[PERF_COUNTER_COUNT];
+    int64_t last_time;
+    uint64_t counts[PERF_PHASE_COUNT][PERF_COUNTER_COUNT];
+    int64_t time[PERF_PHASE_COUNT];
+    int64_t frames[PERF_PHASE_COUNT];
+};
+
+static struct perf_counters* perf;
+
+static struct perf_counters* perf_counters_open(void) {
+    struct perf_counters* pc = calloc(1, sizeof(*pc));
+
+    if (!pc) {
+        return NULL;
+    }
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+        struct perf_event_attr attr = {
+            .type = PERF_TYPE_HARDWARE,
+            .size = sizeof(attr),
+            .config = perf_counter_configs[i],
+            .read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING,
+            .inherit = 1,
+            .exclude_kernel = 1,
+            .exclude_hv = 1,
+        };
+
+        if ((pc->fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC)) < 0) {
+            fprintf(stderr, "Could not open performance counter: %s\n", strerror(errno));
+            while (i--) {
+                close(pc->fds[i]);
+            }
+            free(pc);
+            return NULL;
+        }
+    }
+    pc->last_time = av_gettime_relative();
+
+    return pc;
+}
+
+/* Counter value, scaled up for the time it was multiplexed out */
+static uint64_t perf_counter_read(int fd) {
+    uint64_t values[3];
+
+    if (read(fd, values, sizeof(values)) != sizeof(values) || !values[2]) {
+        return 0;
+    }
+    return values[2] < values[1] ? (uint64_t)((double)values[0] * values[1] / values[2]) : values[0];
+}
+
+/**
+ * End a phase: everything counted since the last call, and frames decoded, go to phase.
+ */
+static void perf_counters_mark(struct perf_counters* pc, enum perf_phase phase, int64_t frames) {
+    int64_t now = av_gettime_relative();
+
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+        uint64_t value = perf_counter_read(pc->fds[i]);
+
+        pc->counts[phase][i] += value - pc->last[i];
+        pc->last[i] = value;
+    }
+    pc->time[phase] += now - pc->last_time;
+    pc->last_time = now;
+    pc->frames[phase] += frames;
+}
+
+static inline void perf_phase(enum perf_phase phase, int64_t frames) {
+    if (perf) {
+        perf_counters_mark(perf, phase, frames);
+    }
+}
+
+static void perf_counters_print(struct perf_counters* pc) {
+    for (int phase = 0; phase < PERF_PHASE_COUNT; phase++) {
+        uint64_t* c = pc->counts[phase];
+        int64_t frames = pc->frames[phase];
+
+        fprintf(stderr, "phase=%s;time_us=%" PRId64 ";cycles=%" PRIu64 ";instructions=%" PRIu64 ";ipc=%.2f"
+                ";cache_misses=%" PRIu64 ";branch_misses=%" PRIu64 ";frames=%" PRId64,
+                perf_phase_names[phase], pc->time[phase], c[PERF_CYCLES], c[PERF_INSTRUCTIONS],
+                c[PERF_CYCLES] ? (double)c[PERF_INSTRUCTIONS] / c[PERF_CYCLES] : 0.0,
+                c[PERF_CACHE_MISSES], c[PERF_BRANCH_MISSES], frames);
+        if (frames) {
+            fprintf(stderr, ";cache_misses_per_frame=%.0f;branch_misses_per_frame=%.0f",
+                    (double)c[PERF_CACHE_MISSES] / frames, (double)c[PERF_BRANCH_MISSES] / frames);
+        }
+        fprintf(stderr, "\n");
+    }
+}
+
+static void perf_counters_close(struct perf_counters* pc) {
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+        close(pc->fds[i]);
+    }
+    free(pc);
+}
+
+/**
+ * Per decoder frame pool. Frame buffers are charged against the budget when the pool first
+ * allocates them and released when the pool is torn down, so the budget tracks the peak
+ * number of frames the decoder holds at once (references plus frame threads).
+ *
+ * The budget lives in the request, but a pooled decoder can keep a reference to a buffer
+ * past the end of it, so buffers reach the budget through a shared link that the request
+ * detaches when it closes; a buffer freed after that has nothing left to release.
+ */
+struct budget_link {
+    pthread_mutex_t lock;
+    /* NULL once the request has closed */
+    struct mem_budget* budget;
+    /* The request's own reference and one for each buffer */
+    int refs;
+};
+
+struct frame_pool {
+    AVBufferPool* pool;
+    int size;
+    struct budget_link* link;
+};
+
+static void budget_link_unref(struct budget_link* link, int detach, int64_t release) {
+    int refs;
+
+    pthread_mutex_lock(&link->lock);
+    if (link->budget && release) {
+        mem_budget_release(link->budget, release);
+    }
+    if (detach) {
+        link->budget = NULL;
+    }
+    refs = --link->refs;
+    pthread_mutex_unlock(&link->lock);
+
+    if (!refs) {
+        pthread_mutex_destroy(&link->lock);
+        free(link);
+    }
+}
+
+/* Point the pool at budget for the request about to use it */
+static int frame_pool_attach(struct frame_pool* fp, struct mem_budget* budget) {
+    if (!(fp->link = calloc(1, sizeof(*fp->link)))) {
+        return AVERROR(ENOMEM);
+    }
+    pthread_mutex_init(&fp->link->lock, NULL);
+    fp->link->budget = budget;
+    fp->link->refs = 1;
+
+    return 0;
+}
+
+static void frame_pool_detach(struct frame_pool* fp) {
+    av_buffer_pool_uninit(&fp->pool);
+    if (fp->link) {
+        budget_link_unref(fp->link, 1, 0);
+        fp->link = NULL;
+    }
+}
+
+/* Each pooled buffer is prefixed with its size so it can be released from the free callback */
+#define FRAME_POOL_HEADER 64
+
+static void frame_pool_buffer_free(void* opaque, uint8_t* data) {
+    uint8_t* base = data - FRAME_POOL_HEADER;
+
+    budget_link_unref(opaque, 0, *(int64_t*)base);
+    av_free(base);
+}
+
+/* Runs on the request's own threads while it holds the link, so the budget is still there */
+static AVBufferRef* frame_pool_buffer_alloc(void* opaque, int size) {
+    struct budget_link* link = opaque;
+    AVBufferRef* buf;
+    uint8_t* base;
+
+    if (mem_budget_charge(link->budget, size) < 0) {
+        return NULL;
+    }
+
+    if (!(base = av_malloc(size + FRAME_POOL_HEADER))) {
+        mem_budget_release(link->budget, size);
+        return NULL;
+    }
+    *(int64_t*)base = size;
+
+    pthread_mutex_lock(&link->lock);
+    link->refs++;
+    pthread_mutex_unlock(&link->lock);
+    buf = av_buffer_create(base + FRAME_POOL_HEADER, size, frame_pool_buffer_free, link, 0);
+    if (!buf) {
+        budget_link_unref(link, 0, size);
+        av_free(base);
+    }
+
+    return buf;
+}
+
+static int frame_pool_get_frame(AVCodecContext* dec_ctx, AVFrame* frame, int flags) {
+    struct frame_pool* fp = dec_ctx->opaque;
+    int linesize_align[AV_NUM_DATA_POINTERS];
+    uint8_t* data[4];
+    int linesize[4];
+    int width = frame->width;
+    int height = frame->height;
+    int size;
+    int ret;
+
+    if (!(dec_ctx->codec->capabilities & AV_CODEC_CAP_DR1)) {
+        return avcodec_default_get_buffer2(dec_ctx, frame, flags);
+    }
+
+    avcodec_align_dimensions2(dec_ctx, &width, &height, linesize_align);
+
+    /* Wide enough that every plane's linesize satisfies linesize_align */
+    if ((ret = av_image_fill_linesizes(linesize, frame->format, FFALIGN(width, 128))) < 0) {
+        return ret;
+    }
+    if ((size = av_image_fill_pointers(data, frame->format, height, NULL, linesize)) < 0) {
+        return size;
+    }
+    size += 16 + 64 - 1;
+
+    if (size != fp->size) {
+        av_buffer_pool_uninit(&fp->pool);
+        fp->pool = av_buffer_pool_init2(size, fp->link, frame_pool_buffer_alloc, NULL);
+        fp->size = size;
+        if (!fp->pool) {
+            return AVERROR(ENOMEM);
+        }
+    }
+
+    if (!(frame->buf[0] = av_buffer_pool_get(fp->pool))) {
+        return AVERROR(ENOMEM);
+    }
+
+    av_image_fill_pointers(data, frame->format, height, frame->buf[0]->data, linesize);
+    for (int i = 0; i < 4; i++) {
+        frame->data[i] = data[i];
+        frame->linesize[i] = linesize[i];
+    }
+    frame->extended_data = frame->data;
+
+    return 0;
+}
+
+/* Buffer requests show when and on which thread the decoder starts on a frame */
+static int frame_pool_get_buffer2(AVCodecContext* dec_ctx, AVFrame* frame, int flags) {
+    int64_t start;
+    int ret;
+
+    if (!trace) {
+        return frame_pool_get_frame(dec_ctx, frame, flags);
+    }
+    start = av_gettime_relative();
+    ret = frame_pool_get_frame(dec_ctx, frame, flags);
+    trace_event("get_buffer", "decode", start, "\"width\":%d,\"height\":%d,\"ret\":%d",
+                frame->width, frame->height, ret);
+    return ret;
+}
+
+/**
+ * Estimate the decoder's frame pool for the given number of frames in flight.
+ */
+static int64_t estimate_decoder_memory(AVCodecContext* dec_ctx, int frames) {
+    int64_t frame_size = av_image_get_buffer_size(dec_ctx->pix_fmt, FFALIGN(dec_ctx->width, 128),
+                                                  FFALIGN(dec_ctx->height, 64), 64);
+
+    if (frame_size < 0) {
+        return 0;
+    }
+
+    return frame_size * (MAX_DPB_FRAMES + frames);
+}
+
+/*
+ * Container limits. In a cgroup v2 container the CPU quota (cpu.max) and memory limit
+ * (memory.max) can be far below what the host has; sizing threads by the host's CPUs gets
+ * them throttled. The tightest limits between our cgroup and the root apply.
+ */
+#define CGROUP_ROOT "/sys/fs/cgroup"
+
+struct cgroup_limits {
+    /* CPUs we may keep busy: the CPU quota, rounded up, and the affinity mask */
+    int cpus;
+    /* Bytes, 0 for no limit */
+    int64_t memory;
+};
+
+static struct cgroup_limits cgroup_limits;
+static pthread_once_t cgroup_once = PTHREAD_ONCE_INIT;
+
+static int cgroup_read(const char* dir, const char* name, char* buf, int size) {
+    char path[PATH_MAX];
+    FILE* f;
+    int ret = -1;
+
+    if (snprintf(path, sizeof(path), "%s/%s", dir, name) >= sizeof(path) || !(f = fopen(path, "r"))) {
+        return -1;
+    }
+    if (fgets(buf, size, f)) {
+        ret = 0;
+    }
+    fclose(f);
+
+    return ret;
+}
+
+static void cgroup_load(void) {
+    char dir[PATH_MAX] = CGROUP_ROOT;
+    char line[PATH_MAX];
+    cpu_set_t allowed;
+    FILE* f;
+
+    cgroup_limits.cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        cgroup_limits.cpus = CPU_COUNT(&allowed);
+    }
+
+    /* The unified hierarchy's entry is "0::/path" */
+    if (!(f = fopen("/proc/self/cgroup", "r"))) {
+        return;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        if (!strncmp(line, "0::", 3)) {
+            line[strcspn(line, "\n")] = '\0';
+            if (strcmp(line + 3, "/")) {
+                snprintf(dir, sizeof(dir), CGROUP_ROOT "%s", line + 3);
+            }
+            break;
+        }
+    }
+    fclose(f);
+
+    for (;;) {
+        char value[64];
+        long long quota, period;
+        char* slash;
+
+        if (cgroup_read(dir, "cpu.max", value, sizeof(value)) == 0 &&
+            sscanf(value, "%lld %lld", &quota, &period) == 2 && quota > 0 && period > 0) {
+            cgroup_limits.cpus = FFMIN(cgroup_limits.cpus, FFMAX(1, (quota + period - 1) / period));
+        }
+        if (cgroup_read(dir, "memory.max", value, sizeof(value)) == 0 &&
+            sscanf(value, "%lld", &quota) == 1 && quota > 0 &&
+            (!cgroup_limits.memory || quota < cgroup_limits.memory)) {
+            cgroup_limits.memory = quota;
+        }
+
+        if (!strcmp(dir, CGROUP_ROOT) || !(slash = strrchr(dir, '/'))) {
+            break;
+        }
+        *slash = '\0';
+    }
+}
+
+static const struct cgroup_limits* container_limits(void) {
+    pthread_once(&cgroup_once, cgroup_load);
+    return &cgroup_limits;
+}
+
+/* The number of CPUs worth sizing threads by */
+static int available_cpus(void) {
+    return container_limits()->cpus;
+}
+
+/*
+ * Decoder threading profile, written by `vodtool autotune`. One line per codec and frame
+ * height says which threading was fastest on this machine:
+ *
+ *   codec=h264;height=1080;thread_type=frame;thread_count=4;latency_us=...
+ *
+ * It is only used when asked for, with --profile or $VODTOOL_PROFILE, and is read the first
+ * time a decoder is opened. autotune writes vodtool.profile unless told otherwise.
+ */
+#define DEFAULT_PROFILE "vodtool.profile"
+
+struct profile_entry {
+    char codec[32];
+    int height;
+    int thread_type;
+    int thread_count;
+};
+
+static struct profile_entry* profile_entries;
+static int nb_profile_entries;
+static pthread_once_t profile_once = PTHREAD_ONCE_INIT;
+/* Set by --profile */
+static const char* profile_path;
+
+/* The profile asked for, or NULL */
+static const char* profile_filename(void) {
+    const char* filename = getenv("VODTOOL_PROFILE");
+
+    return profile_path ? profile_path : filename && *filename ? filename : NULL;
+}
+
+static void profile_load(void) {
+    const char* filename = profile_filename();
+    char line[256];
+    FILE* f;
+
+    if (!filename) {
+        return;
+    }
+    if (!(f = fopen(filename, "r"))) {
+        fprintf(stderr, "Could not read decoder profile %s: %s\n", filename, strerror(errno));
+        return;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        struct profile_entry entry;
+        struct profile_entry* entries;
+        char type[16];
+
+        if (sscanf(line, "codec=%31[^;];height=%d;thread_type=%15[^;];thread_count=%d", entry.codec, &entry.height,
+                   type, &entry.thread_count) != 4 || entry.thread_count < 1 ||
+            (strcmp(type, "frame") && strcmp(type, "slice"))) {
+            continue;
+        }
+        entry.thread_type = !strcmp(type, "frame") ? FF_THREAD_FRAME : FF_THREAD_SLICE;
+        if (!(entries = realloc(profile_entries, (nb_profile_entries + 1) * sizeof(*entries)))) {
+            break;
+        }
+        profile_entries = entries;
+        profile_entries[nb_profile_entries++] = entry;
+    }
+    fclose(f);
+    fprintf(stderr, "Loaded %d decoder profiles from %s\n", nb_profile_entries, filename);
+}
+
+/**
+ * The profile entry for the codec with the closest frame height, or NULL.
+ */
+static const struct profile_entry* profile_lookup(const AVCodec* codec, int height) {
+    const struct profile_entry* best = NULL;
+
+    pthread_once(&profile_once, profile_load);
+    for (int i = 0; i < nb_profile_entries; i++) {
+        const struct profile_entry* entry = &profile_entries[i];
+
+        if (!strcmp(entry->codec, codec->name) && (!best || abs(entry->height - height) < abs(best->height - height))) {
+            best = entry;
+        }
+    }
+    return best;
+}
+
+/**
+ * Pick the decoder threading configuration. The profile's choice is taken when there is one
+ * and it fits the budget; otherwise, without a budget the decoder picks its own. With one,
+ * frame threading is scaled back and then replaced with slice threading until the estimated
+ * frame pool fits in what is left of the budget.
+ */
+static int configure_decoder_threads(AVCodecContext* dec_ctx, const AVCodec* codec,
+                                     struct mem_budget* budget) {
+    int64_t available = budget->limit - atomic_load(&budget->used);
+    int threads = available_cpus();
+    const struct profile_entry* profile = profile_lookup(codec, dec_ctx->height);
+
+    if (profile && (!budget->limit || estimate_decoder_memory(dec_ctx, profile->thread_type == FF_THREAD_FRAME ?
+                                                              profile->thread_count : 1) <= available)) {
+        dec_ctx->thread_type = profile->thread_type;
+        dec_ctx->thread_count = FFMIN(profile->thread_count, threads);
+        return 0;
+    }
+
+    if (!budget->limit) {
+        return 0;
+    }
+
+    if (codec->capabilities & AV_CODEC_CAP_FRAME_THREADS) {
+        for (int n = threads; n > 1; n /= 2) {
+            if (estimate_decoder_memory(dec_ctx, n) <= available) {
+                dec_ctx->thread_type = FF_THREAD_FRAME;
+                dec_ctx->thread_count = n;
+                return 0;
+            }
+        }
+    }
+
+    if (estimate_decoder_memory(dec_ctx, 1) <= available) {
+        dec_ctx->thread_type = FF_THREAD_SLICE;
+        dec_ctx->thread_count = threads;
+        return 0;
+    }
+
+    return AVERROR(ENOMEM);
+}
+
+#define FNV1A_INIT 14695981039346656037ULL
+
+static uint64_t fnv1a(const void* data, size_t size, uint64_t hash) {
+    const uint8_t* bytes = data;
+
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+/*
+ * Decoder pool. Opening a decoder starts its threads and allocates its tables, so opened
+ * contexts are kept between server requests for inputs with the same parameters. Like the
+ * input cache, only idle contexts are held; a request checks one out and flushes it on the
+ * way back.
+ */
+
+struct decoder_key {
+    enum AVCodecID codec_id;
+    int width;
+    int height;
+    int pix_fmt;
+    int thread_type;
+    int thread_count;
+    uint64_t extradata_hash;
+};
+
+struct decoder_entry {
+    struct decoder_key key;
+    AVCodecContext* ctx;
+    struct decoder_entry* prev;
+    struct decoder_entry* next;
+};
+
+struct decoder_pool {
+    pthread_mutex_t lock;
+    int max_entries;
+
+    /* Most recently used first */
+    struct decoder_entry* head;
+    struct decoder_entry* tail;
+    int entries;
+
+    atomic_uint_fast64_t hits;
+    atomic_uint_fast64_t misses;
+    atomic_uint_fast64_t evictions;
+};
+
+static void free_decoder(AVCodecContext** ctx) {
+    if (avcodec_is_open(*ctx)) {
+        metrics_count(METRIC_ACTIVE_DECODERS, -1);
+    }
+    avcodec_free_context(ctx);
+}
+
+/**
+ * Key for a configured, unopened decoder context. Everything that decides how the decoder
+ * is set up when it is opened must be in here.
+ */
+static void decoder_key_init(struct decoder_key* key, const AVCodecContext* ctx) {
+    /* Zeroed so that the padding compares equal too */
+    memset(key, 0, sizeof(*key));
+    key->codec_id = ctx->codec_id;
+    key->width = ctx->width;
+    key->height = ctx->height;
+    key->pix_fmt = ctx->pix_fmt;
+    key->thread_type = ctx->thread_type;
+    key->thread_count = ctx->thread_count;
+    key->extradata_hash = fnv1a(ctx->extradata, ctx->extradata_size, FNV1A_INIT);
+}
+
+/**
+ * Take an entry out of the pool. Called with the lock held.
+ */
+static void decoder_pool_unlink(struct decoder_pool* pool, struct decoder_entry* entry) {
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        pool->head = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        pool->tail = entry->prev;
+    }
+    pool->entries--;
+}
+
+/**
+ * Check out an idle decoder matching key, or NULL if there is none.
+ */
+static struct decoder_entry* decoder_pool_get(struct decoder_pool* pool, const struct decoder_key* key) {
+    struct decoder_entry* entry;
+
+    pthread_mutex_lock(&pool->lock);
+    for (entry = pool->head; entry; entry = entry->next) {
+        if (!memcmp(&entry->key, key, sizeof(*key))) {
+            decoder_pool_unlink(pool, entry);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    atomic_fetch_add(entry ? &pool->hits : &pool->misses, 1);
+    metrics_count(entry ? METRIC_DECODER_POOL_HITS : METRIC_DECODER_POOL_MISSES, 1);
+    return entry;
+}
+
+/**
+ * Return a checked out decoder. It is flushed and pooled if reuse is set, freed otherwise;
+ * the least recently used decoder makes way if the pool is full.
+ */
+static void decoder_pool_release(struct decoder_pool* pool, struct decoder_entry* entry, int reuse) {
+    struct decoder_entry* evicted = NULL;
+
+    if (!reuse || !pool->max_entries) {
+        free_decoder(&entry->ctx);
+        free(entry);
+        return;
+    }
+
+    /* Drops the references the decoder holds on frames of the finished request */
+    avcodec_flush_buffers(entry->ctx);
+    entry->ctx->opaque = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    entry->prev = NULL;
+    entry->next = pool->head;
+    if (pool->head) {
+        pool->head->prev = entry;
+    } else {
+        pool->tail = entry;
+    }
+    pool->head = entry;
+    if (++pool->entries > pool->max_entries) {
+        evicted = pool->tail;
+        decoder_pool_unlink(pool, evicted);
+        atomic_fetch_add(&pool->evictions, 1);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (evicted) {
+        free_decoder(&evicted->ctx);
+        free(evicted);
+    }
+}
+
+static void decoder_pool_print_stats(struct decoder_pool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    fprintf(stderr, "decoder_pool_hits=%" PRIu64 ";decoder_pool_misses=%" PRIu64 ";decoder_pool_evictions=%" PRIu64
+            ";decoder_pool_entries=%d\n",
+            (uint64_t)atomic_load(&pool->hits), (uint64_t)atomic_load(&pool->misses),
+            (uint64_t)atomic_load(&pool->evictions), pool->entries);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Long-only options */
+enum {
+    OPT_STATS = 256,
+    OPT_MEM_BUDGET,
+    OPT_HTTP,
+    OPT_UNIX,
+    OPT_ROOT,
+    OPT_WORKERS,
+    OPT_DEADLINE,
+    OPT_CACHE_ENTRIES,
+    OPT_CACHE_SIZE,
+    OPT_DECODERS,
+    OPT_PROCESSES,
+    OPT_SHM_CACHE,
+    OPT_TRACE,
+    OPT_PERF_COUNTERS,
+    OPT_NUMA,
+    OPT_NUMA_NODE,
+    OPT_BEST_NEAR,
+    OPT_WINDOW,
+    OPT_CROP,
+    OPT_PROFILE,
+};
 
 static void usage(char* cmd_name) {
     fprintf(stderr, "usage: %s [options] infile\n", cmd_name);
+    fprintf(stderr, "       %s serve [--http [host]:port] [--unix path] [options]\n", cmd_name);
+    fprintf(stderr, "       %s costmap [-d duration] [-t timescale] infile\n", cmd_name);
+    fprintf(stderr, "       %s autotune [-o profile] [-n samples] file...\n", cmd_name);
+    fprintf(stderr, "       %s thumbnails [-e seconds] [--keyframes] [-j jobs] [-o prefix] [--crop w:h:x:y|detect] [--stats] infile\n", cmd_name);
+    fprintf(stderr, "       %s scenes [--keyframes] [-T threshold] [--stats] infile\n", cmd_name);
+    fprintf(stderr, "       %s cropdetect [-n samples] [-l limit] [--stats] infile\n", cmd_name);
+    fprintf(stderr, "       %s detect [--black-min s] [--freeze-min s] [--black-ratio r] [--noise %%] [--stats] infile\n", cmd_name);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Extracts and transcodes the specified segment");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "\t-d, --duration\tThe duration in timescale units of each segment.\tDefault Value: 5\n");
+    fprintf(stderr, "\t-t, --timescale\tThe number of units in a second.\tDefault Value: 1\n");
+    fprintf(stderr, "\t-s, --segment\tThe segment to fetch.\tDefault Value:0\n");
+    fprintf(stderr, "\t    --mem-budget\tMemory budget for the request in MiB, more than 0.\tDefault Value: none\n");
+    fprintf(stderr, "\t    --stats\tPrint request counters when done.\n");
+    fprintf(stderr, "\t    --trace\tWrite a Chrome trace of the request to the given file.\n");
+    fprintf(stderr, "\t    --perf-counters\tPrint hardware performance counters for each phase of the request.\n");
+    fprintf(stderr, "\t    --numa-node\tRun on the given NUMA node's CPUs and memory.\n");
+    fprintf(stderr, "\t    --best-near\tInstead of the segment's first frame, the best looking frame near this time in seconds.\n");
+    fprintf(stderr, "\t    --window\tSeconds around --best-near to look at key frames in, more than 0.\tDefault Value: 2\n");
+    fprintf(stderr, "\t    --crop\tCrop the frame to w:h:x:y, or to what cropdetect finds with \"detect\".\n");
+    fprintf(stderr, "\t    --profile\tDecoder threading profile written by autotune.\tDefault Value: $VODTOOL_PROFILE, or none\n");
+    fprintf(stderr, "Serve options:\n");
+    fprintf(stderr, "\t    --http\tThe address to listen on for HTTP.\n");
+    fprintf(stderr, "\t    --unix\tThe Unix socket to listen on for binary RPC.\n");
+    fprintf(stderr, "\t    --root\tThe directory assets are served from.\tDefault Value: .\n");
+    fprintf(stderr, "\t    --workers\tThe number of decode workers.\tDefault Value: number of CPUs, or the container's CPU quota\n");
+    fprintf(stderr, "\t    --deadline\tMilliseconds a request may take before it is shed, 0 for none.\tDefault Value: 0\n");
+    fprintf(stderr, "\t    --cache-entries\tThe number of idle opened inputs to keep, 0 for none.\tDefault Value: 256\n");
+    fprintf(stderr, "\t    --cache-size\tMemory for idle opened inputs in MiB.\tDefault Value: 256, at most 1/8 of the container's memory\n");
+    fprintf(stderr, "\t    --decoders\tThe number of idle opened decoders to keep, 0 for none.\tDefault Value: --workers\n");
+    fprintf(stderr, "\t    --processes\tThe number of worker processes, each with --workers decode workers.\tDefault Value: 1\n");
+    fprintf(stderr, "\t    --shm-cache\tShared response cache in MiB, 0 for none.\tDefault Value: 64, at most 1/16 of the container's memory\n");
+    fprintf(stderr, "\t    --numa\tBind each process to a NUMA node, with at least one process per node.\n");
+    fprintf(stderr, "\t-d, -t and --mem-budget apply to every request. In a container, --mem-budget defaults to\n");
+    fprintf(stderr, "\thalf its memory shared by the workers of all processes.\n");
+
+    exit(1);
+}
+
+/**
+ * Parses a --mem-budget in MiB into bytes. Anything but a positive whole number exits, as a
+ * negative value would otherwise read as "not set" and garbage as no budget at all.
+ */
+static int64_t parse_mem_budget(const char* arg) {
+    long long mib;
+    char* end;
+
+    errno = 0;
+    mib = strtoll(arg, &end, 10);
+    if (end == arg || *end || errno || mib <= 0 || mib > INT64_MAX >> 20) {
+        fprintf(stderr, "Invalid --mem-budget %s: expected a positive number of MiB\n", arg);
+        exit(1);
+    }
+
+    return (int64_t)mib << 20;
+}
+
+static int open_input_file(AVFormatContext** ctx, const char* filename, struct mem_budget* budget,
+                           const AVIOInterruptCB* interrupt_callback) {
+    AVDictionary* options = NULL;
+    int64_t probesize = 0;
+    int64_t start;
+    int ret;
+
+    /* The callback has to be in place before the first read */
+    if (interrupt_callback) {
+        if (!(*ctx = avformat_alloc_context())) {
+            return AVERROR(ENOMEM);
+        }
+        (*ctx)->interrupt_callback = *interrupt_callback;
+    }
+
+    /* Bound how much the demuxer reads ahead while probing; the charge covers its queue too */
+    if (budget->limit) {
+        probesize = FFMAX(budget->limit / BUDGET_PROBESIZE_SHARE, 4096);
+        if ((ret = mem_budget_charge(budget, probesize)) < 0) {
+            fprintf(stderr, "Memory budget of %" PRId64 " bytes too small to open %s\n", budget->limit, filename);
+            avformat_free_context(*ctx);
+            *ctx = NULL;
+            return ret;
+        }
+        av_dict_set_int(&options, "probesize", probesize, 0);
+    }
+
+    PROBE1(open__start, filename);
+    start = av_gettime_relative();
+    ret = avformat_open_input(ctx, filename, NULL, &options);
+    av_dict_free(&options);
+    if(ret < 0) {
+        fprintf(stderr, "Could not open %s: %s\n", filename, av_err2str(ret));
+        mem_budget_release(budget, probesize);
+        PROBE2(open__done, filename, ret);
+        return ret;
+    }
+    metrics_observe_since(HIST_OPEN, start);
+    perf_phase(PERF_OPEN, 0);
+    if (trace) {
+        trace_event("open", "io", start, NULL);
+    }
+
+    start = av_gettime_relative();
+    if((ret = avformat_find_stream_info(*ctx, NULL)) < 0) {
+        fprintf(stderr, "Could not find codec parameters for %s: %s\n", filename, av_err2str(ret));
+        avformat_close_input(ctx);
+        mem_budget_release(budget, probesize);
+        PROBE2(open__done, filename, ret);
+        return ret;
+    }
+    metrics_observe_since(HIST_PROBE, start);
+    perf_phase(PERF_PROBE, 0);
+    if (trace) {
+        trace_event("probe", "io", start, "\"streams\":%u", (*ctx)->nb_streams);
+    }
+    metrics_count(METRIC_ACTIVE_INPUTS, 1);
+    PROBE2(open__done, filename, 0);
+
+    return 0;
+}
+
+static void close_input_file(AVFormatContext** ctx) {
+    if (*ctx) {
+        metrics_count(METRIC_ACTIVE_INPUTS, -1);
+        avformat_close_input(ctx);
+    }
+}
+
+/*
+ * Input cache. Opened inputs are kept after a request so that the next request for the same
+ * file skips opening and probing it. An entry is checked out exclusively while a request uses
+ * it, so the cache only holds idle contexts; popular files can have several.
+ */
+
+#define INPUT_CACHE_BUCKETS 1024
+
+struct input_entry {
+    char* path;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    AVFormatContext* ctx;
+    size_t size;
+    /* The interrupt callback of the request that has the entry checked out, if any */
+    AVIOInterruptCB interrupt;
+
+    struct input_entry* hash_next;
+    struct input_entry* lru_prev;
+    struct input_entry* lru_next;
+};
+
+struct input_cache {
+    pthread_mutex_t lock;
+    int max_entries;
+    size_t max_size;
+
+    struct input_entry* buckets[INPUT_CACHE_BUCKETS];
+    /* Most recently used first */
+    struct input_entry* lru_head;
+    struct input_entry* lru_tail;
+    int entries;
+    size_t size;
+
+    atomic_uint_fast64_t hits;
+    atomic_uint_fast64_t misses;
+    atomic_uint_fast64_t evictions;
+};
+
+static unsigned input_cache_hash(const char* path) {
+    unsigned hash = 5381;
+
+    while (*path) {
+        hash = hash * 33 + (unsigned char)*path++;
+    }
+    return hash % INPUT_CACHE_BUCKETS;
+}
+
+/**
+ * Rough memory held by an opened input: the IO buffer plus what probing and indexing left
+ * attached to the streams.
+ */
+static size_t input_size(const AVFormatContext* ctx) {
+    size_t size = sizeof(*ctx);
+
+    if (ctx->pb) {
+        size += sizeof(*ctx->pb) + ctx->pb->buffer_size;
+    }
+    for (int i = 0; i < ctx->nb_streams; i++) {
+        const AVStream* st = ctx->streams[i];
+
+        size += sizeof(*st) + sizeof(*st->codecpar) + st->codecpar->extradata_size +
+                st->nb_index_entries * sizeof(AVIndexEntry);
+    }
+    return size;
+}
+
+static void input_entry_free(struct input_entry* entry) {
+    close_input_file(&entry->ctx);
+    free(entry->path);
+    free(entry);
+}
+
+/**
+ * Take an entry out of the cache. Called with the lock held.
+ */
+static void input_cache_unlink(struct input_cache* cache, struct input_entry* entry) {
+    struct input_entry** link = &cache->buckets[input_cache_hash(entry->path)];
+
+    while (*link != entry) {
+        link = &(*link)->hash_next;
+    }
+    *link = entry->hash_next;
+
+    if (entry->lru_prev) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        cache->lru_head = entry->lru_next;
+    }
+    if (entry->lru_next) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        cache->lru_tail = entry->lru_prev;
+    }
+
+    cache->entries--;
+    cache->size -= entry->size;
+}
+
+/**
+ * Evict least recently used entries until at most max_entries and max_size are held. The
+ * contexts are closed after the lock is dropped.
+ */
+static void input_cache_trim(struct input_cache* cache, int max_entries, size_t max_size) {
+    struct input_entry* evicted = NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    while (cache->lru_tail && (cache->entries > max_entries || cache->size > max_size)) {
+        struct input_entry* entry = cache->lru_tail;
+
+        input_cache_unlink(cache, entry);
+        entry->hash_next = evicted;
+        evicted = entry;
+        atomic_fetch_add(&cache->evictions, 1);
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    while (evicted) {
+        struct input_entry* next = evicted->hash_next;
+
+        input_entry_free(evicted);
+        evicted = next;
+    }
+}
+
+/**
+ * The interrupt callback of cached inputs. The IO and protocol contexts keep their own copy
+ * of the callback they were opened with, so it has to stay valid for as long as the entry
+ * does; it forwards to whichever request has the entry checked out.
+ */
+static int input_entry_interrupt(void* opaque) {
+    struct input_entry* entry = opaque;
+
+    return entry->interrupt.callback ? entry->interrupt.callback(entry->interrupt.opaque) : 0;
+}
+
+/**
+ * Check out an opened input for filename, from the cache if an entry for the same file
+ * (path, inode and modification time) is idle, otherwise by opening it. Entries for an older
+ * version of the file are dropped on the way. Returns 1 for a cached entry, 0 for a new one.
+ */
+static int input_cache_open(struct input_cache* cache, const char* filename, struct mem_budget* budget,
+                            const AVIOInterruptCB* interrupt_callback, struct input_entry** entry_out) {
+    struct input_entry* entry = NULL;
+    struct input_entry* stale = NULL;
+    struct input_entry** link;
+    struct stat st;
+    int ret;
+
+    if (stat(filename, &st) < 0) {
+        ret = AVERROR(errno);
+        fprintf(stderr, "Could not open %s: %s\n", filename, av_err2str(ret));
+        return ret;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    for (link = &cache->buckets[input_cache_hash(filename)]; *link; ) {
+        struct input_entry* candidate = *link;
+
+        if (strcmp(candidate->path, filename)) {
+            link = &candidate->hash_next;
+        } else if (candidate->dev != st.st_dev || candidate->ino != st.st_ino ||
+                   candidate->mtime.tv_sec != st.st_mtim.tv_sec || candidate->mtime.tv_nsec != st.st_mtim.tv_nsec) {
+            input_cache_unlink(cache, candidate);
+            candidate->hash_next = stale;
+            stale = candidate;
+            atomic_fetch_add(&cache->evictions, 1);
+        } else {
+            input_cache_unlink(cache, candidate);
+            entry = candidate;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    while (stale) {
+        struct input_entry* next = stale->hash_next;
+
+        input_entry_free(stale);
+        stale = next;
+    }
+
+    if (entry) {
+        atomic_fetch_add(&cache->hits, 1);
+        metrics_count(METRIC_INPUT_CACHE_HITS, 1);
+        for (int i = 0; i < entry->ctx->nb_streams; i++) {
+            entry->ctx->streams[i]->discard = AVDISCARD_DEFAULT;
+        }
+        entry->interrupt = interrupt_callback ? *interrupt_callback : (AVIOInterruptCB){0};
+        *entry_out = entry;
+        return 1;
+    }
+
+    atomic_fetch_add(&cache->misses, 1);
+    metrics_count(METRIC_INPUT_CACHE_MISSES, 1);
+    if (!(entry = calloc(1, sizeof(*entry))) || !(entry->path = strdup(filename))) {
+        free(entry);
+        return AVERROR(ENOMEM);
+    }
+    entry->dev = st.st_dev;
+    entry->ino = st.st_ino;
+    entry->mtime = st.st_mtim;
+    entry->interrupt = interrupt_callback ? *interrupt_callback : (AVIOInterruptCB){0};
+
+    ret = open_input_file(&entry->ctx, filename, budget, &(AVIOInterruptCB){ input_entry_interrupt, entry });
+    if (ret == AVERROR(EMFILE) || ret == AVERROR(ENFILE)) {
+        /* Out of descriptors: give back the idle ones and try once more */
+        input_cache_trim(cache, 0, 0);
+        ret = open_input_file(&entry->ctx, filename, budget, &(AVIOInterruptCB){ input_entry_interrupt, entry });
+    }
+    if (ret < 0) {
+        free(entry->path);
+        free(entry);
+        return ret;
+    }
+
+    *entry_out = entry;
+    return 0;
+}
+
+/**
+ * Return a checked out entry. It is cached if reuse is set, closed otherwise.
+ */
+static void input_cache_release(struct input_cache* cache, struct input_entry* entry, int reuse) {
+    struct input_entry** bucket;
+
+    if (!reuse || !cache->max_entries) {
+        input_entry_free(entry);
+        return;
+    }
+
+    entry->interrupt = (AVIOInterruptCB){0};
+    entry->size = input_size(entry->ctx);
+
+    pthread_mutex_lock(&cache->lock);
+    bucket = &cache->buckets[input_cache_hash(entry->path)];
+    entry->hash_next = *bucket;
+    *bucket = entry;
+    entry->lru_prev = NULL;
+    entry->lru_next = cache->lru_head;
+    if (cache->lru_head) {
+        cache->lru_head->lru_prev = entry;
+    } else {
+        cache->lru_tail = entry;
+    }
+    cache->lru_head = entry;
+    cache->entries++;
+    cache->size += entry->size;
+    pthread_mutex_unlock(&cache->lock);
+
+    input_cache_trim(cache, cache->max_entries, cache->max_size);
+}
+
+static void input_cache_print_stats(struct input_cache* cache) {
+    pthread_mutex_lock(&cache->lock);
+    fprintf(stderr, "input_cache_hits=%" PRIu64 ";input_cache_misses=%" PRIu64 ";input_cache_evictions=%" PRIu64
+            ";input_cache_entries=%d;input_cache_size=%zu\n",
+            (uint64_t)atomic_load(&cache->hits), (uint64_t)atomic_load(&cache->misses),
+            (uint64_t)atomic_load(&cache->evictions), cache->entries, cache->size);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+static int find_best_stream(AVFormatContext* ctx, enum AVMediaType type) {
+    int best_stream;
+
+    best_stream = av_find_best_stream(ctx, type, -1, -1, NULL, 0);
+    if (best_stream < 0) {
+        fprintf(stderr, "Could not find stream of type %s\n", av_get_media_type_string(type));
+    }
+
+    return best_stream;
+}
+
+/**
+ * Seek to the specified timestamp. This will seek to the closest key frame that is before or
+ * equal to the specified timestamp.
+ *
+ * The timestamp is in AV_TIME_BASE units
+ */
+static int seek_to_timestamp(AVFormatContext* ctx, int64_t max_timestamp) {
+    int64_t start = av_gettime_relative();
+    int ret;
+
+    PROBE1(seek__start, max_timestamp);
+    if((ret = avformat_seek_file(ctx, -1, 0, max_timestamp, max_timestamp, 0)) < 0) {
+        fprintf(stderr, "Could not seek\n");
+    }
+    PROBE2(seek__done, max_timestamp, ret);
+    metrics_observe_since(HIST_SEEK, start);
+    perf_phase(PERF_SEEK, 0);
+    if (trace) {
+        trace_event("seek", "io", start, "\"target\":%" PRId64 ",\"ret\":%d", max_timestamp, ret);
+    }
+
+    return ret;
+}
+
+/**
+ * Convert frame the specified timebase to AV_TIME_BASE
+ */
+static inline int64_t to_av_timebase(int64_t timestamp, AVRational timebase) {
+    return av_rescale_q(timestamp, timebase, (AVRational){1, AV_TIME_BASE});
+}
+
+
+static void print_stats(const struct request_stats* stats) {
+    fprintf(stderr, "packets_read=%" PRId64 ";packets_decoded=%" PRId64 ";frames_decoded=%" PRId64 ";mem_peak=%" PRId64
+            ";bytes_read=%" PRId64,
+            stats->packets_read, stats->packets_decoded, stats->frames_decoded, stats->mem_peak, stats->bytes_read);
+#ifdef ALLOC_STATS
+    fprintf(stderr, ";allocs_setup=%" PRIu64 ";allocs_loop=%" PRIu64 ";allocs_per_packet=%.3f",
+            stats->allocs_setup, stats->allocs_loop,
+            stats->packets_read ? (double)stats->allocs_loop / stats->packets_read : 0.0);
+#endif
     fprintf(stderr, "\n");
-    fprintf(stderr, "Extracts and transcodes the specified segment");
-    fprintf(stderr, "Options:\n");
-    fprintf(stderr, "\t-d, --duration\tThe duration in timescale units of each segment.\tDefault Value: 5\n");
-    fprintf(stderr, "\t-t, --timescale\tThe number of units in a second.\tDefault Value: 1\n");
-    fprintf(stderr, "\t-s, --segment\tThe segment to fetch.\tDefault Value:0\n");
+}
+
+static void pgm_save(unsigned char *buf, int wrap, int xsize, int ysize,
+                     char *filename)
+{
+    FILE *f;
+    int i;
+
+    f = fopen(filename,"w");
+    fprintf(f, "P5\n%d %d\n%d\n", xsize, ysize, 255);
+    for (i = 0; i < ysize; i++)
+        fwrite(buf + i * wrap, 1, xsize, f);
+    fclose(f);
+}
+
+/**
+ * Everything needed to serve one request against one input file.
+ */
+struct request {
+    struct request_stats stats;
+    struct mem_budget budget;
+    AVFormatContext* input_ctx;
+    AVCodecContext* dec_ctx;
+    struct frame_pool frame_pool;
+    AVPacket* packet;
+    int video_stream;
+    int audio_stream;
+    uint64_t alloc_mark;
+    /* input_ctx->pb->bytes_read when the request took the input over */
+    int64_t bytes_mark;
+    /* Timestamp of the last seek until the first packet after it has been read */
+    int64_t seek_target;
+
+    /* av_gettime_relative() time after which the request is abandoned, 0 for none */
+    int64_t deadline;
+    /* Expected decode time per frame in microseconds, used to plan against the deadline */
+    int64_t frame_cost;
+    /* Time spent in request_decode_frame() */
+    int64_t decode_time;
+
+    /*
+     * Called between packets to let more urgent work run on this thread. Returns nonzero if
+     * it ran anything; that time is counted in preempted rather than against the request.
+     */
+    int (*preempt)(void* opaque);
+    void* preempt_opaque;
+    int64_t preempted;
+
+    /* Where the input and decoder come from and go back to when set */
+    struct input_cache* input_cache;
+    struct input_entry* input_entry;
+    struct decoder_pool* decoder_pool;
+    struct decoder_entry* decoder_entry;
+    /* Set when the input and decoder are in a state the next request can start from */
+    int reusable;
+
+    /* Decoder threading to use instead of the profile's or the decoder's choice, if set */
+    int thread_type;
+    int thread_count;
+};
+
+static int request_interrupt(void* opaque) {
+    struct request* req = opaque;
+
+    return req->deadline && av_gettime_relative() > req->deadline;
+}
+
+/**
+ * Returns AVERROR(ETIMEDOUT) once the request's deadline has passed. Checked once per packet
+ * by the read loops; the demuxer checks the same condition through its interrupt callback.
+ */
+static int request_check_deadline(struct request* req) {
+    if (request_interrupt(req)) {
+        fprintf(stderr, "Deadline exceeded\n");
+        return AVERROR(ETIMEDOUT);
+    }
+    return 0;
+}
+
+/**
+ * Timestamp of a packet in AV_TIME_BASE units, falling back to the dts.
+ */
+static int64_t packet_timestamp(AVStream* st, AVPacket* packet) {
+    int64_t ts = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+
+    return ts == AV_NOPTS_VALUE ? AV_NOPTS_VALUE : to_av_timebase(ts, st->time_base);
+}
+
+/**
+ * av_read_frame() for the read loops, failing with AVERROR(ETIMEDOUT) once the deadline has
+ * passed, whether noticed here or by the demuxer. This is also where the request yields to
+ * preempting work.
+ */
+static int request_read_frame(struct request* req, AVPacket* packet) {
+    int64_t start;
+    int ret;
+
+    if (req->preempt) {
+        start = av_gettime_relative();
+        if (req->preempt(req->preempt_opaque)) {
+            req->preempted += av_gettime_relative() - start;
+        }
+    }
+
+    if ((ret = request_check_deadline(req)) < 0) {
+        return ret;
+    }
+    start = trace_now();
+    if ((ret = av_read_frame(req->input_ctx, packet)) == AVERROR_EXIT) {
+        return request_check_deadline(req) < 0 ? AVERROR(ETIMEDOUT) : ret;
+    }
+    if (ret >= 0) {
+        PROBE4(packet__read, packet->stream_index, packet->size, packet->flags, packet->pts);
+        if (trace) {
+            trace_event("read", "io", start, "\"stream\":%d,\"size\":%d,\"key\":%d,\"pts\":%" PRId64,
+                        packet->stream_index, packet->size, !!(packet->flags & AV_PKT_FLAG_KEY), packet->pts);
+        }
+        if (req->seek_target != AV_NOPTS_VALUE) {
+            PROBE2(seek__landed, req->seek_target,
+                   packet_timestamp(req->input_ctx->streams[packet->stream_index], packet));
+            req->seek_target = AV_NOPTS_VALUE;
+        }
+    }
+    return ret;
+}
+
+/**
+ * Where a frame request lands: the key frame the seek goes to and how many frames have to be
+ * decoded from it to reach the target. Uses the demuxer's index; without one the target is
+ * assumed to be a key frame.
+ */
+struct seek_plan {
+    int64_t keyframe;
+    int64_t decode_frames;
+};
+
+static void plan_seek(struct request* req, int64_t timestamp, struct seek_plan* plan) {
+    AVStream* st = req->input_ctx->streams[req->video_stream];
+    int index = av_index_search_timestamp(st, av_rescale_q(timestamp, AV_TIME_BASE_Q, st->time_base),
+                                          AVSEEK_FLAG_BACKWARD);
+
+    plan->keyframe = timestamp;
+    plan->decode_frames = 1;
+
+    if (index >= 0) {
+        plan->keyframe = to_av_timebase(st->index_entries[index].timestamp, st->time_base);
+    }
+    if (st->avg_frame_rate.num && st->avg_frame_rate.den && plan->keyframe < timestamp) {
+        plan->decode_frames += av_rescale_q(timestamp - plan->keyframe, AV_TIME_BASE_Q, av_inv_q(st->avg_frame_rate));
+    }
+}
+
+/**
+ * Open the input and pick its streams. Streams that will not be read are discarded so the
+ * demuxer does not read and allocate packets that would be thrown away. Audio is optional and
+ * only kept when want_audio is set.
+ */
+static int request_open(struct request* req, const char* filename, int want_audio) {
+    AVIOInterruptCB interrupt_callback = { request_interrupt, req };
+    int ret;
+
+    req->alloc_mark = alloc_counter();
+    req->video_stream = -1;
+    req->audio_stream = -1;
+    req->seek_target = AV_NOPTS_VALUE;
+
+    if ((ret = request_check_deadline(req)) < 0) {
+        return ret;
+    }
+    if (req->input_cache) {
+        ret = input_cache_open(req->input_cache, filename, &req->budget, req->deadline ? &interrupt_callback : NULL,
+                               &req->input_entry);
+        if (ret >= 0) {
+            req->input_ctx = req->input_entry->ctx;
+        }
+    } else {
+        ret = open_input_file(&req->input_ctx, filename, &req->budget, req->deadline ? &interrupt_callback : NULL);
+    }
+    if (ret < 0) {
+        return request_interrupt(req) ? AVERROR(ETIMEDOUT) : ret;
+    }
+    /* Only what this request reads counts; a cached input has been read from before */
+    req->bytes_mark = ret > 0 && req->input_ctx->pb ? req->input_ctx->pb->bytes_read : 0;
+
+    if ((req->video_stream = find_best_stream(req->input_ctx, AVMEDIA_TYPE_VIDEO)) < 0) {
+        return req->video_stream;
+    }
+    if (want_audio) {
+        req->audio_stream = av_find_best_stream(req->input_ctx, AVMEDIA_TYPE_AUDIO, -1, req->video_stream, NULL, 0);
+        if (req->audio_stream < 0) {
+            req->audio_stream = -1;
+        }
+    }
+
+    for (int i = 0; i < req->input_ctx->nb_streams; i++) {
+        if (i != req->video_stream && i != req->audio_stream) {
+            req->input_ctx->streams[i]->discard = AVDISCARD_ALL;
+        }
+    }
+
+    /*
+     * A single packet is reused for every read. av_packet_unref() only drops the payload
+     * reference, so the read loops themselves do not allocate.
+     */
+    if (!(req->packet = av_packet_alloc())) {
+        fprintf(stderr, "Could not allocate packet\n");
+        return AVERROR(ENOMEM);
+    }
+
+    return 0;
+}
+
+static int request_open_decoder(struct request* req) {
+    AVStream* st = req->input_ctx->streams[req->video_stream];
+    AVCodec* codec;
+    int ret;
+
+    codec = avcodec_find_decoder(st->codecpar->codec_id);
+
+    if (!codec) {
+        fprintf(stderr, "Could not find decoder for %s\n", avcodec_get_name(st->codecpar->codec_id));
+        return AVERROR_DECODER_NOT_FOUND;
+    }
+
+    if (!(req->dec_ctx = avcodec_alloc_context3(codec))) {
+        return AVERROR(ENOMEM);
+    }
+
+    ret = avcodec_parameters_to_context(req->dec_ctx, st->codecpar);
+
+    if (ret < 0) {
+        return ret;
+    }
+
+    req->dec_ctx->framerate = st->avg_frame_rate;
+
+    if (req->thread_count) {
+        req->dec_ctx->thread_type = req->thread_type;
+        req->dec_ctx->thread_count = req->thread_count;
+    } else if ((ret = configure_decoder_threads(req->dec_ctx, codec, &req->budget)) < 0) {
+        fprintf(stderr, "Memory budget of %" PRId64 " bytes too small to decode %dx%d %s\n",
+                req->budget.limit, req->dec_ctx->width, req->dec_ctx->height, codec->name);
+        return ret;
+    }
+
+    /* A pooled decoder opened with the same configuration replaces the fresh one */
+    if (req->decoder_pool) {
+        struct decoder_key key;
+
+        decoder_key_init(&key, req->dec_ctx);
+        if ((req->decoder_entry = decoder_pool_get(req->decoder_pool, &key))) {
+            avcodec_free_context(&req->dec_ctx);
+            req->dec_ctx = req->decoder_entry->ctx;
+            req->dec_ctx->opaque = &req->frame_pool;
+            if ((ret = frame_pool_attach(&req->frame_pool, &req->budget)) < 0) {
+                return ret;
+            }
+            req->stats.allocs_setup = alloc_counter() - req->alloc_mark;
+            return 0;
+        }
+        if (!(req->decoder_entry = calloc(1, sizeof(*req->decoder_entry)))) {
+            return AVERROR(ENOMEM);
+        }
+        req->decoder_entry->key = key;
+        req->decoder_entry->ctx = req->dec_ctx;
+    }
+
+    if ((ret = frame_pool_attach(&req->frame_pool, &req->budget)) < 0) {
+        return ret;
+    }
+    req->dec_ctx->opaque = &req->frame_pool;
+    req->dec_ctx->get_buffer2 = frame_pool_get_buffer2;
+
+    ret = avcodec_open2(req->dec_ctx, codec, NULL);
+
+    if (ret < 0) {
+        fprintf(stderr, "Could not open input codec\n");
+        return ret;
+    }
+    metrics_count(METRIC_ACTIVE_DECODERS, 1);
+
+    req->stats.allocs_setup = alloc_counter() - req->alloc_mark;
+
+    return 0;
+}
+
+/**
+ * Release everything the request holds. Frames handed out by request_decode_frame() must be
+ * unreferenced first since their buffers are charged against the request's budget.
+ */
+static void request_close(struct request* req) {
+    if (req->decoder_entry) {
+        decoder_pool_release(req->decoder_pool, req->decoder_entry, req->reusable);
+        req->decoder_entry = NULL;
+        req->dec_ctx = NULL;
+    } else {
+        free_decoder(&req->dec_ctx);
+    }
+    frame_pool_detach(&req->frame_pool);
+    av_packet_free(&req->packet);
+    if (req->input_ctx && req->input_ctx->pb) {
+        req->stats.bytes_read = req->input_ctx->pb->bytes_read - req->bytes_mark;
+        metrics_observe(HIST_READ_BYTES, req->stats.bytes_read);
+    }
+    if (req->input_entry) {
+        input_cache_release(req->input_cache, req->input_entry, req->reusable);
+        req->input_entry = NULL;
+        req->input_ctx = NULL;
+    } else {
+        close_input_file(&req->input_ctx);
+    }
+    req->stats.mem_peak = atomic_load(&req->budget.peak);
+}
+
+static int decode_error(struct request* req, int ret, const char* what) {
+    if (atomic_load(&req->budget.exceeded)) {
+        fprintf(stderr, "Memory budget of %" PRId64 " bytes exceeded\n", req->budget.limit);
+        return AVERROR(ENOMEM);
+    }
+
+    fprintf(stderr, "%s: %s\n", what, av_err2str(ret));
+    return ret;
+}
+
+/**
+ * Decode from wherever the decoder is up to the first frame at or after timestamp, starting
+ * with the frames it already holds. decode_frame_at() seeks first; extracting several frames
+ * of one GOP calls this for the later ones and carries on where the last left off.
+ */
+static int decode_until(struct request* req, int64_t timestamp, AVFrame* frame) {
+    AVStream* st = req->input_ctx->streams[req->video_stream];
+    AVPacket* packet = req->packet;
+    uint64_t alloc_mark = alloc_counter();
+    int64_t start = av_gettime_relative();
+    int64_t call_start;
+    int ret;
+
+    for (;;) {
+        for (;;) {
+            call_start = trace_now();
+            ret = avcodec_receive_frame(req->dec_ctx, frame);
+            if (trace) {
+                trace_event("receive_frame", "decode", call_start, "\"type\":\"%c\",\"pts\":%" PRId64 ",\"ret\":%d",
+                            ret >= 0 ? av_get_picture_type_char(frame->pict_type) : '-',
+                            ret >= 0 ? frame->pts : AV_NOPTS_VALUE, ret);
+            }
+            if (ret < 0) {
+                break;
+            }
+            PROBE2(decode__receive, frame->pts, ret);
+            req->stats.frames_decoded++;
+            metrics_count(METRIC_FRAMES_DECODED, 1);
+            if (av_compare_ts(frame->pts, st->time_base, timestamp, (AVRational){1, AV_TIME_BASE}) >= 0) {
+                req->stats.allocs_loop += alloc_counter() - alloc_mark;
+                metrics_count(METRIC_FRAMES_RETURNED, 1);
+                metrics_observe_since(HIST_PREROLL, start);
+                perf_phase(PERF_DECODE, 1);
+                if (trace) {
+                    trace_event("preroll", "decode", start, "\"target\":%" PRId64 ",\"frames\":%" PRId64,
+                                timestamp, req->stats.frames_decoded);
+                }
+                return 0;
+            }
+            av_frame_unref(frame);
+            perf_phase(PERF_PREROLL, 1);
+        }
+
+        if (ret == AVERROR_EOF) {
+            fprintf(stderr, "No frame at or after timestamp=%" PRId64 "\n", timestamp);
+            return ret;
+        } else if (ret != AVERROR(EAGAIN)) {
+            return decode_error(req, ret, "Didn't get frame");
+        }
+
+        ret = request_read_frame(req, packet);
+        if (ret == AVERROR_EOF) {
+            /* Drain the frames still held by the decoder */
+            call_start = trace_now();
+            ret = avcodec_send_packet(req->dec_ctx, NULL);
+            PROBE2(decode__send, 0, ret);
+            if (trace) {
+                trace_event("send_packet", "decode", call_start, "\"flush\":1,\"ret\":%d", ret);
+            }
+        } else if (ret == AVERROR(ETIMEDOUT)) {
+            return ret;
+        } else if (ret < 0) {
+            fprintf(stderr, "Could not read frame: %s\n", av_err2str(ret));
+            return ret;
+        } else {
+            req->stats.packets_read++;
+
+            if (packet->stream_index != req->video_stream) {
+                av_packet_unref(packet);
+                continue;
+            }
+
+#ifdef DEBUG
+            fprintf(stderr, "packet pts=%" PRId64 ";dts=%" PRId64 "\n", packet->pts, packet->dts);
+#endif
+            call_start = trace_now();
+            ret = avcodec_send_packet(req->dec_ctx, packet);
+            PROBE2(decode__send, packet->size, ret);
+            if (trace) {
+                trace_event("send_packet", "decode", call_start, "\"size\":%d,\"key\":%d,\"pts\":%" PRId64 ",\"ret\":%d",
+                            packet->size, !!(packet->flags & AV_PKT_FLAG_KEY), packet->pts, ret);
+            }
+            av_packet_unref(packet);
+            req->stats.packets_decoded++;
+        }
+
+        if (ret < 0) {
+            return decode_error(req, ret, "Could not send packet");
+        }
+    }
+}
+
+static int decode_frame_at(struct request* req, int64_t timestamp, AVFrame* frame) {
+    int ret;
+
+    if ((ret = seek_to_timestamp(req->input_ctx, timestamp)) < 0) {
+        return ret;
+    }
+    req->seek_target = timestamp;
+    avcodec_flush_buffers(req->dec_ctx);
+
+    return decode_until(req, timestamp, frame);
+}
+
+/**
+ * Decode the first frame at or after timestamp (AV_TIME_BASE units) into frame. With a
+ * deadline, the request is given up before decoding anything when the seek plan says the
+ * pre-roll cannot finish in time.
+ */
+static int request_decode_frame(struct request* req, int64_t timestamp, AVFrame* frame) {
+    int64_t start = av_gettime_relative();
+    int64_t preempted = req->preempted;
+    struct seek_plan plan;
+    int ret;
+
+    if (req->deadline && req->frame_cost) {
+        plan_seek(req, timestamp, &plan);
+        if (start + plan.decode_frames * req->frame_cost > req->deadline) {
+            fprintf(stderr, "Deadline cannot be met: %" PRId64 " frames to decode\n", plan.decode_frames);
+            return AVERROR(ETIMEDOUT);
+        }
+    }
+
+    ret = decode_frame_at(req, timestamp, frame);
+    req->decode_time += av_gettime_relative() - start - (req->preempted - preempted);
+
+    return ret;
+}
+
+/*
+ * Whole-stream passes, which hand every frame they decode to a callback instead of looking
+ * for one. The keyframe-only pass is for thumbnail backfills. The decoder skips everything but key frames
+ * and, when the demuxer has an index, only key frame packets are read from the input: each
+ * is reached by a seek to its index entry, so the bytes between them are never fetched.
+ */
+typedef int (*frame_callback)(void* opaque, AVFrame* frame);
+
+static int receive_frames(struct request* req, AVFrame* frame, frame_callback fn, void* opaque) {
+    int ret;
+
+    while ((ret = avcodec_receive_frame(req->dec_ctx, frame)) >= 0) {
+        req->stats.frames_decoded++;
+        metrics_count(METRIC_FRAMES_DECODED, 1);
+        ret = fn(opaque, frame);
+        av_frame_unref(frame);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : decode_error(req, ret, "Didn't get frame");
+}
+
+static int decode_packet(struct request* req, AVPacket* packet, AVFrame* frame, frame_callback fn, void* opaque) {
+    int ret = avcodec_send_packet(req->dec_ctx, packet);
+
+    PROBE2(decode__send, packet ? packet->size : 0, ret);
+    if (packet) {
+        av_packet_unref(packet);
+        req->stats.packets_decoded++;
+    }
+    if (ret < 0) {
+        return decode_error(req, ret, "Could not send packet");
+    }
+
+    return receive_frames(req, frame, fn, opaque);
+}
+
+/**
+ * Decode the key frames of the video stream, at most one every interval (AV_TIME_BASE
+ * units, 0 for all of them), and pass each to fn. Leaves the input and decoder unusable for
+ * other requests.
+ */
+static int request_decode_keyframes(struct request* req, int64_t interval, frame_callback fn, void* opaque) {
+    AVStream* st = req->input_ctx->streams[req->video_stream];
+    AVPacket* packet = req->packet;
+    AVFrame* frame = av_frame_alloc();
+    int64_t next = INT64_MIN;
+    int ret = 0;
+
+    if (!frame) {
+        return AVERROR(ENOMEM);
+    }
+    req->reusable = 0;
+    req->dec_ctx->skip_frame = AVDISCARD_NONKEY;
+    st->discard = AVDISCARD_NONKEY;
+
+    if (st->nb_index_entries > 0) {
+        for (int i = 0; i < st->nb_index_entries && ret >= 0; i++) {
+            const AVIndexEntry* entry = &st->index_entries[i];
+            int64_t ts = to_av_timebase(entry->timestamp, st->time_base);
+
+            if (!(entry->flags & AVINDEX_KEYFRAME) || ts < next) {
+                continue;
+            }
+            next = ts + FFMAX(interval, 1);
+
+            if ((ret = av_seek_frame(req->input_ctx, req->video_stream, entry->timestamp, AVSEEK_FLAG_BACKWARD)) < 0) {
+                fprintf(stderr, "Could not seek to key frame at %" PRId64 ": %s\n", ts, av_err2str(ret));
+                break;
+            }
+            req->seek_target = ts;
+            while ((ret = request_read_frame(req, packet)) >= 0 && packet->stream_index != req->video_stream) {
+                req->stats.packets_read++;
+                av_packet_unref(packet);
+            }
+            if (ret == AVERROR_EOF) {
+                ret = 0;
+                break;
+            } else if (ret < 0) {
+                break;
+            }
+            req->stats.packets_read++;
+            ret = decode_packet(req, packet, frame, fn, opaque);
+        }
+    } else {
+        /* Without an index every packet has to be read; only key frames are decoded */
+        while (ret >= 0 && (ret = request_read_frame(req, packet)) >= 0) {
+            int64_t ts = packet_timestamp(st, packet);
+
+            req->stats.packets_read++;
+            if (packet->stream_index != req->video_stream || !(packet->flags & AV_PKT_FLAG_KEY) ||
+                (ts != AV_NOPTS_VALUE && ts < next)) {
+                av_packet_unref(packet);
+                continue;
+            }
+            if (ts != AV_NOPTS_VALUE) {
+                next = ts + FFMAX(interval, 1);
+            }
+            ret = decode_packet(req, packet, frame, fn, opaque);
+        }
+        if (ret == AVERROR_EOF) {
+            ret = 0;
+        }
+    }
+
+    /* Key frames still held by the decoder */
+    if (ret >= 0) {
+        ret = decode_packet(req, NULL, frame, fn, opaque);
+    }
+
+    av_frame_free(&frame);
+    return ret;
+}
+
+/**
+ * Decode every frame of the video stream in order and pass each to fn.
+ */
+static int request_decode_all(struct request* req, frame_callback fn, void* opaque) {
+    AVPacket* packet = req->packet;
+    AVFrame* frame = av_frame_alloc();
+    int ret = 0;
+
+    if (!frame) {
+        return AVERROR(ENOMEM);
+    }
+
+    while (ret >= 0 && (ret = request_read_frame(req, packet)) >= 0) {
+        req->stats.packets_read++;
+        if (packet->stream_index != req->video_stream) {
+            av_packet_unref(packet);
+            continue;
+        }
+        ret = decode_packet(req, packet, frame, fn, opaque);
+    }
+    if (ret == AVERROR_EOF) {
+        ret = decode_packet(req, NULL, frame, fn, opaque);
+    }
+
+    av_frame_free(&frame);
+    return ret;
+}
+
+/**
+ * Growable output buffer, charged against the request's memory budget.
+ */
+struct out_buffer {
+    uint8_t* data;
+    size_t len;
+    size_t size;
+    struct mem_budget* budget;
+};
+
+#define OUT_BUFFER_MIN_SIZE (64 * 1024)
+#define IO_BUFFER_SIZE (32 * 1024)
+
+static int out_buffer_append(struct out_buffer* out, const uint8_t* buf, size_t size) {
+    if (out->len + size > out->size) {
+        size_t new_size = FFMAX(FFMAX(out->size * 2, out->len + size), OUT_BUFFER_MIN_SIZE);
+        uint8_t* data;
+
+        if (out->budget && mem_budget_charge(out->budget, new_size - out->size) < 0) {
+            return AVERROR(ENOMEM);
+        }
+        if (!(data = realloc(out->data, new_size))) {
+            if (out->budget) {
+                mem_budget_release(out->budget, new_size - out->size);
+            }
+            return AVERROR(ENOMEM);
+        }
+        out->data = data;
+        out->size = new_size;
+    }
+
+    memcpy(out->data + out->len, buf, size);
+    out->len += size;
+
+    return 0;
+}
+
+static int out_buffer_printf(struct out_buffer* out, const char* fmt, ...) {
+    char line[256];
+    va_list args;
+    int len;
+
+    va_start(args, fmt);
+    len = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+
+    return out_buffer_append(out, (uint8_t*)line, FFMIN(len, sizeof(line) - 1));
+}
+
+static void out_buffer_free(struct out_buffer* out) {
+    if (out->budget) {
+        mem_budget_release(out->budget, out->size);
+    }
+    free(out->data);
+    out->data = NULL;
+    out->len = out->size = 0;
+}
+
+static int out_buffer_write_packet(void* opaque, uint8_t* buf, int size) {
+    int ret = out_buffer_append(opaque, buf, size);
+
+    return ret < 0 ? ret : size;
+}
+
+/**
+ * Stream copy a segment into the given container format. The segment starts at the first video
+ * key frame at or after start and ends before the first video key frame at or after end, so
+ * consecutive segments neither overlap nor leave gaps. Timestamps are kept so the segments
+ * line up in a playlist. A segment with no key frame of its own in [start, end) does not
+ * exist (AVERROR_EOF): the playlist leaves it out and the one before runs through it.
+ *
+ * Output is handed to write_packet every IO_BUFFER_SIZE bytes as it is muxed. MP4 is written
+ * fragmented at each key frame with an empty moov, so it never needs to seek back.
+ */
+static int request_copy_segment(struct request* req, int64_t start, int64_t end, const char* format,
+                                int (*write_packet)(void* opaque, uint8_t* buf, int size), void* opaque) {
+    AVFormatContext* output_ctx = NULL;
+    AVDictionary* options = NULL;
+    AVPacket* packet = req->packet;
+    int stream_map[2] = { req->video_stream, req->audio_stream };
+    int64_t segment_start = AV_NOPTS_VALUE;
+    int64_t output_start;
+    uint8_t* io_buffer;
+    int size;
+    int ret;
+
+    if ((ret = avformat_alloc_output_context2(&output_ctx, NULL, format, NULL)) < 0) {
+        fprintf(stderr, "Could not create %s muxer: %s\n", format, av_err2str(ret));
+        return ret;
+    }
+
+    for (int i = 0; i < 2 && stream_map[i] >= 0; i++) {
+        AVStream* in = req->input_ctx->streams[stream_map[i]];
+        AVStream* st = avformat_new_stream(output_ctx, NULL);
+
+        if (!st || (ret = avcodec_parameters_copy(st->codecpar, in->codecpar)) < 0) {
+            ret = st ? ret : AVERROR(ENOMEM);
+            goto end;
+        }
+        st->codecpar->codec_tag = 0;
+        st->time_base = in->time_base;
+    }
+
+    if (!(io_buffer = av_malloc(IO_BUFFER_SIZE)) ||
+        !(output_ctx->pb = avio_alloc_context(io_buffer, IO_BUFFER_SIZE, 1, opaque, NULL, write_packet, NULL))) {
+        av_free(io_buffer);
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    if ((ret = seek_to_timestamp(req->input_ctx, start)) < 0) {
+        goto end;
+    }
+    req->seek_target = start;
+    output_start = av_gettime_relative();
+
+    if (!strcmp(format, "mp4")) {
+        av_dict_set(&options, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+    }
+
+    ret = avformat_write_header(output_ctx, &options);
+    av_dict_free(&options);
+    if (ret < 0) {
+        fprintf(stderr, "Could not write header: %s\n", av_err2str(ret));
+        goto end;
+    }
+
+    while ((ret = request_read_frame(req, packet)) >= 0) {
+        AVStream* in = req->input_ctx->streams[packet->stream_index];
+        int64_t ts = packet_timestamp(in, packet);
+        int out_index = packet->stream_index == req->video_stream ? 0 : 1;
+
+        req->stats.packets_read++;
+
+        if (packet->stream_index == req->video_stream && (packet->flags & AV_PKT_FLAG_KEY)) {
+            if (ts != AV_NOPTS_VALUE && ts >= end) {
+                av_packet_unref(packet);
+                break;
+            }
+            if (segment_start == AV_NOPTS_VALUE && ts != AV_NOPTS_VALUE && ts >= start) {
+                segment_start = ts;
+            }
+        }
+
+        if (segment_start == AV_NOPTS_VALUE || ts == AV_NOPTS_VALUE || ts < segment_start) {
+            av_packet_unref(packet);
+            continue;
+        }
+
+        av_packet_rescale_ts(packet, in->time_base, output_ctx->streams[out_index]->time_base);
+        packet->stream_index = out_index;
+        packet->pos = -1;
+        size = packet->size;
+
+        ret = av_interleaved_write_frame(output_ctx, packet);
+        PROBE3(output__write, out_index, size, ret);
+        if (ret < 0) {
+            fprintf(stderr, "Could not write packet: %s\n", av_err2str(ret));
+            goto end;
+        }
+    }
+
+    if (ret < 0 && ret != AVERROR_EOF) {
+        if (ret != AVERROR(ETIMEDOUT)) {
+            fprintf(stderr, "Could not read frame: %s\n", av_err2str(ret));
+        }
+        goto end;
+    }
+
+    if (segment_start == AV_NOPTS_VALUE) {
+        ret = AVERROR_EOF;
+        goto end;
+    }
+
+    ret = av_write_trailer(output_ctx);
+    avio_flush(output_ctx->pb);
+    metrics_observe_since(HIST_OUTPUT, output_start);
+
+end:
+    if (output_ctx->pb) {
+        av_freep(&output_ctx->pb->buffer);
+        avio_context_free(&output_ctx->pb);
+    }
+    avformat_free_context(output_ctx);
+    if (ret < 0 && atomic_load(&req->budget.exceeded)) {
+        fprintf(stderr, "Memory budget of %" PRId64 " bytes exceeded\n", req->budget.limit);
+    }
+
+    return ret;
+}
+
+/**
+ * Encode a decoded frame as a JPEG. The MJPEG encoder only takes planar YUV, which is what
+ * the decoders we serve produce. The samples are not converted, so the JPEG is marked with
+ * the frame's own range: full range only for yuvj formats or frames that say so, and
+ * otherwise the limited range video is almost always in.
+ */
+static int encode_jpeg(AVFrame* frame, struct out_buffer* out) {
+    AVCodec* codec = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
+    AVCodecContext* enc_ctx;
+    AVPacket* packet = NULL;
+    int ret;
+
+    if (!codec) {
+        return AVERROR_ENCODER_NOT_FOUND;
+    }
+
+    if (!(enc_ctx = avcodec_alloc_context3(codec))) {
+        return AVERROR(ENOMEM);
+    }
+
+    enc_ctx->width = frame->width;
+    enc_ctx->height = frame->height;
+    enc_ctx->pix_fmt = frame->format;
+    enc_ctx->color_range = frame->color_range == AVCOL_RANGE_JPEG || frame->format == AV_PIX_FMT_YUVJ420P ||
+                           frame->format == AV_PIX_FMT_YUVJ422P || frame->format == AV_PIX_FMT_YUVJ444P ?
+                           AVCOL_RANGE_JPEG : AVCOL_RANGE_MPEG;
+    enc_ctx->time_base = (AVRational){1, 25};
+    enc_ctx->strict_std_compliance = FF_COMPLIANCE_UNOFFICIAL;
+    enc_ctx->flags |= AV_CODEC_FLAG_QSCALE;
+    enc_ctx->global_quality = FF_QP2LAMBDA * 3;
+
+    if ((ret = avcodec_open2(enc_ctx, codec, NULL)) < 0) {
+        fprintf(stderr, "Could not open JPEG encoder for %s: %s\n", av_get_pix_fmt_name(frame->format), av_err2str(ret));
+        goto end;
+    }
+
+    if (!(packet = av_packet_alloc())) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    if ((ret = avcodec_send_frame(enc_ctx, frame)) < 0 ||
+        (ret = avcodec_send_frame(enc_ctx, NULL)) < 0 ||
+        (ret = avcodec_receive_packet(enc_ctx, packet)) < 0) {
+        fprintf(stderr, "Could not encode JPEG: %s\n", av_err2str(ret));
+        goto end;
+    }
+
+    ret = out_buffer_append(out, packet->data, packet->size);
+
+end:
+    av_packet_free(&packet);
+    avcodec_free_context(&enc_ctx);
+
+    return ret;
+}
+
+static int compare_int64(const void* a, const void* b) {
+    int64_t x = *(const int64_t*)a;
+    int64_t y = *(const int64_t*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * The timestamps (AV_TIME_BASE units) of the video key frames, in order. They come from the
+ * index when the demuxer has one, and otherwise from reading through the video packets.
+ */
+static int request_keyframes(struct request* req, int64_t** keyframes, int* count) {
+    AVStream* st = req->input_ctx->streams[req->video_stream];
+    AVPacket* packet = req->packet;
+    int64_t* list = NULL;
+    int size = 0;
+    int n = 0;
+    int ret = 0;
+
+    for (int i = 0; i < st->nb_index_entries || (!st->nb_index_entries && ret >= 0); i++) {
+        int64_t ts = AV_NOPTS_VALUE;
+
+        if (st->nb_index_entries) {
+            if (st->index_entries[i].flags & AVINDEX_KEYFRAME) {
+                ts = to_av_timebase(st->index_entries[i].timestamp, st->time_base);
+            }
+        } else if (!i && (ret = seek_to_timestamp(req->input_ctx, 0)) < 0) {
+            break;
+        } else if ((ret = request_read_frame(req, packet)) >= 0) {
+            req->stats.packets_read++;
+            if (packet->stream_index == req->video_stream && (packet->flags & AV_PKT_FLAG_KEY)) {
+                ts = packet_timestamp(st, packet);
+            }
+            av_packet_unref(packet);
+        }
+
+        if (ts == AV_NOPTS_VALUE) {
+            continue;
+        }
+        if (n == size) {
+            int64_t* grown = realloc(list, (size = FFMAX(size * 2, 64)) * sizeof(*list));
+
+            if (!grown) {
+                free(list);
+                return AVERROR(ENOMEM);
+            }
+            list = grown;
+        }
+        list[n++] = ts;
+    }
+    if (ret < 0 && ret != AVERROR_EOF) {
+        free(list);
+        return ret;
+    }
+
+    qsort(list, n, sizeof(*list), compare_int64);
+    *keyframes = list;
+    *count = n;
+
+    return 0;
+}
+
+/**
+ * Write an HLS playlist of the -d/-t segments over the input's duration, cut where
+ * request_copy_segment() cuts them: at the first key frame of each slot. A slot without a
+ * key frame of its own is left out, as the segment before runs through it. Each entry has its
+ * real length, and the target duration is the longest.
+ */
+static int request_write_playlist(struct request* req, int duration, int timescale, struct out_buffer* out) {
+    int64_t segment_duration = to_av_timebase(1, (AVRational){duration, timescale});
+    int64_t total = req->input_ctx->duration;
+    int64_t media_end;
+    int64_t* keyframes = NULL;
+    int64_t* starts = NULL;
+    int64_t segments;
+    int64_t longest = 0;
+    int nb_keyframes;
+    int k = 0;
+    int ret;
+
+    if (total == AV_NOPTS_VALUE || total <= 0 || segment_duration <= 0) {
+        fprintf(stderr, "Unknown duration\n");
+        return AVERROR_INVALIDDATA;
+    }
+    media_end = (req->input_ctx->start_time != AV_NOPTS_VALUE ? req->input_ctx->start_time : 0) + total;
+    segments = (total + segment_duration - 1) / segment_duration;
+
+    if ((ret = request_keyframes(req, &keyframes, &nb_keyframes)) < 0) {
+        return ret;
+    }
+    if (!nb_keyframes) {
+        fprintf(stderr, "No key frames\n");
+        free(keyframes);
+        return AVERROR_INVALIDDATA;
+    }
+    if (!(starts = calloc(segments, sizeof(*starts)))) {
+        free(keyframes);
+        return AVERROR(ENOMEM);
+    }
+
+    /* Where each slot's segment starts, AV_NOPTS_VALUE for slots without one */
+    for (int64_t i = 0; i < segments; i++) {
+        while (k < nb_keyframes && keyframes[k] < i * segment_duration) {
+            k++;
+        }
+        starts[i] = k < nb_keyframes && keyframes[k] < (i + 1) * segment_duration ? keyframes[k] : AV_NOPTS_VALUE;
+    }
+    for (int64_t i = 0, next; i < segments; i = next) {
+        for (next = i + 1; next < segments && starts[next] == AV_NOPTS_VALUE; next++);
+        if (starts[i] != AV_NOPTS_VALUE) {
+            longest = FFMAX(longest, (next < segments ? starts[next] : media_end) - starts[i]);
+        }
+    }
+
+    ret = out_buffer_printf(out, "#EXTM3U\n#EXT-X-VERSION:3\n#EXT-X-PLAYLIST-TYPE:VOD\n"
+                            "#EXT-X-TARGETDURATION:%" PRId64 "\n#EXT-X-MEDIA-SEQUENCE:0\n",
+                            FFMAX((longest + AV_TIME_BASE - 1) / AV_TIME_BASE, 1));
+
+    for (int64_t i = 0, next; i < segments && ret >= 0; i = next) {
+        for (next = i + 1; next < segments && starts[next] == AV_NOPTS_VALUE; next++);
+        if (starts[i] != AV_NOPTS_VALUE) {
+            int64_t length = FFMAX((next < segments ? starts[next] : media_end) - starts[i], 0);
+
+            ret = out_buffer_printf(out, "#EXTINF:%.6f,\nseg/%" PRId64 ".ts\n", (double)length / AV_TIME_BASE, i);
+        }
+    }
+
+    if (ret >= 0) {
+        ret = out_buffer_printf(out, "#EXT-X-ENDLIST\n");
+    }
+    free(starts);
+    free(keyframes);
+
+    return ret;
+}
+
+/*
+ * Cost maps. `vodtool costmap` extracts every segment and the thumbnail at the start of every
+ * segment of a title, one at a time, and records what each cost in <infile>.costmap. Each item
+ * is measured from its own seek with the decoder flushed, the way the server produces it, so
+ * the costs do not depend on the order they are taken in. The file is one line per segment:
+ *
+ *   costmap=1;duration=5;timescale=1;segments=N
+ *   segment=0;cpu_us=..;wall_us=..;bytes_read=..;frames_decoded=..;thumbnail_cpu_us=..;...
+ *
+ * The server weighs its cost estimates with it, see server_item_weight().
+ */
+#define COSTMAP_VERSION 1
+
+struct costmap_sample {
+    int64_t cpu;
+    int64_t wall;
+    int64_t bytes_read;
+    int64_t frames_decoded;
+};
+
+static int64_t process_cpu_time(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void costmap_sample(struct request* req, struct costmap_sample* sample) {
+    sample->cpu = process_cpu_time();
+    sample->wall = av_gettime_relative();
+    sample->bytes_read = req->input_ctx->pb ? req->input_ctx->pb->bytes_read : 0;
+    sample->frames_decoded = req->stats.frames_decoded;
+}
+
+/* Turn a sample taken before an item into what the item cost */
+static void costmap_measure(struct request* req, struct costmap_sample* sample) {
+    struct costmap_sample now;
+
+    costmap_sample(req, &now);
+    sample->cpu = now.cpu - sample->cpu;
+    sample->wall = now.wall - sample->wall;
+    sample->bytes_read = now.bytes_read - sample->bytes_read;
+    sample->frames_decoded = now.frames_decoded - sample->frames_decoded;
+}
+
+static int discard_packet(void* opaque, uint8_t* buf, int size) {
+    return size;
+}
+
+static int costmap_main(int argc, char** argv) {
+    struct request req = {0};
+    int duration = 5;
+    int timescale = 1;
+    char filename[PATH_MAX];
+    char tmp_filename[PATH_MAX];
+    const char* input_filename;
+    AVFrame* frame;
+    FILE* out;
+    int64_t segment_duration;
+    int64_t segments = 0;
+    int64_t total_cpu = 0;
+    int64_t max_cpu = -1;
+    int64_t max_segment = 0;
+    int ret = 0;
+
+    static struct option long_options[] = {
+        {"duration", required_argument, 0, 'd'},
+        {"timescale", required_argument, 0, 't'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0},
+    };
+    int option;
+    while ((option = getopt_long(argc, argv, "d:t:h?", long_options, NULL)) != -1) {
+        switch (option) {
+            case 'd':
+                duration = atoi(optarg);
+                break;
+            case 't':
+                timescale = atoi(optarg);
+                break;
+            case 'h':
+            case '?':
+                usage(argv[0]);
+                break;
+        }
+    }
+
+    if (argc - optind != 1 || duration <= 0 || timescale <= 0) {
+        usage(argv[0]);
+    }
+
+    av_register_all();
+
+    input_filename = argv[optind];
+    if (snprintf(filename, sizeof(filename), "%s.costmap", input_filename) >= sizeof(filename) ||
+        snprintf(tmp_filename, sizeof(tmp_filename), "%s.costmap.tmp", input_filename) >= sizeof(tmp_filename)) {
+        fprintf(stderr, "File name too long: %s\n", input_filename);
+        return 1;
+    }
+
+    if (request_open(&req, input_filename, 1) < 0 || request_open_decoder(&req) < 0) {
+        return 1;
+    }
+    if (!(frame = av_frame_alloc())) {
+        fprintf(stderr, "Could not allocate frame\n");
+        return 1;
+    }
+    if (!(out = fopen(tmp_filename, "w"))) {
+        fprintf(stderr, "Could not open %s: %s\n", tmp_filename, strerror(errno));
+        return 1;
+    }
+
+    segment_duration = to_av_timebase(1, (AVRational){duration, timescale});
+    if (req.input_ctx->duration != AV_NOPTS_VALUE && req.input_ctx->duration > 0) {
+        segments = (req.input_ctx->duration + segment_duration - 1) / segment_duration;
+    }
+    fprintf(out, "costmap=%d;duration=%d;timescale=%d;segments=%" PRId64 "\n", COSTMAP_VERSION, duration,
+            timescale, segments);
+
+    for (int64_t i = 0; i < segments; i++) {
+        int64_t start = i * segment_duration;
+        struct costmap_sample segment;
+        struct costmap_sample thumbnail;
+
+        costmap_sample(&req, &segment);
+        ret = request_copy_segment(&req, start, start + segment_duration, "mpegts", discard_packet, NULL);
+        costmap_measure(&req, &segment);
+        if (ret < 0 && ret != AVERROR_EOF) {
+            break;
+        }
+
+        costmap_sample(&req, &thumbnail);
+        ret = request_decode_frame(&req, start, frame);
+        costmap_measure(&req, &thumbnail);
+        av_frame_unref(frame);
+        if (ret < 0 && ret != AVERROR_EOF) {
+            break;
+        }
+        ret = 0;
+
+        fprintf(out, "segment=%" PRId64 ";cpu_us=%" PRId64 ";wall_us=%" PRId64 ";bytes_read=%" PRId64
+                ";frames_decoded=%" PRId64 ";thumbnail_cpu_us=%" PRId64 ";thumbnail_wall_us=%" PRId64
+                ";thumbnail_bytes_read=%" PRId64 ";thumbnail_frames_decoded=%" PRId64 "\n",
+                i, segment.cpu, segment.wall, segment.bytes_read, segment.frames_decoded,
+                thumbnail.cpu, thumbnail.wall, thumbnail.bytes_read, thumbnail.frames_decoded);
+
+        total_cpu += segment.cpu + thumbnail.cpu;
+        if (segment.cpu + thumbnail.cpu > max_cpu) {
+            max_cpu = segment.cpu + thumbnail.cpu;
+            max_segment = i;
+        }
+    }
+
+    av_frame_free(&frame);
+    request_close(&req);
+
+    if (fclose(out) != 0 && ret >= 0) {
+        fprintf(stderr, "Could not write %s: %s\n", tmp_filename, strerror(errno));
+        ret = AVERROR(errno);
+    }
+    if (ret < 0 || rename(tmp_filename, filename) < 0) {
+        if (ret >= 0) {
+            fprintf(stderr, "Could not rename %s: %s\n", tmp_filename, strerror(errno));
+        }
+        unlink(tmp_filename);
+        return 1;
+    }
+
+    fprintf(stderr, "segments=%" PRId64 ";cpu_us=%" PRId64 ";max_segment=%" PRId64 ";max_cpu_us=%" PRId64 "\n",
+            segments, total_cpu, max_segment, max_cpu);
+
+    return 0;
+}
+
+/**
+ * A loaded cost map: the CPU time of every segment and thumbnail relative to the title's
+ * average, in COST_WEIGHT_ONE units.
+ */
+#define COST_WEIGHT_ONE 1024
+
+struct costmap {
+    int duration;
+    int timescale;
+    int64_t segments;
+    int32_t* segment_weight;
+    int32_t* thumbnail_weight;
+};
+
+static void costmap_free(struct costmap* map) {
+    if (map) {
+        free(map->segment_weight);
+        free(map->thumbnail_weight);
+        free(map);
+    }
+}
+
+/* Spread between the cheapest and the dearest item a cost map may claim */
+#define COSTMAP_MIN_WEIGHT (COST_WEIGHT_ONE / 16)
+#define COSTMAP_MAX_WEIGHT (COST_WEIGHT_ONE * 64)
+
+static void costmap_normalize(int32_t* weights, const int64_t* costs, int64_t count) {
+    int64_t total = 0;
+
+    for (int64_t i = 0; i < count; i++) {
+        total += costs[i];
+    }
+    for (int64_t i = 0; i < count; i++) {
+        int64_t weight = total ? costs[i] * count * COST_WEIGHT_ONE / total : COST_WEIGHT_ONE;
+
+        weights[i] = FFMIN(FFMAX(weight, COSTMAP_MIN_WEIGHT), COSTMAP_MAX_WEIGHT);
+    }
+}
+
+static struct costmap* costmap_load(const char* filename) {
+    FILE* f = fopen(filename, "r");
+    struct costmap* map = NULL;
+    int64_t* segment_cost = NULL;
+    int64_t* thumbnail_cost = NULL;
+    char line[512];
+    int version;
+
+    if (!f) {
+        return NULL;
+    }
+    if (!(map = calloc(1, sizeof(*map))) || !fgets(line, sizeof(line), f) ||
+        sscanf(line, "costmap=%d;duration=%d;timescale=%d;segments=%" SCNd64, &version, &map->duration,
+               &map->timescale, &map->segments) != 4 || version != COSTMAP_VERSION ||
+        map->segments <= 0 || map->segments > INT_MAX) {
+        goto fail;
+    }
+    if (!(map->segment_weight = malloc(map->segments * sizeof(*map->segment_weight))) ||
+        !(map->thumbnail_weight = malloc(map->segments * sizeof(*map->thumbnail_weight))) ||
+        !(segment_cost = calloc(map->segments, sizeof(*segment_cost))) ||
+        !(thumbnail_cost = calloc(map->segments, sizeof(*thumbnail_cost)))) {
+        goto fail;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        char* thumbnail = strstr(line, ";thumbnail_cpu_us=");
+        int64_t segment;
+        int64_t cpu;
+
+        if (sscanf(line, "segment=%" SCNd64 ";cpu_us=%" SCNd64, &segment, &cpu) == 2 &&
+            segment >= 0 && segment < map->segments && thumbnail) {
+            segment_cost[segment] = cpu;
+            thumbnail_cost[segment] = strtoll(thumbnail + 18, NULL, 10);
+        }
+    }
+    costmap_normalize(map->segment_weight, segment_cost, map->segments);
+    costmap_normalize(map->thumbnail_weight, thumbnail_cost, map->segments);
+    free(segment_cost);
+    free(thumbnail_cost);
+    fclose(f);
+
+    return map;
+
+fail:
+    free(segment_cost);
+    free(thumbnail_cost);
+    costmap_free(map);
+    fclose(f);
+    return NULL;
+}
+
+/*
+ * Cost maps the server has loaded, by asset. Only the event loop uses it, so it touches the
+ * file system at most every COSTMAP_RECHECK_MS per asset: a map is reloaded when its file has
+ * changed, and assets without one are remembered as such. When the cache is full it is
+ * emptied and fills up again from the assets in use.
+ */
+#define COSTMAP_CACHE_BUCKETS 256
+#define COSTMAP_CACHE_MAX_ENTRIES 4096
+#define COSTMAP_RECHECK_MS 5000
+
+struct costmap_entry {
+    char* asset;
+    struct timespec mtime;
+    /* NULL if the asset has no cost map */
+    struct costmap* map;
+    /* av_gettime_relative() time the file was last looked at */
+    int64_t checked;
+    struct costmap_entry* next;
+};
+
+struct costmap_cache {
+    struct costmap_entry* buckets[COSTMAP_CACHE_BUCKETS];
+    int entries;
+};
+
+static void costmap_cache_clear(struct costmap_cache* cache) {
+    for (int i = 0; i < COSTMAP_CACHE_BUCKETS; i++) {
+        while (cache->buckets[i]) {
+            struct costmap_entry* entry = cache->buckets[i];
+
+            cache->buckets[i] = entry->next;
+            costmap_free(entry->map);
+            free(entry->asset);
+            free(entry);
+        }
+    }
+    cache->entries = 0;
+}
+
+/**
+ * The cost map for asset under root, or NULL if it has none.
+ */
+static struct costmap* costmap_cache_get(struct costmap_cache* cache, const char* root, const char* asset) {
+    struct costmap_entry** bucket = &cache->buckets[fnv1a(asset, strlen(asset), FNV1A_INIT) % COSTMAP_CACHE_BUCKETS];
+    struct costmap_entry* entry;
+    char filename[PATH_MAX];
+    int64_t now = av_gettime_relative();
+    struct stat st;
+
+    for (entry = *bucket; entry && strcmp(entry->asset, asset); entry = entry->next);
+    if (entry && now - entry->checked < COSTMAP_RECHECK_MS * 1000LL) {
+        return entry->map;
+    }
+
+    if (!entry) {
+        if (cache->entries == COSTMAP_CACHE_MAX_ENTRIES) {
+            costmap_cache_clear(cache);
+        }
+        if (!(entry = calloc(1, sizeof(*entry))) || !(entry->asset = strdup(asset))) {
+            free(entry);
+            return NULL;
+        }
+        entry->next = *bucket;
+        *bucket = entry;
+        cache->entries++;
+    }
+    entry->checked = now;
+
+    if (snprintf(filename, sizeof(filename), "%s/%s.costmap", root, asset) >= sizeof(filename) ||
+        stat(filename, &st) < 0) {
+        costmap_free(entry->map);
+        entry->map = NULL;
+        entry->mtime = (struct timespec){0};
+        return NULL;
+    }
+    if (entry->map && entry->mtime.tv_sec == st.st_mtim.tv_sec && entry->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+        return entry->map;
+    }
+
+    costmap_free(entry->map);
+    entry->map = costmap_load(filename);
+    entry->mtime = st.st_mtim;
+
+    return entry->map;
+}
+
+/*
+ * Autotuning. `vodtool autotune file...` decodes frames at evenly spaced times of each file,
+ * the way thumbnail requests do, with every threading configuration the decoder supports, and
+ * writes the fastest per codec and frame height to the profile. The files should be
+ * representative of what is served: their GOP structure decides how much pre-roll each
+ * request decodes.
+ */
+#define AUTOTUNE_MAX_CONFIGS 32
+#define AUTOTUNE_MAX_KEYS 64
+/* Fewer threads are preferred over a configuration that is faster by less than this, in % */
+#define AUTOTUNE_TOLERANCE 5
+
+struct autotune_config {
+    int thread_type;
+    int thread_count;
+};
+
+struct autotune_key {
+    char codec[32];
+    int height;
+    int64_t time[AUTOTUNE_MAX_CONFIGS];
+    int64_t requests[AUTOTUNE_MAX_CONFIGS];
+};
+
+/* Single threaded, then frame and slice threading with 2, 4, ... and all CPUs, if there are more than one */
+static int autotune_configs(struct autotune_config* configs) {
+    int threads = available_cpus();
+    int n = 0;
+
+    configs[n++] = (struct autotune_config){ FF_THREAD_SLICE, 1 };
+    for (int count = FFMIN(2, threads); count > 1 && n + 2 <= AUTOTUNE_MAX_CONFIGS;
+         count = count * 2 < threads ? count * 2 : threads) {
+        configs[n++] = (struct autotune_config){ FF_THREAD_FRAME, count };
+        configs[n++] = (struct autotune_config){ FF_THREAD_SLICE, count };
+        if (count >= threads) {
+            break;
+        }
+    }
+    return n;
+}
+
+static const char* thread_type_name(int thread_type) {
+    return thread_type == FF_THREAD_FRAME ? "frame" : "slice";
+}
+
+/**
+ * Time samples frame requests against filename with each configuration and add them to the
+ * file's key.
+ */
+static int autotune_file(const char* filename, const struct autotune_config* configs, int nb_configs,
+                         int samples, struct autotune_key* keys, int* nb_keys) {
+    struct autotune_key* key = NULL;
+    AVFrame* frame = av_frame_alloc();
+    int ret = 0;
+
+    if (!frame) {
+        return AVERROR(ENOMEM);
+    }
+
+    for (int c = 0; c < nb_configs && ret >= 0; c++) {
+        struct request req = { .thread_type = configs[c].thread_type, .thread_count = configs[c].thread_count };
+        int capability = configs[c].thread_type == FF_THREAD_FRAME ? AV_CODEC_CAP_FRAME_THREADS : AV_CODEC_CAP_SLICE_THREADS;
+        int64_t duration;
+        int64_t time = 0;
+
+        if ((ret = request_open(&req, filename, 0)) < 0 || (ret = request_open_decoder(&req)) < 0) {
+            request_close(&req);
+            break;
+        }
+
+        if (!key) {
+            for (int i = 0; i < *nb_keys && !key; i++) {
+                if (!strcmp(keys[i].codec, req.dec_ctx->codec->name) && keys[i].height == req.dec_ctx->height) {
+                    key = &keys[i];
+                }
+            }
+            if (!key && *nb_keys == AUTOTUNE_MAX_KEYS) {
+                fprintf(stderr, "Too many codec and height combinations, skipping %s\n", filename);
+                request_close(&req);
+                break;
+            } else if (!key) {
+                key = &keys[(*nb_keys)++];
+                snprintf(key->codec, sizeof(key->codec), "%s", req.dec_ctx->codec->name);
+                key->height = req.dec_ctx->height;
+            }
+        }
+
+        duration = req.input_ctx->duration;
+        if (configs[c].thread_count > 1 && !(req.dec_ctx->codec->capabilities & capability)) {
+            request_close(&req);
+            continue;
+        }
+        if (duration == AV_NOPTS_VALUE || duration <= 0) {
+            fprintf(stderr, "Unknown duration, skipping %s\n", filename);
+            request_close(&req);
+            break;
+        }
+
+        /* The first request also pays for starting the decoder's threads; leave it out */
+        if ((ret = request_decode_frame(&req, 0, frame)) >= 0) {
+            av_frame_unref(frame);
+        }
+        for (int i = 0; i < samples && ret >= 0; i++) {
+            int64_t start = av_gettime_relative();
+
+            ret = request_decode_frame(&req, duration * (2 * i + 1) / (2 * samples), frame);
+            time += av_gettime_relative() - start;
+            av_frame_unref(frame);
+        }
+        request_close(&req);
+
+        if (ret >= 0) {
+            key->time[c] += time;
+            key->requests[c] += samples;
+            fprintf(stderr, "file=%s;codec=%s;height=%d;thread_type=%s;thread_count=%d;latency_us=%" PRId64 "\n",
+                    filename, key->codec, key->height, thread_type_name(configs[c].thread_type),
+                    configs[c].thread_count, time / samples);
+        }
+    }
+
+    av_frame_free(&frame);
+    return ret;
+}
+
+static int autotune_main(int argc, char** argv) {
+    struct autotune_config configs[AUTOTUNE_MAX_CONFIGS];
+    struct autotune_key* keys;
+    const char* output = profile_filename() ? profile_filename() : DEFAULT_PROFILE;
+    char tmp_filename[PATH_MAX];
+    int nb_configs = autotune_configs(configs);
+    int nb_keys = 0;
+    int samples = 16;
+    FILE* out;
+
+    static struct option long_options[] = {
+        {"output", required_argument, 0, 'o'},
+        {"samples", required_argument, 0, 'n'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0},
+    };
+    int option;
+    while ((option = getopt_long(argc, argv, "o:n:h?", long_options, NULL)) != -1) {
+        switch (option) {
+            case 'o':
+                output = optarg;
+                break;
+            case 'n':
+                samples = atoi(optarg);
+                break;
+            case 'h':
+            case '?':
+                usage(argv[0]);
+                break;
+        }
+    }
+
+    if (argc - optind < 1 || samples < 1) {
+        usage(argv[0]);
+    }
+    if (snprintf(tmp_filename, sizeof(tmp_filename), "%s.tmp", output) >= sizeof(tmp_filename)) {
+        fprintf(stderr, "File name too long: %s\n", output);
+        return 1;
+    }
+    if (!(keys = calloc(AUTOTUNE_MAX_KEYS, sizeof(*keys)))) {
+        return 1;
+    }
+
+    av_register_all();
+
+    for (int i = optind; i < argc; i++) {
+        if (autotune_file(argv[i], configs, nb_configs, samples, keys, &nb_keys) < 0) {
+            fprintf(stderr, "Could not benchmark %s\n", argv[i]);
+        }
+    }
+    if (!nb_keys) {
+        fprintf(stderr, "Nothing to tune\n");
+        return 1;
+    }
+
+    if (!(out = fopen(tmp_filename, "w"))) {
+        fprintf(stderr, "Could not open %s: %s\n", tmp_filename, strerror(errno));
+        return 1;
+    }
+    for (int k = 0; k < nb_keys; k++) {
+        struct autotune_key* key = &keys[k];
+        int64_t fastest = INT64_MAX;
+        int best = -1;
+
+        for (int c = 0; c < nb_configs; c++) {
+            if (key->requests[c] && key->time[c] / key->requests[c] < fastest) {
+                fastest = key->time[c] / key->requests[c];
+            }
+        }
+        /* The server decodes many requests at once: take the fewest threads that keep up */
+        for (int c = 0; c < nb_configs; c++) {
+            if (key->requests[c] && key->time[c] / key->requests[c] <= fastest * (100 + AUTOTUNE_TOLERANCE) / 100 &&
+                (best < 0 || configs[c].thread_count < configs[best].thread_count)) {
+                best = c;
+            }
+        }
+        if (best < 0) {
+            continue;
+        }
+        fprintf(out, "codec=%s;height=%d;thread_type=%s;thread_count=%d;latency_us=%" PRId64 "\n", key->codec,
+                key->height, thread_type_name(configs[best].thread_type), configs[best].thread_count,
+                key->time[best] / key->requests[best]);
+    }
+    free(keys);
+
+    if (fclose(out) != 0 || rename(tmp_filename, output) < 0) {
+        fprintf(stderr, "Could not write %s: %s\n", output, strerror(errno));
+        unlink(tmp_filename);
+        return 1;
+    }
+    fprintf(stderr, "Wrote %s\n", output);
+
+    return 0;
+}
+
+/*
+ * Luma analysis. Frame statistics are computed straight on the decoder's luma plane
+ * (frame->data[0]) of 8-bit YUV and gray frames, with SSE2 where the compiler targets it and
+ * plain loops otherwise. Scene detection compares frames on a small grid of block averages,
+ * so that it costs a pass over the plane rather than a scale.
+ */
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define LUMA_GRID_W 64
+#define LUMA_GRID_H 36
+
+/* Whether frame->data[0] is one byte of luma per pixel */
+static int luma_supported(const AVFrame* frame) {
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(frame->format);
+
+    return desc && !(desc->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_HWACCEL |
+                                    AV_PIX_FMT_FLAG_BITSTREAM)) &&
+           desc->comp[0].depth == 8 && desc->comp[0].step == 1;
+}
+
+/* Sum of absolute differences of n bytes */
+static uint64_t luma_sad(const uint8_t* a, const uint8_t* b, int n) {
+    uint64_t sum = 0;
+    int i = 0;
+
+#ifdef __SSE2__
+    __m128i acc = _mm_setzero_si128();
+    uint64_t lanes[2];
+
+    for (; i + 16 <= n; i += 16) {
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i*)(a + i)),
+                                              _mm_loadu_si128((const __m128i*)(b + i))));
+    }
+    _mm_storeu_si128((__m128i*)lanes, acc);
+    sum = lanes[0] + lanes[1];
+#endif
+    for (; i < n; i++) {
+        sum += FFABS(a[i] - b[i]);
+    }
+
+    return sum;
+}
+
+/* Add a row of n bytes to 16-bit column sums */
+static void luma_accumulate(uint16_t* acc, const uint8_t* row, int n) {
+    int i = 0;
+
+#ifdef __SSE2__
+    __m128i zero = _mm_setzero_si128();
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(row + i));
+        __m128i* dst = (__m128i*)(acc + i);
+
+        _mm_storeu_si128(dst, _mm_add_epi16(_mm_loadu_si128(dst), _mm_unpacklo_epi8(v, zero)));
+        _mm_storeu_si128(dst + 1, _mm_add_epi16(_mm_loadu_si128(dst + 1), _mm_unpackhi_epi8(v, zero)));
+    }
+#endif
+    for (; i < n; i++) {
+        acc[i] += row[i];
+    }
+}
+
+/**
+ * Block averages of a luma plane. Each band of rows is summed into column sums with vector
+ * adds, then each band's columns are summed per block; at most 256 rows of a band are added
+ * so the 16-bit sums cannot overflow.
+ */
+struct luma_grid {
+    int width;
+    int height;
+    uint8_t cells[LUMA_GRID_W * LUMA_GRID_H];
+    /* Column sums, one per pixel of the widest frame so far */
+    uint16_t* columns;
+    int columns_size;
+};
+
+static int luma_grid_update(struct luma_grid* grid, const AVFrame* frame) {
+    grid->width = FFMIN(frame->width, LUMA_GRID_W);
+    grid->height = FFMIN(frame->height, LUMA_GRID_H);
+
+    if (frame->width > grid->columns_size) {
+        uint16_t* columns = realloc(grid->columns, frame->width * sizeof(*columns));
+
+        if (!columns) {
+            return AVERROR(ENOMEM);
+        }
+        grid->columns = columns;
+        grid->columns_size = frame->width;
+    }
+
+    for (int gy = 0; gy < grid->height; gy++) {
+        int y0 = gy * frame->height / grid->height;
+        int y1 = (gy + 1) * frame->height / grid->height;
+        int step = (y1 - y0 + 255) / 256;
+        int rows = 0;
+
+        memset(grid->columns, 0, frame->width * sizeof(*grid->columns));
+        for (int y = y0; y < y1; y += step, rows++) {
+            luma_accumulate(grid->columns, frame->data[0] + (ptrdiff_t)y * frame->linesize[0], frame->width);
+        }
+
+        for (int gx = 0; gx < grid->width; gx++) {
+            int x0 = gx * frame->width / grid->width;
+            int x1 = (gx + 1) * frame->width / grid->width;
+            uint32_t sum = 0;
+
+            for (int x = x0; x < x1; x++) {
+                sum += grid->columns[x];
+            }
+            grid->cells[gy * grid->width + gx] = sum / (rows * (x1 - x0));
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Whole-plane statistics: mean and variance of the luma, and the share of pixels at or
+ * below dark_level.
+ */
+struct luma_stats {
+    double mean;
+    double variance;
+    double dark;
+};
+
+static void luma_stats(const AVFrame* frame, int dark_level, struct luma_stats* stats) {
+    uint64_t sum = 0;
+    uint64_t squares = 0;
+    uint64_t dark = 0;
+    double pixels = (double)frame->width * frame->height;
+
+    for (int y = 0; y < frame->height; y++) {
+        const uint8_t* row = frame->data[0] + (ptrdiff_t)y * frame->linesize[0];
+        int x = 0;
+
+#ifdef __SSE2__
+        __m128i zero = _mm_setzero_si128();
+        __m128i ones = _mm_set1_epi8(1);
+        __m128i level = _mm_set1_epi8((char)dark_level);
+        __m128i sums = zero;
+        __m128i darks = zero;
+        /* 32-bit lanes: a row adds width / 4 squares to each, far from overflowing */
+        __m128i square_sums = zero;
+        uint64_t lanes[2];
+        uint32_t square_lanes[4];
+
+        for (; x + 16 <= frame->width; x += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(row + x));
+            __m128i lo = _mm_unpacklo_epi8(v, zero);
+            __m128i hi = _mm_unpackhi_epi8(v, zero);
+            __m128i is_dark = _mm_cmpeq_epi8(_mm_max_epu8(v, level), level);
+
+            sums = _mm_add_epi64(sums, _mm_sad_epu8(v, zero));
+            darks = _mm_add_epi64(darks, _mm_sad_epu8(_mm_and_si128(is_dark, ones), zero));
+            square_sums = _mm_add_epi32(square_sums, _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi)));
+        }
+        _mm_storeu_si128((__m128i*)lanes, sums);
+        sum += lanes[0] + lanes[1];
+        _mm_storeu_si128((__m128i*)lanes, darks);
+        dark += lanes[0] + lanes[1];
+        _mm_storeu_si128((__m128i*)square_lanes, square_sums);
+        squares += (uint64_t)square_lanes[0] + square_lanes[1] + square_lanes[2] + square_lanes[3];
+#endif
+        for (; x < frame->width; x++) {
+            sum += row[x];
+            squares += row[x] * row[x];
+            dark += row[x] <= dark_level;
+        }
+    }
+
+    stats->mean = sum / pixels;
+    stats->variance = squares / pixels - stats->mean * stats->mean;
+    stats->dark = dark / pixels;
+}
+
+/**
+ * Sharpness: the variance of the 4-neighbour Laplacian over the plane's inner pixels, every
+ * other row. Blurred frames and transitions have little high frequency content and score low.
+ */
+static double luma_laplacian_variance(const AVFrame* frame) {
+    int64_t sum = 0;
+    uint64_t squares = 0;
+    int64_t count = 0;
+
+    for (int y = 1; y < frame->height - 1; y += 2) {
+        const uint8_t* row = frame->data[0] + (ptrdiff_t)y * frame->linesize[0];
+        const uint8_t* up = row - frame->linesize[0];
+        const uint8_t* down = row + frame->linesize[0];
+        int x = 1;
+
+#ifdef __SSE2__
+        __m128i zero = _mm_setzero_si128();
+        __m128i ones = _mm_set1_epi16(1);
+        __m128i sums = zero;
+        /* 32-bit lanes: width / 4 squares of at most 1020^2 each, enough for 8K rows */
+        __m128i square_sums = zero;
+        int32_t lanes[4];
+        uint32_t square_lanes[4];
+
+        for (; x + 16 <= frame->width - 1; x += 16) {
+            __m128i c = _mm_loadu_si128((const __m128i*)(row + x));
+            __m128i l = _mm_loadu_si128((const __m128i*)(row + x - 1));
+            __m128i r = _mm_loadu_si128((const __m128i*)(row + x + 1));
+            __m128i u = _mm_loadu_si128((const __m128i*)(up + x));
+            __m128i d = _mm_loadu_si128((const __m128i*)(down + x));
+
+            __m128i lap_lo = _mm_slli_epi16(_mm_unpacklo_epi8(c, zero), 2);
+            __m128i lap_hi = _mm_slli_epi16(_mm_unpackhi_epi8(c, zero), 2);
+
+            lap_lo = _mm_sub_epi16(lap_lo, _mm_add_epi16(_mm_unpacklo_epi8(l, zero), _mm_unpacklo_epi8(r, zero)));
+            lap_lo = _mm_sub_epi16(lap_lo, _mm_add_epi16(_mm_unpacklo_epi8(u, zero), _mm_unpacklo_epi8(d, zero)));
+            lap_hi = _mm_sub_epi16(lap_hi, _mm_add_epi16(_mm_unpackhi_epi8(l, zero), _mm_unpackhi_epi8(r, zero)));
+            lap_hi = _mm_sub_epi16(lap_hi, _mm_add_epi16(_mm_unpackhi_epi8(u, zero), _mm_unpackhi_epi8(d, zero)));
+            sums = _mm_add_epi32(sums, _mm_add_epi32(_mm_madd_epi16(lap_lo, ones), _mm_madd_epi16(lap_hi, ones)));
+            square_sums = _mm_add_epi32(square_sums, _mm_add_epi32(_mm_madd_epi16(lap_lo, lap_lo),
+                                                                   _mm_madd_epi16(lap_hi, lap_hi)));
+        }
+        _mm_storeu_si128((__m128i*)lanes, sums);
+        sum += (int64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+        _mm_storeu_si128((__m128i*)square_lanes, square_sums);
+        squares += (uint64_t)square_lanes[0] + square_lanes[1] + square_lanes[2] + square_lanes[3];
+        count += x - 1;
+#endif
+        for (; x < frame->width - 1; x++) {
+            int lap = 4 * row[x] - row[x - 1] - row[x + 1] - up[x] - down[x];
+
+            sum += lap;
+            squares += lap * lap;
+            count++;
+        }
+    }
+
+    if (!count) {
+        return 0;
+    }
+
+    return (double)squares / count - ((double)sum / count) * ((double)sum / count);
+}
+
+/*
+ * Crop detection. Letterbox and pillarbox bars are rows and columns whose mean luma stays
+ * at black. A few key frames spread over the input, from the keyframe-only pass, are scanned
+ * and the crop keeps everything any of them shows, so a dark scene does not cut into the
+ * picture. `vodtool cropdetect` prints it; --crop applies one to frames before they are
+ * scaled or encoded, so the bars are never processed.
+ */
+#define CROP_DEFAULT_SAMPLES 8
+/* Luma above black that still counts as a bar, for compression noise */
+#define CROP_DEFAULT_LIMIT 24
+
+struct crop_rect {
+    int width;
+    int height;
+    int x;
+    int y;
+};
+
+/* "w:h:x:y", as printed by cropdetect */
+static int parse_crop(const char* s, struct crop_rect* crop) {
+    if (sscanf(s, "%d:%d:%d:%d", &crop->width, &crop->height, &crop->x, &crop->y) != 4 || crop->width <= 0 ||
+        crop->height <= 0 || crop->x < 0 || crop->y < 0) {
+        fprintf(stderr, "Invalid crop: %s\n", s);
+        return AVERROR(EINVAL);
+    }
+    return 0;
+}
+
+/**
+ * Crop frame in place, clamped to its size. Only the data pointers and size change. The
+ * crop is applied exactly, not rounded to an aligned left edge, which would widen it.
+ */
+static int apply_crop(AVFrame* frame, const struct crop_rect* crop) {
+    int x = FFMIN(crop->x, frame->width - 1);
+    int y = FFMIN(crop->y, frame->height - 1);
+
+    frame->crop_left = x;
+    frame->crop_top = y;
+    frame->crop_right = frame->width - x - FFMIN(crop->width, frame->width - x);
+    frame->crop_bottom = frame->height - y - FFMIN(crop->height, frame->height - y);
+
+    return av_frame_apply_cropping(frame, AV_FRAME_CROP_UNALIGNED);
+}
+
+/* Sum of n bytes */
+static uint64_t luma_row_sum(const uint8_t* row, int n) {
+    uint64_t sum = 0;
+    int i = 0;
+
+#ifdef __SSE2__
+    __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    uint64_t lanes[2];
+
+    for (; i + 16 <= n; i += 16) {
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i*)(row + i)), zero));
+    }
+    _mm_storeu_si128((__m128i*)lanes, acc);
+    sum = lanes[0] + lanes[1];
+#endif
+    for (; i < n; i++) {
+        sum += row[i];
+    }
+
+    return sum;
+}
+
+struct crop_detector {
+    int limit;
+    /* The active area seen so far; found is 0 until a frame had any */
+    int found;
+    int left, top, right, bottom;
+    /* Column sums: 16-bit for up to 256 rows at a time, then 32-bit */
+    uint16_t* band;
+    uint32_t* columns;
+    int columns_size;
+};
+
+static int crop_detector_add(void* opaque, AVFrame* frame) {
+    struct crop_detector* cd = opaque;
+    int black = frame->color_range == AVCOL_RANGE_JPEG ? 0 : 16;
+    int64_t row_limit = (int64_t)(black + cd->limit) * frame->width;
+    int64_t column_limit;
+    int top = -1, bottom = -1, left = -1, right = -1;
+
+    if (!luma_supported(frame)) {
+        fprintf(stderr, "Unsupported pixel format for luma analysis: %s\n", av_get_pix_fmt_name(frame->format));
+        return AVERROR(ENOSYS);
+    }
+    if (frame->width > cd->columns_size) {
+        uint16_t* band = realloc(cd->band, frame->width * sizeof(*band));
+        uint32_t* columns = band ? realloc(cd->columns, frame->width * sizeof(*columns)) : NULL;
+
+        if (band) {
+            cd->band = band;
+        }
+        if (!columns) {
+            return AVERROR(ENOMEM);
+        }
+        cd->columns = columns;
+        cd->columns_size = frame->width;
+    }
+    for (int y = 0; y < frame->height; y++) {
+        if ((int64_t)luma_row_sum(frame->data[0] + (ptrdiff_t)y * frame->linesize[0], frame->width) > row_limit) {
+            top = top < 0 ? y : top;
+            bottom = y;
+        }
+    }
+    /* All black: says nothing about where the picture is */
+    if (top < 0) {
+        return 0;
+    }
+
+    /* Columns only over the rows with picture, or letterbox bars would hide pillarbox ones */
+    memset(cd->columns, 0, frame->width * sizeof(*cd->columns));
+    for (int y0 = top; y0 <= bottom; y0 += 256) {
+        memset(cd->band, 0, frame->width * sizeof(*cd->band));
+        for (int y = y0; y < FFMIN(y0 + 256, bottom + 1); y++) {
+            luma_accumulate(cd->band, frame->data[0] + (ptrdiff_t)y * frame->linesize[0], frame->width);
+        }
+        for (int x = 0; x < frame->width; x++) {
+            cd->columns[x] += cd->band[x];
+        }
+    }
+    column_limit = (int64_t)(black + cd->limit) * (bottom - top + 1);
+    for (int x = 0; x < frame->width; x++) {
+        if (cd->columns[x] > column_limit) {
+            left = left < 0 ? x : left;
+            right = x;
+        }
+    }
+
+    if (left < 0) {
+        return 0;
+    }
+    if (!cd->found) {
+        cd->found = 1;
+        cd->left = left;
+        cd->top = top;
+        cd->right = right;
+        cd->bottom = bottom;
+    } else {
+        cd->left = FFMIN(cd->left, left);
+        cd->top = FFMIN(cd->top, top);
+        cd->right = FFMAX(cd->right, right);
+        cd->bottom = FFMAX(cd->bottom, bottom);
+    }
+
+    return 0;
+}
+
+/**
+ * Find the active picture area of filename from samples key frames with its own request.
+ * Edges are widened to even pixels so 4:2:0 chroma crops with the luma.
+ */
+static int detect_crop(const char* filename, int samples, int limit, struct crop_rect* crop,
+                       struct request_stats* stats) {
+    struct request req = {0};
+    struct crop_detector cd = { .limit = limit };
+    int64_t duration;
+    int ret;
+
+    if ((ret = request_open(&req, filename, 0)) < 0 || (ret = request_open_decoder(&req)) < 0) {
+        request_close(&req);
+        return ret;
+    }
+    duration = req.input_ctx->duration;
+    ret = request_decode_keyframes(&req, duration > 0 ? duration / samples : 0, crop_detector_add, &cd);
+    request_close(&req);
+    if (stats) {
+        *stats = req.stats;
+    }
+    free(cd.band);
+    free(cd.columns);
+
+    if (ret < 0) {
+        return ret;
+    }
+    if (!cd.found) {
+        fprintf(stderr, "No picture found to detect a crop in\n");
+        return AVERROR(EINVAL);
+    }
+    crop->x = cd.left & ~1;
+    crop->y = cd.top & ~1;
+    crop->width = ((cd.right + 2) & ~1) - crop->x;
+    crop->height = ((cd.bottom + 2) & ~1) - crop->y;
+
+    return 0;
+}
+
+static int cropdetect_main(int argc, char** argv) {
+    struct request_stats stats = {0};
+    struct crop_rect crop;
+    int samples = CROP_DEFAULT_SAMPLES;
+    int limit = CROP_DEFAULT_LIMIT;
+    int print_stats_flag = 0;
+
+    static struct option long_options[] = {
+        {"samples", required_argument, 0, 'n'},
+        {"limit", required_argument, 0, 'l'},
+        {"stats", no_argument, 0, OPT_STATS},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0},
+    };
+    int option;
+    while ((option = getopt_long(argc, argv, "n:l:h?", long_options, NULL)) != -1) {
+        switch (option) {
+            case 'n':
+                samples = atoi(optarg);
+                break;
+            case 'l':
+                limit = atoi(optarg);
+                break;
+            case OPT_STATS:
+                print_stats_flag = 1;
+                break;
+            case 'h':
+            case '?':
+                usage(argv[0]);
+                break;
+        }
+    }
+
+    if (argc - optind != 1 || samples < 1) {
+        usage(argv[0]);
+    }
+
+    av_register_all();
+
+    if (detect_crop(argv[optind], samples, limit, &crop, &stats) < 0) {
+        return 1;
+    }
+    printf("crop=%d:%d:%d:%d\n", crop.width, crop.height, crop.x, crop.y);
+    if (print_stats_flag) {
+        print_stats(&stats);
+    }
+
+    return 0;
+}
+
+/**
+ * Parse a --crop argument: "w:h:x:y", or "detect" to find one for filename first.
+ */
+static int crop_option(const char* arg, const char* filename, struct crop_rect* crop) {
+    int ret;
+
+    if (strcmp(arg, "detect")) {
+        return parse_crop(arg, crop);
+    }
+    if ((ret = detect_crop(filename, CROP_DEFAULT_SAMPLES, CROP_DEFAULT_LIMIT, crop, NULL)) >= 0) {
+        fprintf(stderr, "crop=%d:%d:%d:%d\n", crop->width, crop->height, crop->x, crop->y);
+    }
+    return ret;
+}
+
+/*
+ * Thumbnail extraction. `vodtool thumbnails --every S infile` writes a JPEG of the frame at
+ * every S seconds; with --keyframes it takes the first key frame at or after each of those
+ * times instead (every key frame when S is 0), reading and decoding nothing else.
+ */
+struct thumbnail_writer {
+    const char* prefix;
+    AVStream* st;
+    struct mem_budget* budget;
+    /* Applied before encoding, if set */
+    const struct crop_rect* crop;
+    int count;
+};
+
+/* Write the next thumbnail's JPEG; timestamp is in AV_TIME_BASE units */
+static int thumbnail_save(struct thumbnail_writer* writer, const struct out_buffer* jpeg, int64_t timestamp) {
+    char filename[PATH_MAX];
+    FILE* f;
+
+    if (snprintf(filename, sizeof(filename), "%s%06d.jpg", writer->prefix, writer->count) >= sizeof(filename)) {
+        fprintf(stderr, "File name too long: %s\n", writer->prefix);
+        return AVERROR(EINVAL);
+    }
+    if (!(f = fopen(filename, "wb")) || fwrite(jpeg->data, 1, jpeg->len, f) != jpeg->len || fclose(f) != 0) {
+        fprintf(stderr, "Could not write %s: %s\n", filename, strerror(errno));
+        return AVERROR(errno);
+    }
+
+    printf("thumbnail=%d;timestamp=%" PRId64 ";file=%s\n", writer->count++, timestamp, filename);
+
+    return 0;
+}
+
+static int64_t frame_timestamp(AVStream* st, AVFrame* frame) {
+    int64_t pts = frame->best_effort_timestamp != AV_NOPTS_VALUE ? frame->best_effort_timestamp : frame->pts;
+
+    return pts == AV_NOPTS_VALUE ? AV_NOPTS_VALUE : to_av_timebase(pts, st->time_base);
+}
+
+static int thumbnail_write(void* opaque, AVFrame* frame) {
+    struct thumbnail_writer* writer = opaque;
+    struct out_buffer out = { .budget = writer->budget };
+    int64_t timestamp = frame_timestamp(writer->st, frame);
+    int ret;
+
+    if ((!writer->crop || (ret = apply_crop(frame, writer->crop)) >= 0) && (ret = encode_jpeg(frame, &out)) >= 0) {
+        ret = thumbnail_save(writer, &out, timestamp);
+    }
+    out_buffer_free(&out);
+
+    return ret;
+}
+
+/*
+ * GOP-parallel extraction. The --every targets are grouped by the key frame they decode
+ * from. GOPs are independent, so workers, each with its own input and single threaded
+ * decoder, take them in turn; within a GOP a worker carries on from one target to the next
+ * without seeking again. The JPEGs are written in timestamp order as soon as every GOP before
+ * them is done, and workers stay at most GOP_MAX_AHEAD GOPs per worker ahead of the writer,
+ * so only that many GOPs' JPEGs are held at once.
+ */
+#define GOP_MAX_AHEAD 2
+/* Most --every targets in one run */
+#define EVERY_MAX_TARGETS 1000000
+
+struct gop_target {
+    int64_t timestamp;
+    int64_t keyframe;
+    /* Filled in by the worker */
+    int status;
+    int64_t frame_timestamp;
+    struct out_buffer jpeg;
+};
+
+struct gop_job {
+    const char* filename;
+    struct gop_target* targets;
+    /* The index of the first target of each GOP, then nb_targets */
+    int* gops;
+    int nb_gops;
+    /* Decoder threads for each worker, 0 for the usual choice */
+    int thread_count;
+    const struct crop_rect* crop;
+    /* Shared by the workers' output buffers */
+    struct mem_budget budget;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* Under lock: the next GOP to take, which are done, how many the writer is past, how
+     * many GOPs may be done or in progress past that, the workers still running and whether
+     * to stop */
+    int next_gop;
+    uint8_t* done;
+    int written;
+    int max_ahead;
+    int workers;
+    int abort;
+    struct request_stats stats;
+};
+
+static void* gop_worker(void* opaque) {
+    struct gop_job* job = opaque;
+    struct request req = { .thread_type = FF_THREAD_SLICE, .thread_count = job->thread_count };
+    AVFrame* frame = av_frame_alloc();
+    int gop;
+
+    if (!frame || request_open(&req, job->filename, 0) < 0 || request_open_decoder(&req) < 0) {
+        /* The other workers take this one's share */
+        goto end;
+    }
+
+    for (;;) {
+        int ret = 0;
+
+        pthread_mutex_lock(&job->lock);
+        while (!job->abort && job->next_gop < job->nb_gops && job->next_gop >= job->written + job->max_ahead) {
+            pthread_cond_wait(&job->cond, &job->lock);
+        }
+        gop = job->abort ? job->nb_gops : job->next_gop++;
+        pthread_mutex_unlock(&job->lock);
+        if (gop >= job->nb_gops) {
+            break;
+        }
+
+        for (int i = job->gops[gop]; i < job->gops[gop + 1]; i++) {
+            struct gop_target* target = &job->targets[i];
+
+            if (ret >= 0) {
+                ret = i == job->gops[gop] ? request_decode_frame(&req, target->timestamp, frame)
+                                          : decode_until(&req, target->timestamp, frame);
+            }
+            if (ret >= 0) {
+                target->jpeg.budget = &job->budget;
+                target->frame_timestamp = frame_timestamp(req.input_ctx->streams[req.video_stream], frame);
+                if (!job->crop || (ret = apply_crop(frame, job->crop)) >= 0) {
+                    ret = encode_jpeg(frame, &target->jpeg);
+                }
+                av_frame_unref(frame);
+            }
+            /* Past the last frame, the rest of the GOP is too */
+            target->status = ret;
+        }
+
+        pthread_mutex_lock(&job->lock);
+        job->done[gop] = 1;
+        pthread_cond_broadcast(&job->cond);
+        pthread_mutex_unlock(&job->lock);
+    }
+
+end:
+    av_frame_free(&frame);
+    request_close(&req);
+
+    pthread_mutex_lock(&job->lock);
+    job->stats.packets_read += req.stats.packets_read;
+    job->stats.packets_decoded += req.stats.packets_decoded;
+    job->stats.frames_decoded += req.stats.frames_decoded;
+    job->stats.mem_peak = FFMAX(job->stats.mem_peak, req.stats.mem_peak);
+    job->stats.bytes_read += req.stats.bytes_read;
+    job->workers--;
+    pthread_cond_broadcast(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+
+    return NULL;
+}
+
+/**
+ * Extract the frames at every interval (AV_TIME_BASE units) of the input req has open, with
+ * up to jobs workers, and write them in order as they are done. Targets past the last frame
+ * are reported and skipped; any other failure stops the extraction.
+ */
+static int extract_every(struct request* req, const char* filename, int64_t interval, int jobs,
+                         struct thumbnail_writer* writer, struct request_stats* stats) {
+    struct gop_job job = { .filename = filename, .crop = writer->crop };
+    pthread_t* threads = NULL;
+    int64_t duration = req->input_ctx->duration;
+    int64_t count = duration > 0 ? (duration - 1) / interval + 1 : 1;
+    int nb_targets;
+    int nb_threads = 0;
+    int skipped = 0;
+    int ret = 0;
+
+    if (count > EVERY_MAX_TARGETS) {
+        fprintf(stderr, "An interval of %" PRId64 "us gives %" PRId64 " frames over %s, more than the %d allowed\n",
+                interval, count, filename, EVERY_MAX_TARGETS);
+        return AVERROR(EINVAL);
+    }
+    nb_targets = count;
+
+    job.targets = calloc(nb_targets, sizeof(*job.targets));
+    job.gops = calloc(nb_targets + 1, sizeof(*job.gops));
+    job.done = calloc(nb_targets, sizeof(*job.done));
+    if (!job.targets || !job.gops || !job.done) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    for (int i = 0; i < nb_targets; i++) {
+        struct seek_plan plan;
+
+        plan_seek(req, i * interval, &plan);
+        job.targets[i] = (struct gop_target){ .timestamp = i * interval, .keyframe = plan.keyframe, .status = AVERROR(ECANCELED) };
+        if (!i || plan.keyframe != job.targets[i - 1].keyframe) {
+            job.gops[job.nb_gops++] = i;
+        }
+    }
+    job.gops[job.nb_gops] = nb_targets;
+
+    /* Frame threading scales poorly past a few threads; the GOPs are the parallelism */
+    jobs = FFMIN(jobs, job.nb_gops);
+    job.thread_count = jobs > 1 ? 1 : 0;
+    job.max_ahead = jobs * GOP_MAX_AHEAD;
+    job.workers = jobs;
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.cond, NULL);
+    if (!(threads = calloc(jobs, sizeof(*threads)))) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    for (; nb_threads < jobs; nb_threads++) {
+        if (pthread_create(&threads[nb_threads], NULL, gop_worker, &job) != 0) {
+            fprintf(stderr, "Could not start worker\n");
+            pthread_mutex_lock(&job.lock);
+            job.workers -= jobs - nb_threads;
+            pthread_mutex_unlock(&job.lock);
+            break;
+        }
+    }
+
+    for (int gop = 0; gop < job.nb_gops && ret >= 0; gop++) {
+        /* Once all workers are gone, what is not done never will be */
+        pthread_mutex_lock(&job.lock);
+        while (!job.done[gop] && job.workers > 0) {
+            pthread_cond_wait(&job.cond, &job.lock);
+        }
+        pthread_mutex_unlock(&job.lock);
+
+        for (int i = job.gops[gop]; i < job.gops[gop + 1] && ret >= 0; i++) {
+            struct gop_target* target = &job.targets[i];
+
+            if (target->status == AVERROR_EOF) {
+                fprintf(stderr, "No frame at timestamp=%" PRId64 ", skipped\n", target->timestamp);
+                skipped++;
+            } else if ((ret = target->status) < 0) {
+                fprintf(stderr, "Could not extract the frame at timestamp=%" PRId64 "\n", target->timestamp);
+            } else {
+                ret = thumbnail_save(writer, &target->jpeg, target->frame_timestamp);
+            }
+            out_buffer_free(&target->jpeg);
+        }
+
+        pthread_mutex_lock(&job.lock);
+        job.written = gop + 1;
+        job.abort = ret < 0;
+        pthread_cond_broadcast(&job.cond);
+        pthread_mutex_unlock(&job.lock);
+    }
+    for (int i = 0; i < nb_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    if (skipped) {
+        fprintf(stderr, "Skipped %d of %d frames\n", skipped, nb_targets);
+    }
+    *stats = job.stats;
+    pthread_cond_destroy(&job.cond);
+    pthread_mutex_destroy(&job.lock);
+
+end:
+    if (job.targets) {
+        for (int i = 0; i < nb_targets; i++) {
+            out_buffer_free(&job.targets[i].jpeg);
+        }
+    }
+    free(threads);
+    free(job.targets);
+    free(job.gops);
+    free(job.done);
+
+    return ret;
+}
+
+static int thumbnails_main(int argc, char** argv) {
+    struct request req = {0};
+    struct request_stats stats = {0};
+    struct thumbnail_writer writer = { .prefix = "thumb-" };
+    const char* input_filename;
+    double every = -1;
+    int keyframes = 0;
+    int jobs = available_cpus();
+    const char* crop_arg = NULL;
+    struct crop_rect crop;
+    int print_stats_flag = 0;
+    int ret = 0;
+
+    static struct option long_options[] = {
+        {"every", required_argument, 0, 'e'},
+        {"keyframes", no_argument, 0, 'k'},
+        {"jobs", required_argument, 0, 'j'},
+        {"output", required_argument, 0, 'o'},
+        {"crop", required_argument, 0, 'c'},
+        {"stats", no_argument, 0, OPT_STATS},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0},
+    };
+    int option;
+    while ((option = getopt_long(argc, argv, "e:kj:o:c:h?", long_options, NULL)) != -1) {
+        switch (option) {
+            case 'e':
+                every = atof(optarg);
+                break;
+            case 'k':
+                keyframes = 1;
+                break;
+            case 'j':
+                jobs = atoi(optarg);
+                break;
+            case 'o':
+                writer.prefix = optarg;
+                break;
+            case 'c':
+                crop_arg = optarg;
+                break;
+            case OPT_STATS:
+                print_stats_flag = 1;
+                break;
+            case 'h':
+            case '?':
+                usage(argv[0]);
+                break;
+        }
+    }
+
+    if (every < 0 && keyframes) {
+        every = 0;
+    }
+    if (argc - optind != 1 || every < 0 || (every * AV_TIME_BASE < 1 && !keyframes) || jobs < 1) {
+        usage(argv[0]);
+    }
+
+    av_register_all();
+
+    input_filename = argv[optind];
+    if (crop_arg) {
+        if (crop_option(crop_arg, input_filename, &crop) < 0) {
+            return 1;
+        }
+        writer.crop = &crop;
+    }
+    if (request_open(&req, input_filename, 0) < 0) {
+        return 1;
+    }
+
+    if (keyframes) {
+        if (request_open_decoder(&req) < 0) {
+            return 1;
+        }
+        writer.st = req.input_ctx->streams[req.video_stream];
+        writer.budget = &req.budget;
+        ret = request_decode_keyframes(&req, every * AV_TIME_BASE, thumbnail_write, &writer);
+        request_close(&req);
+        stats = req.stats;
+    } else {
+        /* This request only plans the GOPs; the workers open their own */
+        ret = extract_every(&req, input_filename, every * AV_TIME_BASE, jobs, &writer, &stats);
+        request_close(&req);
+    }
+
+    if (print_stats_flag) {
+        print_stats(&stats);
+    }
+
+    return ret < 0 ? 1 : 0;
+}
+
+/*
+ * Scene cuts. The score of a frame is its mean absolute difference from the previous one on
+ * the grid, less the previous frame's, as a percentage of full scale: a cut is a jump in
+ * difference, so steady motion and fades do not count. Sparse frames, such as key frames
+ * only, are seconds apart and scored on the difference alone.
+ */
+#define SCENE_DEFAULT_THRESHOLD 10.0
+
+struct scene_detector {
+    int sparse;
+    struct luma_grid grids[2];
+    int current;
+    int frames;
+    double prev_diff;
+};
+
+/**
+ * Add the next frame. Returns its score, 0 to 100, or a negative error.
+ */
+static double scene_detector_add(struct scene_detector* sd, const AVFrame* frame) {
+    struct luma_grid* prev = &sd->grids[sd->current];
+    struct luma_grid* cur = &sd->grids[!sd->current];
+    double diff;
+    double score;
+    int ret;
+
+    if (!luma_supported(frame)) {
+        fprintf(stderr, "Unsupported pixel format for luma analysis: %s\n", av_get_pix_fmt_name(frame->format));
+        return AVERROR(ENOSYS);
+    }
+    if ((ret = luma_grid_update(cur, frame)) < 0) {
+        return ret;
+    }
+    sd->current = !sd->current;
+
+    if (!sd->frames++) {
+        return 0;
+    }
+    if (prev->width != cur->width || prev->height != cur->height) {
+        sd->prev_diff = 0;
+        return 100;
+    }
+
+    diff = (double)luma_sad(prev->cells, cur->cells, cur->width * cur->height) / (cur->width * cur->height);
+    score = (sd->sparse ? diff : FFMIN(diff, FFABS(diff - sd->prev_diff))) * 100 / 255;
+    sd->prev_diff = diff;
+
+    return score;
+}
+
+static void scene_detector_free(struct scene_detector* sd) {
+    free(sd->grids[0].columns);
+    free(sd->grids[1].columns);
+}
+
+struct scene_writer {
+    struct scene_detector detector;
+    AVStream* st;
+    double threshold;
+    int scenes;
+};
+
+static int scene_write(void* opaque, AVFrame* frame) {
+    struct scene_writer* writer = opaque;
+    double score = scene_detector_add(&writer->detector, frame);
+
+    if (score < 0) {
+        return score;
+    }
+    if (score >= writer->threshold) {
+        printf("scene=%d;timestamp=%" PRId64 ";score=%.2f\n", ++writer->scenes,
+               frame_timestamp(writer->st, frame), score);
+    }
+
+    return 0;
+}
+
+static int scenes_main(int argc, char** argv) {
+    struct request req = {0};
+    struct scene_writer writer = { .threshold = SCENE_DEFAULT_THRESHOLD };
+    const char* input_filename;
+    int keyframes = 0;
+    int print_stats_flag = 0;
+    int ret;
+
+    static struct option long_options[] = {
+        {"keyframes", no_argument, 0, 'k'},
+        {"threshold", required_argument, 0, 'T'},
+        {"stats", no_argument, 0, OPT_STATS},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0},
+    };
+    int option;
+    while ((option = getopt_long(argc, argv, "kT:h?", long_options, NULL)) != -1) {
+        switch (option) {
+            case 'k':
+                keyframes = 1;
+                break;
+            case 'T':
+                writer.threshold = atof(optarg);
+                break;
+            case OPT_STATS:
+                print_stats_flag = 1;
+                break;
+            case 'h':
+            case '?':
+                usage(argv[0]);
+                break;
+        }
+    }
+
+    if (argc - optind != 1) {
+        usage(argv[0]);
+    }
+
+    av_register_all();
+
+    input_filename = argv[optind];
+    /* A full pass is throughput bound: let the decoder use the CPUs */
+    if (!keyframes) {
+        req.thread_type = FF_THREAD_FRAME;
+        req.thread_count = available_cpus();
+    }
+    if (request_open(&req, input_filename, 0) < 0 || request_open_decoder(&req) < 0) {
+        return 1;
+    }
+    writer.st = req.input_ctx->streams[req.video_stream];
+    writer.detector.sparse = keyframes;
+
+    ret = keyframes ? request_decode_keyframes(&req, 0, scene_write, &writer)
+                    : request_decode_all(&req, scene_write, &writer);
+
+    request_close(&req);
+    scene_detector_free(&writer.detector);
+    if (print_stats_flag) {
+        print_stats(&req.stats);
+    }
+
+    return ret < 0 ? 1 : 0;
+}
+
+/*
+ * Black and freeze detection, for skipping intros and credits. A frame is black when nearly
+ * all of its luma is at or below a level just above black; it is frozen when its grid (see
+ * Luma analysis) is all but identical to the previous frame's. Runs of either that last long
+ * enough are printed as time ranges.
+ */
+#define DETECT_DEFAULT_MIN_DURATION 2.0
+#define DETECT_DEFAULT_BLACK_RATIO 0.98
+/* Share of the nominal luma range above black that still counts as black */
+#define DETECT_BLACK_LEVEL 0.10
+/* Mean absolute grid difference, in % of full scale, below which frames are the same */
+#define DETECT_DEFAULT_NOISE 0.1
+
+struct detect_range {
+    const char* type;
+    int64_t min_duration;
+    int active;
+    int64_t start;
+};
+
+/* Feed whether the frame at timestamp matches; print the range that ends, if long enough */
+static void detect_range_update(struct detect_range* range, int match, int64_t timestamp) {
+    if (match && !range->active) {
+        range->active = 1;
+        range->start = timestamp;
+    } else if (!match && range->active) {
+        range->active = 0;
+        if (timestamp - range->start >= range->min_duration) {
+            printf("type=%s;start=%" PRId64 ";end=%" PRId64 ";duration=%" PRId64 "\n", range->type,
+                   range->start, timestamp, timestamp - range->start);
+        }
+    }
+}
+
+struct detector {
+    AVStream* st;
+    double black_ratio;
+    double noise;
+    struct detect_range black;
+    struct detect_range freeze;
+    struct luma_grid grids[2];
+    int current;
+    int frames;
+    int64_t last_timestamp;
+};
+
+static int detect_frame(void* opaque, AVFrame* frame) {
+    struct detector* d = opaque;
+    struct luma_grid* prev = &d->grids[d->current];
+    struct luma_grid* cur = &d->grids[!d->current];
+    int64_t timestamp = frame_timestamp(d->st, frame);
+    int full_range = frame->color_range == AVCOL_RANGE_JPEG;
+    int black = full_range ? 0 : 16;
+    int white = full_range ? 255 : 235;
+    struct luma_stats stats;
+    int frozen = 0;
+    int ret;
+
+    if (!luma_supported(frame)) {
+        fprintf(stderr, "Unsupported pixel format for luma analysis: %s\n", av_get_pix_fmt_name(frame->format));
+        return AVERROR(ENOSYS);
+    }
+    if (timestamp == AV_NOPTS_VALUE) {
+        return 0;
+    }
+
+    luma_stats(frame, black + (int)(DETECT_BLACK_LEVEL * (white - black)), &stats);
+    detect_range_update(&d->black, stats.dark >= d->black_ratio, timestamp);
+
+    if ((ret = luma_grid_update(cur, frame)) < 0) {
+        return ret;
+    }
+    d->current = !d->current;
+    if (d->frames++ && prev->width == cur->width && prev->height == cur->height) {
+        int cells = cur->width * cur->height;
+
+        frozen = (double)luma_sad(prev->cells, cur->cells, cells) / cells * 100 / 255 < d->noise;
+    }
+    /* A freeze starts with the frame the next ones repeat */
+    detect_range_update(&d->freeze, frozen, frozen && !d->freeze.active ? d->last_timestamp : timestamp);
+    d->last_timestamp = timestamp;
+
+    return 0;
+}
+
+static int detect_main(int argc, char** argv) {
+    struct request req = {
+        /* Every frame is needed: let the decoder use the CPUs */
+        .thread_type = FF_THREAD_FRAME,
+        .thread_count = available_cpus(),
+    };
+    struct detector d = {
+        .black_ratio = DETECT_DEFAULT_BLACK_RATIO,
+        .noise = DETECT_DEFAULT_NOISE,
+        .black = { .type = "black" },
+        .freeze = { .type = "freeze" },
+    };
+    double black_min = DETECT_DEFAULT_MIN_DURATION;
+    double freeze_min = DETECT_DEFAULT_MIN_DURATION;
+    const char* input_filename;
+    int print_stats_flag = 0;
+    int ret;
+
+    static struct option long_options[] = {
+        {"black-min", required_argument, 0, 'b'},
+        {"freeze-min", required_argument, 0, 'f'},
+        {"black-ratio", required_argument, 0, 'r'},
+        {"noise", required_argument, 0, 'n'},
+        {"stats", no_argument, 0, OPT_STATS},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0},
+    };
+    int option;
+    while ((option = getopt_long(argc, argv, "b:f:r:n:h?", long_options, NULL)) != -1) {
+        switch (option) {
+            case 'b':
+                black_min = atof(optarg);
+                break;
+            case 'f':
+                freeze_min = atof(optarg);
+                break;
+            case 'r':
+                d.black_ratio = atof(optarg);
+                break;
+            case 'n':
+                d.noise = atof(optarg);
+                break;
+            case OPT_STATS:
+                print_stats_flag = 1;
+                break;
+            case 'h':
+            case '?':
+                usage(argv[0]);
+                break;
+        }
+    }
+
+    if (argc - optind != 1) {
+        usage(argv[0]);
+    }
+    d.black.min_duration = black_min * AV_TIME_BASE;
+    d.freeze.min_duration = freeze_min * AV_TIME_BASE;
+
+    av_register_all();
+
+    input_filename = argv[optind];
+    if (request_open(&req, input_filename, 0) < 0 || request_open_decoder(&req) < 0) {
+        return 1;
+    }
+    d.st = req.input_ctx->streams[req.video_stream];
+
+    ret = request_decode_all(&req, detect_frame, &d);
+    /* Ranges still open run to the last frame */
+    detect_range_update(&d.black, 0, d.last_timestamp);
+    detect_range_update(&d.freeze, 0, d.last_timestamp);
+
+    request_close(&req);
+    free(d.grids[0].columns);
+    free(d.grids[1].columns);
+    if (print_stats_flag) {
+        print_stats(&req.stats);
+    }
+
+    return ret < 0 ? 1 : 0;
+}
+
+/*
+ * Representative frames. The frame at a requested time is often a blur or half of a
+ * transition. request_decode_best_frame() also looks at the key frames in a window around
+ * it, and keeps the candidate that scores best on sharpness (Laplacian variance, relative to
+ * the sharpest candidate), exposure and distance from a cut: each candidate is compared with
+ * the next frame decoded after it, and a large difference means it sits on a transition.
+ * Key frames need no pre-roll, so each costs a seek and two decodes, with frames that nothing
+ * refers to skipped; only the frame asked for is pre-rolled from its key frame as usual. The
+ * whole pick costs little more than fetching that one frame.
+ */
+#define BEST_MAX_KEYFRAMES 7
+
+struct best_candidate {
+    AVFrame* frame;
+    int valid;
+    int64_t timestamp;
+    double sharpness;
+    double exposure;
+    double transition;
+};
+
+/**
+ * Score the candidate in c->frame, against next, the frame after it, when there is one.
+ * grids are scratch.
+ */
+static void best_candidate_score(struct best_candidate* c, const AVFrame* next, struct luma_grid* grids) {
+    int full_range;
+    int black;
+    int white;
+    struct luma_stats stats;
+
+    if (!luma_supported(c->frame)) {
+        return;
+    }
+
+    full_range = c->frame->color_range == AVCOL_RANGE_JPEG;
+    black = full_range ? 0 : 16;
+    white = full_range ? 255 : 235;
+    luma_stats(c->frame, black + (int)(DETECT_BLACK_LEVEL * (white - black)), &stats);
+    c->exposure = 1 - FFMIN(1, FFABS(stats.mean - (black + white) / 2.0) / ((white - black) / 2.0));
+    c->sharpness = luma_laplacian_variance(c->frame);
+
+    /* Without the following frame only the cut check is lost */
+    if (next && luma_grid_update(&grids[0], c->frame) >= 0 && luma_grid_update(&grids[1], next) >= 0 &&
+        grids[0].width == grids[1].width && grids[0].height == grids[1].height) {
+        int cells = grids[0].width * grids[0].height;
+        double diff = (double)luma_sad(grids[0].cells, grids[1].cells, cells) / cells * 100 / 255;
+
+        c->transition = FFMIN(1, diff / SCENE_DEFAULT_THRESHOLD);
+    }
+}
+
+/**
+ * Decode the best frame within window / 2 of timestamp (AV_TIME_BASE units, window > 0) into
+ * frame.
+ */
+static int request_decode_best_frame(struct request* req, int64_t timestamp, int64_t window, AVFrame* frame) {
+    AVStream* st = req->input_ctx->streams[req->video_stream];
+    struct best_candidate candidates[BEST_MAX_KEYFRAMES + 1] = {{0}};
+    struct luma_grid grids[2] = {{0}};
+    int64_t times[BEST_MAX_KEYFRAMES + 1];
+    int nb_candidates = 0;
+    int target = 0;
+    AVFrame* next = av_frame_alloc();
+    int has_next = 0;
+    double max_sharpness = 0;
+    double best_score = 0;
+    int best = -1;
+    int ret = 0;
+
+    if (!next) {
+        return AVERROR(ENOMEM);
+    }
+
+    /* The nearest key frames in the window, in file order */
+    for (int i = 0; i < st->nb_index_entries; i++) {
+        int64_t ts = to_av_timebase(st->index_entries[i].timestamp, st->time_base);
+
+        if (!(st->index_entries[i].flags & AVINDEX_KEYFRAME) || ts == timestamp ||
+            FFABS(ts - timestamp) > window / 2) {
+            continue;
+        }
+        if (nb_candidates == BEST_MAX_KEYFRAMES) {
+            /* From here on they only get further away */
+            if (FFABS(ts - timestamp) >= FFABS(times[0] - timestamp)) {
+                break;
+            }
+            memmove(times, times + 1, --nb_candidates * sizeof(*times));
+        }
+        times[nb_candidates++] = ts;
+    }
+    /* And the frame asked for, in its place */
+    while (target < nb_candidates && times[target] < timestamp) {
+        target++;
+    }
+    memmove(times + target + 1, times + target, (nb_candidates - target) * sizeof(*times));
+    times[target] = timestamp;
+    nb_candidates++;
+
+    for (int i = 0; i < nb_candidates; i++) {
+        struct best_candidate* c = &candidates[i];
+
+        if (!(c->frame = av_frame_alloc())) {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+        /* Seeking to a key frame decodes it first; the cut check only needs one more */
+        req->dec_ctx->skip_frame = i == target ? AVDISCARD_DEFAULT : AVDISCARD_NONREF;
+        if ((ret = request_decode_frame(req, times[i], c->frame)) < 0) {
+            /* Only the frame asked for has to be there */
+            if (i == target) {
+                goto end;
+            }
+            continue;
+        }
+        c->valid = 1;
+        c->timestamp = frame_timestamp(st, c->frame);
+        has_next = c->timestamp != AV_NOPTS_VALUE && decode_until(req, c->timestamp + 1, next) >= 0;
+        best_candidate_score(c, has_next ? next : NULL, grids);
+        max_sharpness = FFMAX(max_sharpness, c->sharpness);
+        av_frame_unref(next);
+    }
+    ret = 0;
+
+    for (int i = 0; i < nb_candidates; i++) {
+        struct best_candidate* c = &candidates[i];
+        double score;
+
+        if (!c->valid) {
+            continue;
+        }
+        /* Sharpness counts most; nearness to the time asked for breaks ties */
+        score = 0.5 * (max_sharpness > 0 ? c->sharpness / max_sharpness : 0) + 0.3 * c->exposure +
+                0.2 * (1 - c->transition);
+        if (c->timestamp != AV_NOPTS_VALUE) {
+            score -= 0.1 * FFABS(c->timestamp - timestamp) / window;
+        }
+        fprintf(stderr, "candidate timestamp=%" PRId64 ";sharpness=%.1f;exposure=%.3f;transition=%.3f;score=%.3f\n",
+                c->timestamp, c->sharpness, c->exposure, c->transition, score);
+        if (best < 0 || score > best_score) {
+            best = i;
+            best_score = score;
+        }
+    }
+    av_frame_move_ref(frame, candidates[best].frame);
+
+end:
+    req->dec_ctx->skip_frame = AVDISCARD_DEFAULT;
+    for (int i = 0; i < nb_candidates; i++) {
+        av_frame_free(&candidates[i].frame);
+    }
+    free(grids[0].columns);
+    free(grids[1].columns);
+    av_frame_free(&next);
+
+    return ret;
+}
+
+/*
+ * Shared response cache. Finished playlists, segments and thumbnails are kept in a POSIX
+ * shared memory region mapped by every server process, so a response built by one worker
+ * process can be served by the others.
+ *
+ * Bodies are appended to a circular arena, overwriting the oldest ones. Each body has a slot
+ * in an open-addressed table. Writers take a process-shared mutex. Readers take no lock: a
+ * slot is guarded by a sequence count that is odd while the slot changes, and a copied body
+ * is only trusted if the arena head has not wrapped over it in the meantime.
+ */
+
+#define SHM_CACHE_SLOTS 4096
+#define SHM_CACHE_PROBES 8
+#define SHM_CACHE_KEY_SIZE 256
+
+struct shm_cache_slot {
+    atomic_uint seq;
+    uint64_t hash;
+    char key[SHM_CACHE_KEY_SIZE];
+    /* Position in the arena, counting every byte ever written */
+    uint64_t offset;
+    uint64_t len;
+};
+
+struct shm_cache {
+    pthread_mutex_t lock;
+    uint64_t arena_size;
+    atomic_uint_fast64_t head;
+
+    atomic_uint_fast64_t hits;
+    atomic_uint_fast64_t misses;
+    atomic_uint_fast64_t inserts;
+
+    struct shm_cache_slot slots[SHM_CACHE_SLOTS];
+    uint8_t arena[];
+};
+
+/**
+ * Map a new cache with an arena of size bytes. The region is unlinked straight away; it is
+ * shared with the worker processes by inheritance.
+ */
+static struct shm_cache* shm_cache_create(int64_t size) {
+    char name[64];
+    struct shm_cache* cache;
+    pthread_mutexattr_t attr;
+    size_t total = sizeof(*cache) + size;
+    int fd;
+
+    snprintf(name, sizeof(name), "/vodtool-%d", (int)getpid());
+    if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600)) < 0) {
+        fprintf(stderr, "Could not create shared cache: %s\n", strerror(errno));
+        return NULL;
+    }
+    shm_unlink(name);
+    if (ftruncate(fd, total) < 0 ||
+        (cache = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        fprintf(stderr, "Could not map shared cache: %s\n", strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    close(fd);
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&cache->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    cache->arena_size = size;
+
+    return cache;
+}
+
+/**
+ * Take the writer lock. A worker process that died holding it can have left one slot half
+ * written, recognisable by its odd sequence count; that slot is emptied.
+ */
+static void shm_cache_lock(struct shm_cache* cache) {
+    if (pthread_mutex_lock(&cache->lock) != EOWNERDEAD) {
+        return;
+    }
+
+    for (int i = 0; i < SHM_CACHE_SLOTS; i++) {
+        struct shm_cache_slot* slot = &cache->slots[i];
+
+        if (atomic_load(&slot->seq) & 1) {
+            slot->hash = 0;
+            slot->len = 0;
+            atomic_fetch_add_explicit(&slot->seq, 1, memory_order_release);
+        }
+    }
+    pthread_mutex_consistent(&cache->lock);
+}
+
+static void shm_cache_copy_out(const struct shm_cache* cache, uint8_t* dst, uint64_t offset, uint64_t len) {
+    uint64_t start = offset % cache->arena_size;
+    uint64_t first = FFMIN(len, cache->arena_size - start);
+
+    memcpy(dst, cache->arena + start, first);
+    memcpy(dst + first, cache->arena, len - first);
+}
+
+/**
+ * Look up key. On a hit a copy of the body is returned in *data, to be freed by the caller.
+ */
+static int shm_cache_get(struct shm_cache* cache, const char* key, uint8_t** data, size_t* len) {
+    uint64_t hash = fnv1a(key, strlen(key), FNV1A_INIT);
+
+    for (int i = 0; i < SHM_CACHE_PROBES; i++) {
+        struct shm_cache_slot* slot = &cache->slots[(hash + i) % SHM_CACHE_SLOTS];
+        unsigned seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        uint64_t offset, size;
+        uint8_t* copy;
+
+        if ((seq & 1) || slot->hash != hash || strncmp(slot->key, key, SHM_CACHE_KEY_SIZE)) {
+            continue;
+        }
+        offset = slot->offset;
+        size = slot->len;
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq) {
+            continue;
+        }
+        if (!(copy = malloc(FFMAX(size, 1)))) {
+            return AVERROR(ENOMEM);
+        }
+
+        shm_cache_copy_out(cache, copy, offset, size);
+
+        /* Neither the slot nor the bytes under the copy may have been reused meanwhile */
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq ||
+            atomic_load_explicit(&cache->head, memory_order_relaxed) - offset > cache->arena_size) {
+            free(copy);
+            continue;
+        }
+
+        atomic_fetch_add(&cache->hits, 1);
+        *data = copy;
+        *len = size;
+        return 1;
+    }
+
+    atomic_fetch_add(&cache->misses, 1);
+    return 0;
+}
+
+/**
+ * Store a body under key. Bodies larger than an eighth of the arena would push out too much
+ * to be worth it and are not stored.
+ */
+static void shm_cache_put(struct shm_cache* cache, const char* key, const uint8_t* data, size_t len) {
+    uint64_t hash = fnv1a(key, strlen(key), FNV1A_INIT);
+    struct shm_cache_slot* victim = NULL;
+    uint64_t offset, start, first;
+
+    if (strlen(key) >= SHM_CACHE_KEY_SIZE || len > cache->arena_size / 8) {
+        return;
+    }
+
+    shm_cache_lock(cache);
+
+    /* Reuse the key's own slot, else a free one, else the one with the oldest body */
+    for (int i = 0; i < SHM_CACHE_PROBES; i++) {
+        struct shm_cache_slot* slot = &cache->slots[(hash + i) % SHM_CACHE_SLOTS];
+
+        if (slot->hash == hash && !strcmp(slot->key, key)) {
+            victim = slot;
+            break;
+        }
+        if (!victim || (slot->hash ? slot->offset : 0) < (victim->hash ? victim->offset : 0)) {
+            victim = slot;
+        }
+    }
+    offset = atomic_load_explicit(&cache->head, memory_order_relaxed);
+
+    atomic_store_explicit(&victim->seq, victim->seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    /* Claim the bytes before overwriting them, so readers of older bodies notice */
+    atomic_store_explicit(&cache->head, offset + len, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    start = offset % cache->arena_size;
+    first = FFMIN(len, cache->arena_size - start);
+    memcpy(cache->arena + start, data, first);
+    memcpy(cache->arena, data + first, len - first);
+
+    victim->hash = hash;
+    strcpy(victim->key, key);
+    victim->offset = offset;
+    victim->len = len;
+    atomic_store_explicit(&victim->seq, victim->seq + 1, memory_order_release);
+
+    atomic_fetch_add(&cache->inserts, 1);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+static void shm_cache_print_stats(struct shm_cache* cache) {
+    fprintf(stderr, "shm_cache_hits=%" PRIu64 ";shm_cache_misses=%" PRIu64 ";shm_cache_inserts=%" PRIu64
+            ";shm_cache_bytes_written=%" PRIu64 "\n",
+            (uint64_t)atomic_load(&cache->hits), (uint64_t)atomic_load(&cache->misses),
+            (uint64_t)atomic_load(&cache->inserts), (uint64_t)atomic_load(&cache->head));
+}
+
+/*
+ * Server
+ *
+ * A single thread runs a non-blocking epoll loop that accepts connections, parses requests and
+ * writes responses. Parsed requests are handed as jobs to a fixed pool of decode workers; a
+ * worker runs the job and hands it back to the loop through an eventfd. While a connection
+ * has work with the workers it is removed from the epoll set, so its requests are answered in
+ * order.
+ */
+
+#define SERVER_MAX_EVENTS 64
+#define SERVER_LISTEN_BACKLOG 1024
+#define HTTP_MAX_HEADER 8192
+/* How long a client may take to accept more of a streamed response once HTTP_STREAM_PENDING
+ * bytes are waiting, before the request fails; a worker is never held longer than this */
+#define HTTP_SEND_STALL_MS 1000
+/* Bytes of a streamed response a worker buffers for a slow client before it waits for it */
+#define HTTP_STREAM_PENDING (1 << 20)
+
+#define container_of(ptr, type, member) ((type*)((char*)(ptr) - offsetof(type, member)))
+
+/* Starting cost estimates in microseconds, until real requests have been measured */
+#define INITIAL_PLAYLIST_COST 1000
+#define INITIAL_SEGMENT_COST 50000
+#define INITIAL_THUMBNAIL_COST 30000
+#define INITIAL_FRAME_COST 2000
+
+struct server_config {
+    const char* root;
+    int duration;
+    int timescale;
+    int workers;
+    int64_t mem_budget;
+    int64_t deadline;
+    int cache_entries;
+    int64_t cache_size;
+    int decoders;
+    int processes;
+    int64_t shm_cache_size;
+    /* Bind each process to a NUMA node, and size its workers from that node's CPUs */
+    int numa;
+    int numa_workers;
+    /* Set up by serve() */
+    struct shm_cache* shm_cache;
+    struct metrics* metrics;
+    /* Which of the processes' metrics shards this one writes to */
+    int process_index;
+};
+
+enum route {
+    ROUTE_NONE,
+    ROUTE_PLAYLIST,
+    ROUTE_SEGMENT,
+    ROUTE_FMP4_SEGMENT,
+    ROUTE_THUMBNAIL,
+    ROUTE_COUNT,
+};
+
+/**
+ * Scheduling classes, most urgent first. A worker running a job checks between packets for
+ * queued work of a more urgent class and runs it before carrying on.
+ */
+enum priority {
+    PRIORITY_STARTUP,   /* playlists and first segments: playback has not started */
+    PRIORITY_SEEK,      /* other segments and thumbnails a viewer is waiting on */
+    PRIORITY_PREFETCH,
+    PRIORITY_BATCH,     /* pre-generation, sprites */
+    PRIORITY_COUNT,
+};
+
+static const char* const priority_names[PRIORITY_COUNT] = { "startup", "seek", "prefetch", "batch" };
+
+struct server;
+
+/**
+ * A unit of work for the decode workers. run is called on a worker, complete back on the
+ * event loop.
+ */
+struct job {
+    void (*run)(struct server* server, struct job* job);
+    void (*complete)(struct server* server, struct job* job);
+    struct job* next;
+    struct server* server;
+
+    enum route route;
+    enum priority priority;
+    /* av_gettime_relative() time the job is worthless after, 0 for none */
+    int64_t deadline;
+    /* Estimated cost, in microseconds, charged to the queue while the job waits */
+    int64_t cost;
+    /* How dear the item is relative to its route's average, in COST_WEIGHT_ONE units */
+    int64_t weight;
+    /* av_gettime_relative() time the job was queued */
+    int64_t submitted;
+    /* Set by run: the outcome, the measured per-frame decode cost, if any, and the time
+     * spent running preempting jobs */
+    int status;
+    int64_t frame_cost;
+    int64_t preempted;
+};
+
+/* What an epoll event points at */
+enum poll_kind {
+    POLL_EVENT,
+    POLL_HTTP_LISTEN,
+    POLL_HTTP_CONN,
+    POLL_RPC_LISTEN,
+    POLL_RPC_CONN,
+    POLL_SIGNAL,
+    POLL_CHANNEL,
+    POLL_ROUTE_HTTP,
+    POLL_ROUTE_RPC,
+};
+
+struct poll_source {
+    enum poll_kind kind;
+    int fd;
+    int watched;
+};
+
+struct server {
+    struct server_config config;
+    int epoll_fd;
+    struct poll_source event;
+    struct poll_source http_listen;
+    struct poll_source rpc_listen;
+    struct poll_source signal;
+    /* Connections handed over by the cluster router, in a worker process */
+    struct poll_source channel;
+    struct input_cache inputs;
+    struct decoder_pool decoders;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct job* pending[PRIORITY_COUNT];
+    struct job** pending_tail[PRIORITY_COUNT];
+    struct job* done;
+    /* Bit n is set while pending[n] is not empty; read without the lock by server_preempt() */
+    atomic_uint pending_classes;
+
+    /* Admission control, protected by lock */
+    int idle_workers;
+    int64_t queued_cost[PRIORITY_COUNT];
+    int64_t route_cost[ROUTE_COUNT];
+    int64_t frame_cost;
+    struct costmap_cache costmaps;
+
+    /* Metrics shards handed out to this process's threads so far */
+    atomic_int metrics_shards;
+};
+
+/**
+ * Claim the calling thread's metrics shard. A process restarted in a cluster takes over the
+ * shards of the one it replaces: totals carry on, gauges start again from zero.
+ */
+static void server_claim_metrics_shard(struct server* server) {
+    struct metrics* metrics = server->config.metrics;
+    int index = atomic_fetch_add(&server->metrics_shards, 1);
+
+    if (!metrics || index >= metrics->shards_per_process) {
+        return;
+    }
+    metrics_shard = &metrics->shards[server->config.process_index * metrics->shards_per_process + index];
+    for (int i = METRIC_ACTIVE_INPUTS; i < METRIC_COUNT; i++) {
+        atomic_store_explicit(&metrics_shard->counters[i], 0, memory_order_relaxed);
+    }
+}
+
+static int server_watch(struct server* server, struct poll_source* src, uint32_t events) {
+    struct epoll_event ev = { .events = events, .data.ptr = src };
+    int ret = epoll_ctl(server->epoll_fd, src->watched ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, src->fd, &ev);
+
+    src->watched = 1;
+    return ret;
+}
+
+/**
+ * Stop polling a connection. Used while workers own it, since hangups are reported even with
+ * no events requested.
+ */
+static void server_unwatch(struct server* server, struct poll_source* src) {
+    if (src->watched) {
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, src->fd, NULL);
+        src->watched = 0;
+    }
+}
+
+/**
+ * Queue a job for the workers, or shed it when it cannot make its deadline. The expected wait
+ * is the estimated work already queued in the job's class or more urgent ones, spread over
+ * the workers, or nothing when one is idle; less urgent work is preempted and does not count.
+ * Returns AVERROR(ETIMEDOUT) when the job was shed.
+ */
+static int server_submit(struct server* server, struct job* job) {
+    int64_t wait = 0;
+
+    pthread_mutex_lock(&server->lock);
+
+    job->server = server;
+    job->cost = server->route_cost[job->route] * job->weight / COST_WEIGHT_ONE;
+    job->submitted = av_gettime_relative();
+    if (!server->idle_workers) {
+        for (int i = 0; i <= job->priority; i++) {
+            wait += server->queued_cost[i];
+        }
+        wait /= server->config.workers;
+    }
+    if (job->deadline && job->submitted + wait + job->cost > job->deadline) {
+        pthread_mutex_unlock(&server->lock);
+        metrics_count(METRIC_REQUESTS_SHED, 1);
+        return AVERROR(ETIMEDOUT);
+    }
+
+    server->queued_cost[job->priority] += job->cost;
+    metrics_count(METRIC_QUEUE_DEPTH + job->priority, 1);
+    job->next = NULL;
+    *server->pending_tail[job->priority] = job;
+    server->pending_tail[job->priority] = &job->next;
+    atomic_fetch_or(&server->pending_classes, 1u << job->priority);
+    pthread_cond_signal(&server->cond);
+    pthread_mutex_unlock(&server->lock);
+
+    return 0;
+}
+
+/**
+ * Take the most urgent queued job of a class more urgent than below, or NULL. Called with
+ * the lock held.
+ */
+static struct job* server_take(struct server* server, enum priority below) {
+    for (int i = 0; i < below; i++) {
+        struct job* job = server->pending[i];
+
+        if (!job) {
+            continue;
+        }
+        if (!(server->pending[i] = job->next)) {
+            server->pending_tail[i] = &server->pending[i];
+            atomic_fetch_and(&server->pending_classes, ~(1u << i));
+        }
+        server->queued_cost[i] -= job->cost;
+        metrics_count(METRIC_QUEUE_DEPTH + i, -1);
+        return job;
+    }
+    return NULL;
+}
+
+/**
+ * Fold a finished job's measurements into the cost estimates. Jobs that failed say little
+ * about what a request costs and are left out, except that one cut off by its deadline cost
+ * at least as long as it ran.
+ */
+static void server_account(struct server* server, struct job* job, int64_t elapsed) {
+    /* Route costs are kept for an item of average weight */
+    int64_t cost = elapsed * COST_WEIGHT_ONE / job->weight;
+
+    if (job->status == AVERROR(ETIMEDOUT) && cost > server->route_cost[job->route]) {
+        server->route_cost[job->route] += (cost - server->route_cost[job->route]) / 8;
+    }
+    if (job->status < 0) {
+        return;
+    }
+
+    cost = (elapsed - job->preempted) * COST_WEIGHT_ONE / job->weight;
+    server->route_cost[job->route] += (cost - server->route_cost[job->route]) / 8;
+    if (job->frame_cost) {
+        server->frame_cost += (job->frame_cost - server->frame_cost) / 8;
+    }
+}
+
+/**
+ * Run a job on the calling worker and hand it back to the event loop.
+ */
+static void server_run(struct server* server, struct job* job) {
+    int64_t start = av_gettime_relative();
+    uint64_t one = 1;
+
+    job->run(server, job);
+    if (job->route != ROUTE_NONE) {
+        metrics_observe_since(HIST_PLAYLIST + job->route - 1, job->submitted);
+    }
+
+    pthread_mutex_lock(&server->lock);
+    server_account(server, job, av_gettime_relative() - start);
+    job->next = server->done;
+    server->done = job;
+    pthread_mutex_unlock(&server->lock);
+
+    if (write(server->event.fd, &one, sizeof(one)) < 0) {
+        fprintf(stderr, "Could not signal event loop: %s\n", strerror(errno));
+    }
+}
+
+/**
+ * Preemption point for a running job, called between packets. While every worker is busy,
+ * queued jobs of a more urgent class are run here, on top of the current one. Returns
+ * nonzero if any were.
+ */
+static int server_preempt(void* opaque) {
+    struct job* current = opaque;
+    struct server* server = current->server;
+    struct job* job;
+    int ran = 0;
+
+    if (!(atomic_load_explicit(&server->pending_classes, memory_order_relaxed) & ((1u << current->priority) - 1))) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&server->lock);
+    while (!server->idle_workers && (job = server_take(server, current->priority))) {
+        pthread_mutex_unlock(&server->lock);
+        server_run(server, job);
+        ran = 1;
+        pthread_mutex_lock(&server->lock);
+    }
+    pthread_mutex_unlock(&server->lock);
+
+    return ran;
+}
+
+/**
+ * Called when accept4() stops. If that was for lack of descriptors, give back the ones idle
+ * cached inputs hold so the listener can make progress.
+ */
+static void server_check_accept(struct server* server) {
+    if (errno == EMFILE || errno == ENFILE) {
+        input_cache_trim(&server->inputs, 0, 0);
+    }
+}
+
+static void server_signal(struct server* server) {
+    struct signalfd_siginfo info;
+
+    while (read(server->signal.fd, &info, sizeof(info)) == sizeof(info)) {
+        input_cache_print_stats(&server->inputs);
+        decoder_pool_print_stats(&server->decoders);
+        /* In a cluster the router prints the shared counters once */
+        if (server->config.shm_cache && server->config.processes <= 1) {
+            shm_cache_print_stats(server->config.shm_cache);
+        }
+    }
+}
+
+static void* server_worker(void* opaque) {
+    struct server* server = opaque;
+
+    server_claim_metrics_shard(server);
+
+    for (;;) {
+        struct job* job;
+
+        pthread_mutex_lock(&server->lock);
+        while (!(job = server_take(server, PRIORITY_COUNT))) {
+            pthread_cond_wait(&server->cond, &server->lock);
+        }
+        server->idle_workers--;
+        pthread_mutex_unlock(&server->lock);
+
+        server_run(server, job);
+
+        pthread_mutex_lock(&server->lock);
+        server->idle_workers++;
+        pthread_mutex_unlock(&server->lock);
+    }
+
+    return NULL;
+}
+
+static void server_complete(struct server* server) {
+    struct job* done;
+    uint64_t count;
+
+    if (read(server->event.fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        fprintf(stderr, "Could not read event: %s\n", strerror(errno));
+    }
+
+    pthread_mutex_lock(&server->lock);
+    done = server->done;
+    server->done = NULL;
+    pthread_mutex_unlock(&server->lock);
+
+    while (done) {
+        struct job* job = done;
+
+        done = job->next;
+        job->complete(server, job);
+    }
+}
+
+static const char* route_content_type(enum route route) {
+    switch (route) {
+        case ROUTE_PLAYLIST: return "application/vnd.apple.mpegurl";
+        case ROUTE_SEGMENT: return "video/mp2t";
+        case ROUTE_FMP4_SEGMENT: return "video/mp4";
+        case ROUTE_THUMBNAIL: return "image/jpeg";
+        default: return "text/plain";
+    }
+}
+
+/**
+ * The class a request runs in unless the client says otherwise: whatever a player needs
+ * before it can start is most urgent.
+ */
+static enum priority route_priority(enum route route, int64_t number) {
+    switch (route) {
+        case ROUTE_PLAYLIST: return PRIORITY_STARTUP;
+        case ROUTE_SEGMENT:
+        case ROUTE_FMP4_SEGMENT: return number == 0 ? PRIORITY_STARTUP : PRIORITY_SEEK;
+        default: return PRIORITY_SEEK;
+    }
+}
+
+static int has_parent_component(const char* path) {
+    for (const char* p = path; (p = strstr(p, "..")); p += 2) {
+        if ((p == path || p[-1] == '/') && (p[2] == 0 || p[2] == '/')) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Weight of one item for admission control, from the asset's cost map when there is one that
+ * was made with the server's segment duration. Items are otherwise taken to cost the average.
+ */
+static int64_t server_item_weight(struct server* server, enum route route, const char* asset, int64_t number) {
+    const struct server_config* config = &server->config;
+    struct costmap* map;
+    int64_t segment;
+
+    if (route == ROUTE_PLAYLIST || has_parent_component(asset) ||
+        !(map = costmap_cache_get(&server->costmaps, config->root, asset)) ||
+        map->duration != config->duration || map->timescale != config->timescale) {
+        return COST_WEIGHT_ONE;
+    }
+
+    /* Thumbnails are numbered by time, and weighed as the one at the start of the segment */
+    segment = route == ROUTE_THUMBNAIL ? number / config->duration : number;
+    if (segment < 0 || segment >= map->segments) {
+        return COST_WEIGHT_ONE;
+    }
+    return route == ROUTE_THUMBNAIL ? map->thumbnail_weight[segment] : map->segment_weight[segment];
+}
+
+/**
+ * Set up a request for a job: the server's budget, input cache and decoder pool, the job's
+ * deadline, the current per-frame cost estimate and the preemption point.
+ */
+static void server_init_request(struct server* server, struct job* job, struct request* req) {
+    memset(req, 0, sizeof(*req));
+    req->budget.limit = server->config.mem_budget;
+    req->deadline = job->deadline;
+    req->input_cache = &server->inputs;
+    req->decoder_pool = &server->decoders;
+    if (job->priority > 0) {
+        req->preempt = server_preempt;
+        req->preempt_opaque = job;
+    }
+
+    pthread_mutex_lock(&server->lock);
+    req->frame_cost = server->frame_cost;
+    pthread_mutex_unlock(&server->lock);
+}
+
+/**
+ * Report a finished request back to its job.
+ */
+static void server_finish_request(struct job* job, struct request* req, int status) {
+    job->status = status;
+    job->frame_cost = req->stats.frames_decoded ? req->decode_time / req->stats.frames_decoded : 0;
+    job->preempted = req->preempted;
+}
+
+/**
+ * Passes a response through to its real write_packet while keeping a copy for the shared
+ * cache, as long as it stays small enough to be cached.
+ */
+struct cache_tee {
+    int (*write_packet)(void* opaque, uint8_t* buf, int size);
+    void* opaque;
+    struct out_buffer copy;
+    size_t max_size;
+    int overflow;
+};
+
+static int cache_tee_write_packet(void* opaque, uint8_t* buf, int size) {
+    struct cache_tee* tee = opaque;
+
+    if (!tee->overflow && (tee->copy.len + size > tee->max_size || out_buffer_append(&tee->copy, buf, size) < 0)) {
+        tee->overflow = 1;
+        out_buffer_free(&tee->copy);
+    }
+    return tee->write_packet(tee->opaque, buf, size);
+}
+
+/**
+ * Cache key for a response: the route and its parameters, plus the identity and
+ * modification time of the file so that a replaced file is not served from the cache.
+ */
+static int response_cache_key(const struct server_config* config, enum route route, const char* asset,
+                              int64_t number, const char* filename, char* key, size_t size) {
+    struct stat st;
+
+    if (stat(filename, &st) < 0) {
+        return AVERROR(errno);
+    }
+    if (snprintf(key, size, "%d/%d/%d/%" PRId64 "/%lx/%lx/%ld.%09ld/%s", route, config->duration, config->timescale,
+                 number, (unsigned long)st.st_dev, (unsigned long)st.st_ino, (long)st.st_mtim.tv_sec,
+                 st.st_mtim.tv_nsec, asset) >= size) {
+        return AVERROR(ENAMETOOLONG);
+    }
+    return 0;
+}
+
+/**
+ * Produce the body for one request against an asset under the server root. Segments are
+ * handed to write_packet as they are muxed, everything else in one piece. Responses are
+ * served from and added to the shared cache when there is one. req comes from
+ * server_init_request(); it is closed before returning.
+ */
+static int serve_request(const struct server_config* config, struct request* req, enum route route,
+                         const char* asset, int64_t number,
+                         int (*write_packet)(void* opaque, uint8_t* buf, int size), void* opaque) {
+    AVRational segment_timebase = {config->duration, config->timescale};
+    struct out_buffer out = { .budget = &req->budget };
+    struct cache_tee tee = { write_packet, opaque };
+    char key[SHM_CACHE_KEY_SIZE];
+    char filename[PATH_MAX];
+    AVFrame* frame = NULL;
+    int64_t start;
+    int cached = 0;
+    int ret;
+
+    if (has_parent_component(asset)) {
+        return AVERROR(EINVAL);
+    }
+    if (snprintf(filename, sizeof(filename), "%s/%s", config->root, asset) >= sizeof(filename)) {
+        return AVERROR(ENAMETOOLONG);
+    }
+
+    if (config->shm_cache && response_cache_key(config, route, asset, number, filename, key, sizeof(key)) >= 0) {
+        uint8_t* data;
+        size_t len;
+
+        if ((ret = shm_cache_get(config->shm_cache, key, &data, &len)) > 0) {
+            ret = len ? write_packet(opaque, data, len) : 0;
+            free(data);
+            return ret < 0 ? ret : 0;
+        }
+        cached = 1;
+        tee.max_size = config->shm_cache->arena_size / 8;
+        write_packet = cache_tee_write_packet;
+        opaque = &tee;
+    }
+
+    if ((ret = request_open(req, filename, route == ROUTE_SEGMENT || route == ROUTE_FMP4_SEGMENT)) < 0) {
+        goto end;
+    }
+
+    switch (route) {
+        case ROUTE_PLAYLIST:
+            start = av_gettime_relative();
+            ret = request_write_playlist(req, config->duration, config->timescale, &out);
+            metrics_observe_since(HIST_OUTPUT, start);
+            break;
+        case ROUTE_SEGMENT:
+        case ROUTE_FMP4_SEGMENT:
+            ret = request_copy_segment(req, to_av_timebase(number, segment_timebase),
+                                       to_av_timebase(number + 1, segment_timebase),
+                                       route == ROUTE_SEGMENT ? "mpegts" : "mp4", write_packet, opaque);
+            break;
+        case ROUTE_THUMBNAIL:
+            if (!(frame = av_frame_alloc())) {
+                ret = AVERROR(ENOMEM);
+            } else if ((ret = request_open_decoder(req)) >= 0 &&
+                       (ret = request_decode_frame(req, to_av_timebase(number, (AVRational){1, config->timescale}), frame)) >= 0) {
+                start = av_gettime_relative();
+                ret = encode_jpeg(frame, &out);
+                metrics_observe_since(HIST_OUTPUT, start);
+            }
+            av_frame_free(&frame);
+            break;
+        default:
+            ret = AVERROR(EINVAL);
+            break;
+    }
+
+    if (ret >= 0 && out.len) {
+        ret = write_packet(opaque, out.data, out.len);
+        PROBE3(output__write, -1, out.len, ret);
+    }
+
+end:
+    if (ret < 0 && request_interrupt(req)) {
+        ret = AVERROR(ETIMEDOUT);
+    }
+    /* The demuxer and decoder state after a failure is anyone's guess; do not hand it on */
+    req->reusable = ret >= 0;
+    if (cached && ret >= 0 && !tee.overflow) {
+        shm_cache_put(config->shm_cache, key, tee.copy.data, tee.copy.len);
+    }
+    out_buffer_free(&tee.copy);
+    out_buffer_free(&out);
+    request_close(req);
+
+    return ret < 0 ? ret : 0;
+}
+
+static const char* const hist_labels[HIST_COUNT] = {
+    "route=\"playlist\"", "route=\"segment\"", "route=\"fmp4_segment\"", "route=\"thumbnail\"",
+    "phase=\"open\"", "phase=\"probe\"", "phase=\"seek\"", "phase=\"preroll\"", "phase=\"output\"",
+    "",
+};
+
+static const double metric_quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+/**
+ * Write one merged histogram, or with quantiles set its quantiles. Buckets are reported at
+ * every power of two so the series stay the same from scrape to scrape; the quantiles use
+ * the full resolution.
+ */
+static void metrics_write_histogram(struct metrics* metrics, enum metric_hist hist, const char* name,
+                                    double scale, int quantiles, struct out_buffer* out) {
+    const char* labels = hist_labels[hist];
+    const char* sep = *labels ? "," : "";
+    uint64_t buckets[HIST_BUCKETS] = {0};
+    uint64_t sum = 0;
+    uint64_t count = 0;
+    uint64_t cumulative = 0;
+
+    for (int i = 0; i < metrics->nb_shards; i++) {
+        struct metric_histogram* h = &metrics->shards[i].hists[hist];
+
+        for (int b = 0; b < HIST_BUCKETS; b++) {
+            buckets[b] += atomic_load_explicit(&h->buckets[b], memory_order_relaxed);
+        }
+        sum += atomic_load_explicit(&h->sum, memory_order_relaxed);
+    }
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        count += buckets[b];
+    }
+
+    if (!quantiles) {
+        for (int b = 0; b < HIST_BUCKETS; b++) {
+            cumulative += buckets[b];
+            if (b % HIST_SUB_COUNT == HIST_SUB_COUNT - 1) {
+                out_buffer_printf(out, "%s_bucket{%s%sle=\"%g\"} %" PRIu64 "\n", name, labels, sep,
+                                  hist_bucket_limit(b) * scale, cumulative);
+            }
+        }
+        out_buffer_printf(out, "%s_bucket{%s%sle=\"+Inf\"} %" PRIu64 "\n", name, labels, sep, count);
+        out_buffer_printf(out, "%s_sum%s%s%s %g\n", name, *labels ? "{" : "", labels, *labels ? "}" : "", sum * scale);
+        out_buffer_printf(out, "%s_count%s%s%s %" PRIu64 "\n", name, *labels ? "{" : "", labels, *labels ? "}" : "", count);
+        return;
+    }
+
+    for (int q = 0; q < FF_ARRAY_ELEMS(metric_quantiles); q++) {
+        uint64_t rank = FFMIN(count, (uint64_t)(metric_quantiles[q] * count) + 1);
+        int b = 0;
+
+        for (cumulative = 0; b < HIST_BUCKETS - 1 && (cumulative += buckets[b]) < rank; b++);
+        out_buffer_printf(out, "%s_quantile{%s%squantile=\"%g\"} %g\n", name, labels, sep,
+                          metric_quantiles[q], count ? hist_bucket_limit(b) * scale : 0.0);
+    }
+}
+
+static int64_t metrics_sum(struct metrics* metrics, enum metric_counter counter) {
+    int64_t total = 0;
+
+    for (int i = 0; i < metrics->nb_shards; i++) {
+        total += atomic_load_explicit(&metrics->shards[i].counters[counter], memory_order_relaxed);
+    }
+    return total;
+}
+
+static double ratio(int64_t a, int64_t b) {
+    return b ? (double)a / b : 0.0;
+}
+
+/**
+ * Render every metric in the Prometheus text format.
+ */
+static void metrics_write(struct metrics* metrics, struct shm_cache* shm_cache, struct out_buffer* out) {
+    int64_t input_hits = metrics_sum(metrics, METRIC_INPUT_CACHE_HITS);
+    int64_t input_misses = metrics_sum(metrics, METRIC_INPUT_CACHE_MISSES);
+    int64_t decoder_hits = metrics_sum(metrics, METRIC_DECODER_POOL_HITS);
+    int64_t decoder_misses = metrics_sum(metrics, METRIC_DECODER_POOL_MISSES);
+    int64_t frames_decoded = metrics_sum(metrics, METRIC_FRAMES_DECODED);
+    int64_t frames_returned = metrics_sum(metrics, METRIC_FRAMES_RETURNED);
+
+    out_buffer_printf(out, "# HELP vodtool_request_duration_seconds Time from admission to completion.\n");
+    out_buffer_printf(out, "# TYPE vodtool_request_duration_seconds histogram\n");
+    for (int hist = HIST_PLAYLIST; hist <= HIST_THUMBNAIL; hist++) {
+        metrics_write_histogram(metrics, hist, "vodtool_request_duration_seconds", 1e-6, 0, out);
+    }
+    out_buffer_printf(out, "# TYPE vodtool_request_duration_seconds_quantile gauge\n");
+    for (int hist = HIST_PLAYLIST; hist <= HIST_THUMBNAIL; hist++) {
+        metrics_write_histogram(metrics, hist, "vodtool_request_duration_seconds", 1e-6, 1, out);
+    }
+    out_buffer_printf(out, "# HELP vodtool_phase_duration_seconds Time spent opening, probing, seeking, decoding up to the wanted frame and writing output.\n");
+    out_buffer_printf(out, "# TYPE vodtool_phase_duration_seconds histogram\n");
+    for (int hist = HIST_OPEN; hist <= HIST_OUTPUT; hist++) {
+        metrics_write_histogram(metrics, hist, "vodtool_phase_duration_seconds", 1e-6, 0, out);
+    }
+    out_buffer_printf(out, "# HELP vodtool_request_read_bytes Bytes read from the input per request.\n");
+    out_buffer_printf(out, "# TYPE vodtool_request_read_bytes histogram\n");
+    metrics_write_histogram(metrics, HIST_READ_BYTES, "vodtool_request_read_bytes", 1, 0, out);
+
+    out_buffer_printf(out, "# TYPE vodtool_input_cache_hits_total counter\nvodtool_input_cache_hits_total %" PRId64 "\n", input_hits);
+    out_buffer_printf(out, "# TYPE vodtool_input_cache_misses_total counter\nvodtool_input_cache_misses_total %" PRId64 "\n", input_misses);
+    out_buffer_printf(out, "# TYPE vodtool_input_cache_hit_ratio gauge\nvodtool_input_cache_hit_ratio %g\n",
+                      ratio(input_hits, input_hits + input_misses));
+    out_buffer_printf(out, "# TYPE vodtool_decoder_pool_hits_total counter\nvodtool_decoder_pool_hits_total %" PRId64 "\n", decoder_hits);
+    out_buffer_printf(out, "# TYPE vodtool_decoder_pool_misses_total counter\nvodtool_decoder_pool_misses_total %" PRId64 "\n", decoder_misses);
+    out_buffer_printf(out, "# TYPE vodtool_decoder_pool_hit_ratio gauge\nvodtool_decoder_pool_hit_ratio %g\n",
+                      ratio(decoder_hits, decoder_hits + decoder_misses));
+    if (shm_cache) {
+        uint64_t hits = atomic_load(&shm_cache->hits);
+        uint64_t misses = atomic_load(&shm_cache->misses);
+
+        out_buffer_printf(out, "# TYPE vodtool_shm_cache_hits_total counter\nvodtool_shm_cache_hits_total %" PRIu64 "\n", hits);
+        out_buffer_printf(out, "# TYPE vodtool_shm_cache_misses_total counter\nvodtool_shm_cache_misses_total %" PRIu64 "\n", misses);
+        out_buffer_printf(out, "# TYPE vodtool_shm_cache_hit_ratio gauge\nvodtool_shm_cache_hit_ratio %g\n",
+                          ratio(hits, hits + misses));
+    }
+
+    out_buffer_printf(out, "# TYPE vodtool_frames_decoded_total counter\nvodtool_frames_decoded_total %" PRId64 "\n", frames_decoded);
+    out_buffer_printf(out, "# TYPE vodtool_frames_returned_total counter\nvodtool_frames_returned_total %" PRId64 "\n", frames_returned);
+    out_buffer_printf(out, "# HELP vodtool_decode_amplification Frames decoded per frame returned.\n");
+    out_buffer_printf(out, "# TYPE vodtool_decode_amplification gauge\nvodtool_decode_amplification %g\n",
+                      ratio(frames_decoded, frames_returned));
+    out_buffer_printf(out, "# TYPE vodtool_requests_shed_total counter\nvodtool_requests_shed_total %" PRId64 "\n",
+                      metrics_sum(metrics, METRIC_REQUESTS_SHED));
+
+    out_buffer_printf(out, "# TYPE vodtool_queue_depth gauge\n");
+    for (int i = 0; i < PRIORITY_COUNT; i++) {
+        out_buffer_printf(out, "vodtool_queue_depth{priority=\"%s\"} %" PRId64 "\n", priority_names[i],
+                          metrics_sum(metrics, METRIC_QUEUE_DEPTH + i));
+    }
+    out_buffer_printf(out, "# HELP vodtool_active_inputs Opened input contexts, in use or cached.\n");
+    out_buffer_printf(out, "# TYPE vodtool_active_inputs gauge\nvodtool_active_inputs %" PRId64 "\n",
+                      metrics_sum(metrics, METRIC_ACTIVE_INPUTS));
+    out_buffer_printf(out, "# HELP vodtool_active_decoders Opened decoder contexts, in use or pooled.\n");
+    out_buffer_printf(out, "# TYPE vodtool_active_decoders gauge\nvodtool_active_decoders %" PRId64 "\n",
+                      metrics_sum(metrics, METRIC_ACTIVE_DECODERS));
+}
+
+/*
+ * HTTP
+ */
+
+struct http_conn {
+    struct poll_source src;
+    struct job job;
+    char in[HTTP_MAX_HEADER];
+    size_t in_len;
+    char path[HTTP_MAX_HEADER];
+    char* asset;
+    int64_t number;
+    int head_only;
+    int keep_alive;
+    int chunked_ok;
+
+    /* The response, filled in by a worker */
+    int status;
+    const char* content_type;
+    struct out_buffer body;
+    char header[512];
+    size_t header_len;
+    size_t written;
+    /* Some of the response has left, and whether it is streamed with its header in body */
+    int sent;
+    int streamed;
+};
+
+static const char* http_status_text(int status) {
+    switch (status) {
+        case 200: return "OK";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 431: return "Request Header Fields Too Large";
+        case 503: return "Service Unavailable";
+        default: return "Internal Server Error";
+    }
+}
+
+static int http_error_status(int err) {
+    if (err == AVERROR(ENOENT) || err == AVERROR_EOF || err == AVERROR_STREAM_NOT_FOUND) {
+        return 404;
+    } else if (err == AVERROR(EINVAL) || err == AVERROR(ENAMETOOLONG)) {
+        return 400;
+    } else if (err == AVERROR(ENOMEM) || err == AVERROR(ETIMEDOUT)) {
+        return 503;
+    }
+    return 500;
+}
+
+static void url_decode(char* s) {
+    char* out = s;
+
+    for (; *s; s++) {
+        if (s[0] == '%' && isxdigit((unsigned char)s[1]) && isxdigit((unsigned char)s[2])) {
+            char hex[3] = { s[1], s[2], 0 };
+            *out++ = strtol(hex, NULL, 16);
+            s += 2;
+        } else {
+            *out++ = *s;
+        }
+    }
+    *out = 0;
+}
+
+/**
+ * Split /<asset>/index.m3u8, /<asset>/seg/<n>.ts, /<asset>/seg/<n>.mp4 and
+ * /<asset>/thumb/<ts>.jpg. The asset may contain slashes but no ".." components. path is
+ * modified in place.
+ */
+static enum route http_parse_route(char* path, char** asset, int64_t* number) {
+    char* query = strchr(path, '?');
+    char* last;
+    char* kind;
+    char* end;
+
+    if (query) {
+        *query = 0;
+    }
+    url_decode(path);
+
+    if (path[0] != '/' || has_parent_component(path) || !(last = strrchr(path, '/')) || last == path) {
+        return ROUTE_NONE;
+    }
+    *asset = path + 1;
+
+    if (!strcmp(last, "/index.m3u8")) {
+        *last = 0;
+        return ROUTE_PLAYLIST;
+    }
+
+    *last = 0;
+    if (!(kind = strrchr(path, '/')) || kind == path) {
+        return ROUTE_NONE;
+    }
+    *kind = 0;
+
+    *number = strtoll(last + 1, &end, 10);
+    if (end == last + 1 || *number < 0) {
+        return ROUTE_NONE;
+    }
+
+    if (!strcmp(kind + 1, "seg") && !strcmp(end, ".ts")) {
+        return ROUTE_SEGMENT;
+    } else if (!strcmp(kind + 1, "seg") && !strcmp(end, ".mp4")) {
+        return ROUTE_FMP4_SEGMENT;
+    } else if (!strcmp(kind + 1, "thumb") && !strcmp(end, ".jpg")) {
+        return ROUTE_THUMBNAIL;
+    }
+
+    return ROUTE_NONE;
+}
+
+/**
+ * Write as much of a streamed response as the socket takes and drop it from the buffer. With
+ * wait set, a worker then waits for a slow client while more than HTTP_STREAM_PENDING bytes are
+ * left, for no longer than HTTP_SEND_STALL_MS at a time and never past the request's
+ * deadline, if it has one; the event loop sends the rest once the worker is done.
+ */
+static int http_stream_flush(struct http_conn* conn, int wait) {
+    int64_t timeout;
+
+    for (;;) {
+        while (conn->written < conn->body.len) {
+            ssize_t n = write(conn->src.fd, conn->body.data + conn->written, conn->body.len - conn->written);
+
+            if (n < 0 && errno == EAGAIN) {
+                break;
+            } else if (n < 0 && errno == EINTR) {
+                continue;
+            } else if (n < 0) {
+                return AVERROR(errno);
+            }
+            conn->written += n;
+            conn->sent = 1;
+        }
+
+        memmove(conn->body.data, conn->body.data + conn->written, conn->body.len - conn->written);
+        conn->body.len -= conn->written;
+        conn->written = 0;
+
+        if (!wait || conn->body.len <= HTTP_STREAM_PENDING) {
+            return 0;
+        }
+
+        timeout = HTTP_SEND_STALL_MS;
+        if (conn->job.deadline) {
+            timeout = FFMIN(timeout, (conn->job.deadline - av_gettime_relative()) / 1000);
+        }
+        if (timeout <= 0 || poll(&(struct pollfd){ .fd = conn->src.fd, .events = POLLOUT }, 1, timeout) <= 0) {
+            return AVERROR(ETIMEDOUT);
+        }
+    }
+}
+
+static void http_format_header(struct http_conn* conn, int chunked) {
+    if (chunked) {
+        conn->header_len = snprintf(conn->header, sizeof(conn->header),
+                                    "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nTransfer-Encoding: chunked\r\nConnection: %s\r\n\r\n",
+                                    conn->status, http_status_text(conn->status), conn->content_type,
+                                    conn->keep_alive ? "keep-alive" : "close");
+    } else {
+        conn->header_len = snprintf(conn->header, sizeof(conn->header),
+                                    "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: %s\r\n\r\n",
+                                    conn->status, http_status_text(conn->status),
+                                    conn->content_type ? conn->content_type : "text/plain",
+                                    conn->body.len, conn->keep_alive ? "keep-alive" : "close");
+    }
+}
+
+/**
+ * Muxer output callback for streamed responses. The worker owns the connection while it
+ * handles the request, so chunks go to the socket as the muxer produces them, as far as it
+ * takes them without blocking; the header goes out with the first one.
+ */
+static int http_write_chunk(void* opaque, uint8_t* buf, int size) {
+    struct http_conn* conn = opaque;
+    int ret;
+
+    if (!conn->streamed) {
+        http_format_header(conn, 1);
+        if ((ret = out_buffer_append(&conn->body, (uint8_t*)conn->header, conn->header_len)) < 0) {
+            return ret;
+        }
+        conn->header_len = 0;
+        conn->streamed = 1;
+    }
+
+    if ((ret = out_buffer_printf(&conn->body, "%x\r\n", size)) < 0 ||
+        (ret = out_buffer_append(&conn->body, buf, size)) < 0 ||
+        (ret = out_buffer_append(&conn->body, (const uint8_t*)"\r\n", 2)) < 0 ||
+        (ret = http_stream_flush(conn, 1)) < 0) {
+        return ret;
+    }
+
+    return size;
+}
+
+/**
+ * Build the response for a parsed request. Runs on a decode worker. GET requests for
+ * segments from HTTP/1.1 clients are streamed with chunked encoding so the first bytes leave
+ * as soon as they are muxed; everything else is buffered.
+ */
+static void http_handle(struct server* server, struct job* job) {
+    struct http_conn* conn = container_of(job, struct http_conn, job);
+    enum route route = job->route;
+    struct request req;
+    int streamed;
+    int ret;
+
+    server_init_request(server, job, &req);
+
+    conn->status = 200;
+    conn->content_type = route_content_type(route);
+    streamed = (route == ROUTE_SEGMENT || route == ROUTE_FMP4_SEGMENT) && !conn->head_only && conn->chunked_ok;
+    conn->body.budget = &req.budget;
+
+    if (streamed) {
+        ret = serve_request(&server->config, &req, route, conn->asset, conn->number, http_write_chunk, conn);
+        if (ret >= 0 && (ret = out_buffer_append(&conn->body, (const uint8_t*)"0\r\n\r\n", 5)) >= 0) {
+            ret = http_stream_flush(conn, 0);
+        }
+    } else {
+        ret = serve_request(&server->config, &req, route, conn->asset, conn->number, out_buffer_write_packet, &conn->body);
+    }
+    server_finish_request(job, &req, ret);
+
+    if (ret < 0 && conn->sent) {
+        /* Part of the body is already out; closing without the last chunk tells the client */
+        conn->keep_alive = 0;
+    } else if (ret < 0) {
+        conn->status = http_error_status(ret);
+        conn->content_type = "text/plain";
+        conn->body.len = 0;
+        conn->streamed = 0;
+    }
+
+    /* The body outlives the request; it is released when the response has been written */
+    mem_budget_release(&req.budget, conn->body.size);
+    conn->body.budget = NULL;
+}
+
+static void http_close(struct server* server, struct http_conn* conn) {
+    server_unwatch(server, &conn->src);
+    close(conn->src.fd);
+    out_buffer_free(&conn->body);
+    free(conn);
+}
+
+static void http_respond(struct server* server, struct http_conn* conn);
+
+/**
+ * Parse the next buffered request, if it is complete. Requests that can be answered without
+ * touching a file, or that cannot make their deadline, are answered directly; the rest go to
+ * the workers.
+ *
+ * X-Deadline-Ms gives the time the client is willing to wait for the response, overriding
+ * the server's --deadline. X-Priority names the class to run in, overriding route_priority().
+ */
+static void http_process(struct server* server, struct http_conn* conn) {
+    char* header_end = memmem(conn->in, conn->in_len, "\r\n\r\n", 4);
+    char method[16];
+    char version[16];
+    int64_t deadline_ms;
+    int priority = -1;
+    size_t consumed;
+    char* line;
+
+    if (!header_end) {
+        if (conn->in_len == sizeof(conn->in)) {
+            conn->keep_alive = 0;
+            conn->status = 431;
+            http_respond(server, conn);
+        }
+        return;
+    }
+
+    *header_end = 0;
+    consumed = header_end + 4 - conn->in;
+
+    if (sscanf(conn->in, "%15s %8191s %15s", method, conn->path, version) != 3 || strncmp(version, "HTTP/1.", 7)) {
+        conn->keep_alive = 0;
+        conn->status = 400;
+        http_respond(server, conn);
+        return;
+    }
+
+    conn->keep_alive = conn->chunked_ok = strcmp(version, "HTTP/1.0") != 0;
+    deadline_ms = server->config.deadline;
+    for (line = strstr(conn->in, "\r\n"); line; line = strstr(line + 2, "\r\n")) {
+        if (!strncasecmp(line + 2, "X-Deadline-Ms:", 14)) {
+            deadline_ms = strtoll(line + 16, NULL, 10);
+        } else if (!strncasecmp(line + 2, "X-Priority:", 11)) {
+            const char* value = line + 13;
+
+            while (*value == ' ') {
+                value++;
+            }
+            for (int i = 0; i < PRIORITY_COUNT; i++) {
+                size_t len = strlen(priority_names[i]);
+
+                if (!strncasecmp(value, priority_names[i], len) && (value[len] == '\r' || value[len] == 0 || value[len] == ' ')) {
+                    priority = i;
+                }
+            }
+        } else if (!strncasecmp(line + 2, "Connection:", 11)) {
+            const char* value = line + 13;
+
+            while (*value == ' ') {
+                value++;
+            }
+            if (!strncasecmp(value, "close", 5)) {
+                conn->keep_alive = 0;
+            } else if (!strncasecmp(value, "keep-alive", 10)) {
+                conn->keep_alive = 1;
+            }
+        }
+    }
+
+    memmove(conn->in, conn->in + consumed, conn->in_len - consumed);
+    conn->in_len -= consumed;
+
+    conn->head_only = !strcmp(method, "HEAD");
+    conn->content_type = "text/plain";
+    if (!conn->head_only && strcmp(method, "GET")) {
+        conn->status = 405;
+        http_respond(server, conn);
+        return;
+    }
+
+    if (!strcmp(conn->path, "/metrics")) {
+        metrics_write(server->config.metrics, server->config.shm_cache, &conn->body);
+        conn->status = 200;
+        conn->content_type = "text/plain; version=0.0.4";
+        http_respond(server, conn);
+        return;
+    }
+
+    if ((conn->job.route = http_parse_route(conn->path, &conn->asset, &conn->number)) == ROUTE_NONE) {
+        conn->status = 404;
+        http_respond(server, conn);
+        return;
+    }
+
+    conn->job.priority = priority >= 0 ? priority : route_priority(conn->job.route, conn->number);
+    conn->job.deadline = deadline_ms > 0 ? av_gettime_relative() + deadline_ms * 1000 : 0;
+    conn->job.weight = server_item_weight(server, conn->job.route, conn->asset, conn->number);
+    if (server_submit(server, &conn->job) < 0) {
+        conn->status = 503;
+        http_respond(server, conn);
+        return;
+    }
+    server_unwatch(server, &conn->src);
+}
+
+/**
+ * Write as much of the response as the socket takes. Once it is all out the connection goes
+ * back to reading, or is closed.
+ */
+static void http_write(struct server* server, struct http_conn* conn) {
+    size_t body_len = conn->head_only ? 0 : conn->body.len;
+
+    while (conn->written < conn->header_len + body_len) {
+        struct iovec iov[2];
+        int iovcnt = 0;
+        ssize_t n;
+
+        if (conn->written < conn->header_len) {
+            iov[iovcnt++] = (struct iovec){ conn->header + conn->written, conn->header_len - conn->written };
+            iov[iovcnt++] = (struct iovec){ conn->body.data, body_len };
+        } else {
+            iov[iovcnt++] = (struct iovec){ conn->body.data + conn->written - conn->header_len,
+                                            conn->header_len + body_len - conn->written };
+        }
+
+        n = writev(conn->src.fd, iov, iovcnt);
+        if (n < 0 && errno == EAGAIN) {
+            server_watch(server, &conn->src, EPOLLOUT);
+            return;
+        } else if (n < 0) {
+            http_close(server, conn);
+            return;
+        }
+        conn->written += n;
+    }
+
+    if (!conn->keep_alive) {
+        http_close(server, conn);
+        return;
+    }
+
+    out_buffer_free(&conn->body);
+    conn->written = 0;
+    conn->sent = 0;
+    conn->streamed = 0;
+    server_watch(server, &conn->src, EPOLLIN | EPOLLRDHUP);
+    http_process(server, conn);
+}
+
+/**
+ * Send a buffered response. What the worker could not send of a streamed response is still in
+ * the body, header included, and goes out the same way.
+ */
+static void http_respond(struct server* server, struct http_conn* conn) {
+    if (!conn->streamed) {
+        http_format_header(conn, 0);
+        conn->written = 0;
+    }
+    http_write(server, conn);
+}
+
+static void http_complete(struct server* server, struct job* job) {
+    http_respond(server, container_of(job, struct http_conn, job));
+}
+
+static void http_read(struct server* server, struct http_conn* conn) {
+    for (;;) {
+        ssize_t n = read(conn->src.fd, conn->in + conn->in_len, sizeof(conn->in) - conn->in_len);
+
+        if (n < 0 && errno == EAGAIN) {
+            break;
+        } else if (n <= 0) {
+            http_close(server, conn);
+            return;
+        }
+        conn->in_len += n;
+        if (conn->in_len == sizeof(conn->in)) {
+            break;
+        }
+    }
+
+    http_process(server, conn);
+}
+
+/**
+ * Start serving an accepted connection, or one handed over by the cluster router.
+ */
+static void http_add_conn(struct server* server, int fd) {
+    struct http_conn* conn = calloc(1, sizeof(*conn));
+    int one = 1;
+
+    if (!conn) {
+        close(fd);
+        return;
+    }
+    conn->src = (struct poll_source){ .kind = POLL_HTTP_CONN, .fd = fd };
+    conn->job.run = http_handle;
+    conn->job.complete = http_complete;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (server_watch(server, &conn->src, EPOLLIN | EPOLLRDHUP) < 0) {
+        close(fd);
+        free(conn);
+    }
+}
+
+static void http_accept(struct server* server) {
+    int fd;
+
+    while ((fd = accept4(server->http_listen.fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        http_add_conn(server, fd);
+    }
+    server_check_accept(server);
+}
+
+static int http_listen(const char* address) {
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_ANY) };
+    const char* port = strrchr(address, ':');
+    char host[64];
+    int one = 1;
+    int fd;
+
+    if (!port || port - address >= sizeof(host)) {
+        fprintf(stderr, "Invalid listen address %s\n", address);
+        return -1;
+    }
+    memcpy(host, address, port - address);
+    host[port - address] = 0;
+    addr.sin_port = htons(atoi(port + 1));
+
+    if (host[0] && inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        fprintf(stderr, "Invalid listen address %s\n", address);
+        return -1;
+    }
+
+    if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+        bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(fd, SERVER_LISTEN_BACKLOG) < 0) {
+        fprintf(stderr, "Could not listen on %s: %s\n", address, strerror(errno));
+        return -1;
+    }
+
+    return fd;
+}
+
+/*
+ * Binary RPC over a Unix stream socket, for clients on the same host.
+ *
+ * A request message is an rpc_header followed by header.count entries, each an
+ * rpc_request followed by asset_len bytes of asset path. Integers are in host byte order.
+ * The entries of one message are run concurrently on the workers and answered together by a
+ * single message: an rpc_header followed by one rpc_response per entry, in order. The body
+ * of every entry with status 0 is a sealed memfd passed with SCM_RIGHTS, again in entry
+ * order, so bodies never travel through the socket. A connection has one message in flight
+ * at a time.
+ */
+
+#define RPC_MAGIC 0x43505256 /* "VRPC" */
+#define RPC_VERSION 1
+#define RPC_MAX_BATCH 64
+#define RPC_MAX_MESSAGE (64 * 1024)
+
+enum rpc_type {
+    RPC_PLAYLIST = 1,
+    RPC_SEGMENT = 2,
+    RPC_FMP4_SEGMENT = 3,
+    RPC_THUMBNAIL = 4,
+};
+
+struct rpc_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t count;
+    uint32_t length;    /* bytes following the header */
+};
+
+struct rpc_request {
+    uint8_t type;       /* enum rpc_type */
+    uint8_t priority;   /* enum priority + 1, 0 for the route's default */
+    uint16_t asset_len;
+    uint32_t deadline_ms;   /* 0 for the server's --deadline */
+    int64_t number;     /* segment number, or thumbnail time in timescale units */
+};
+
+struct rpc_response {
+    int32_t status;     /* 0 or a negative AVERROR */
+    uint32_t reserved;
+    uint64_t size;      /* bytes in the memfd */
+};
+
+struct rpc_item {
+    struct job job;
+    struct rpc_conn* conn;
+    char asset[PATH_MAX];
+    int64_t number;
+    struct mem_budget* budget;
+    int fd;
+    uint64_t size;
+    int status;
+};
+
+struct rpc_conn {
+    struct poll_source src;
+    uint8_t in[RPC_MAX_MESSAGE];
+    size_t in_len;
+    size_t consumed;
+    struct rpc_item items[RPC_MAX_BATCH];
+    int count;
+    int pending;
+    uint8_t out[sizeof(struct rpc_header) + RPC_MAX_BATCH * sizeof(struct rpc_response)];
+    size_t out_len;
+    size_t written;
+};
+
+static enum route rpc_route(uint8_t type) {
+    switch (type) {
+        case RPC_PLAYLIST: return ROUTE_PLAYLIST;
+        case RPC_SEGMENT: return ROUTE_SEGMENT;
+        case RPC_FMP4_SEGMENT: return ROUTE_FMP4_SEGMENT;
+        case RPC_THUMBNAIL: return ROUTE_THUMBNAIL;
+        default: return ROUTE_NONE;
+    }
+}
+
+static int rpc_write_packet(void* opaque, uint8_t* buf, int size) {
+    struct rpc_item* item = opaque;
+    int ret;
+
+    if ((ret = mem_budget_charge(item->budget, size)) < 0) {
+        return ret;
+    }
+
+    for (int written = 0; written < size; ) {
+        ssize_t n = write(item->fd, buf + written, size - written);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0) {
+            return AVERROR(errno);
+        }
+        written += n;
+    }
+    item->size += size;
+
+    return size;
+}
+
+/**
+ * Run one entry of a batch into its own memfd. Runs on a decode worker.
+ */
+static void rpc_handle(struct server* server, struct job* job) {
+    struct rpc_item* item = container_of(job, struct rpc_item, job);
+    struct request req;
+
+    server_init_request(server, job, &req);
+    item->size = 0;
+    item->budget = &req.budget;
+
+    if (job->route == ROUTE_NONE) {
+        job->status = item->status = AVERROR(EINVAL);
+        return;
+    }
+
+    if ((item->fd = memfd_create("vodtool", MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0) {
+        job->status = item->status = AVERROR(errno);
+        return;
+    }
+
+    item->status = serve_request(&server->config, &req, job->route, item->asset, item->number,
+                                 rpc_write_packet, item);
+    server_finish_request(job, &req, item->status);
+
+    /* The receiver maps the body; make sure it cannot change underneath it */
+    if (item->status >= 0 && fcntl(item->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+        item->status = AVERROR(errno);
+    }
+    if (item->status < 0) {
+        close(item->fd);
+        item->fd = -1;
+    }
+}
+
+static void rpc_close(struct server* server, struct rpc_conn* conn) {
+    server_unwatch(server, &conn->src);
+    close(conn->src.fd);
+    free(conn);
+}
+
+static void rpc_process(struct server* server, struct rpc_conn* conn);
+
+/**
+ * Send the reply for the batch in flight. The memfds go with the first byte of the reply and
+ * are closed once sent.
+ */
+static void rpc_write(struct server* server, struct rpc_conn* conn) {
+    while (conn->written < conn->out_len) {
+        struct iovec iov = { conn->out + conn->written, conn->out_len - conn->written };
+        union {
+            char buf[CMSG_SPACE(sizeof(int) * RPC_MAX_BATCH)];
+            struct cmsghdr align;
+        } control;
+        struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+        int fds[RPC_MAX_BATCH];
+        int nfds = 0;
+        ssize_t n;
+
+        for (int i = 0; !conn->written && i < conn->count; i++) {
+            if (conn->items[i].fd >= 0) {
+                fds[nfds++] = conn->items[i].fd;
+            }
+        }
+        if (nfds) {
+            struct cmsghdr* cmsg;
+
+            msg.msg_control = control.buf;
+            msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+            cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+            memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+        }
+
+        n = sendmsg(conn->src.fd, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno == EAGAIN) {
+            server_watch(server, &conn->src, EPOLLOUT);
+            return;
+        } else if (n < 0) {
+            rpc_close(server, conn);
+            return;
+        }
+
+        if (!conn->written) {
+            for (int i = 0; i < conn->count; i++) {
+                if (conn->items[i].fd >= 0) {
+                    close(conn->items[i].fd);
+                }
+            }
+        }
+        conn->written += n;
+    }
+
+    memmove(conn->in, conn->in + conn->consumed, conn->in_len - conn->consumed);
+    conn->in_len -= conn->consumed;
+    conn->consumed = 0;
+    conn->count = 0;
+    conn->out_len = conn->written = 0;
+
+    server_watch(server, &conn->src, EPOLLIN | EPOLLRDHUP);
+    rpc_process(server, conn);
+}
+
+static void rpc_reply(struct server* server, struct rpc_conn* conn) {
+    struct rpc_header header = { RPC_MAGIC, RPC_VERSION, conn->count, conn->count * sizeof(struct rpc_response) };
+
+    memcpy(conn->out, &header, sizeof(header));
+    for (int i = 0; i < conn->count; i++) {
+        struct rpc_response response = { .status = conn->items[i].status, .size = conn->items[i].size };
+
+        memcpy(conn->out + sizeof(header) + i * sizeof(response), &response, sizeof(response));
+    }
+    conn->out_len = sizeof(header) + conn->count * sizeof(struct rpc_response);
+    conn->written = 0;
+
+    rpc_write(server, conn);
+}
+
+static void rpc_complete(struct server* server, struct job* job) {
+    struct rpc_item* item = container_of(job, struct rpc_item, job);
+    struct rpc_conn* conn = item->conn;
+
+    if (--conn->pending == 0) {
+        rpc_reply(server, conn);
+    }
+}
+
+/**
+ * Parse the next buffered message, if it is complete, and hand its entries to the workers.
+ * Entries that cannot make their deadline fail with AVERROR(ETIMEDOUT) without being run.
+ * Malformed messages close the connection.
+ */
+static void rpc_process(struct server* server, struct rpc_conn* conn) {
+    struct rpc_header header;
+    size_t offset = sizeof(header);
+    int64_t now = av_gettime_relative();
+
+    if (conn->in_len < sizeof(header)) {
+        return;
+    }
+
+    memcpy(&header, conn->in, sizeof(header));
+    if (header.magic != RPC_MAGIC || header.version != RPC_VERSION || header.count > RPC_MAX_BATCH ||
+        header.length > sizeof(conn->in) - sizeof(header)) {
+        rpc_close(server, conn);
+        return;
+    }
+    if (conn->in_len < sizeof(header) + header.length) {
+        return;
+    }
+
+    for (int i = 0; i < header.count; i++) {
+        struct rpc_item* item = &conn->items[i];
+        struct rpc_request request;
+        int64_t deadline_ms;
+        enum route route;
+
+        if (offset + sizeof(request) > sizeof(header) + header.length) {
+            rpc_close(server, conn);
+            return;
+        }
+        memcpy(&request, conn->in + offset, sizeof(request));
+        offset += sizeof(request);
+        if (offset + request.asset_len > sizeof(header) + header.length || request.asset_len >= sizeof(item->asset)) {
+            rpc_close(server, conn);
+            return;
+        }
+
+        deadline_ms = request.deadline_ms ? request.deadline_ms : server->config.deadline;
+        route = rpc_route(request.type);
+        *item = (struct rpc_item){
+            .job = {
+                .run = rpc_handle,
+                .complete = rpc_complete,
+                .route = route,
+                .priority = request.priority > 0 && request.priority <= PRIORITY_COUNT ?
+                            request.priority - 1 : route_priority(route, request.number),
+                .deadline = deadline_ms > 0 ? now + deadline_ms * 1000 : 0,
+            },
+            .conn = conn,
+            .number = request.number,
+            .fd = -1,
+        };
+        memcpy(item->asset, conn->in + offset, request.asset_len);
+        item->asset[request.asset_len] = 0;
+        offset += request.asset_len;
+        item->job.weight = server_item_weight(server, route, item->asset, item->number);
+    }
+
+    conn->consumed = sizeof(header) + header.length;
+    conn->count = conn->pending = header.count;
+
+    if (!conn->count) {
+        rpc_reply(server, conn);
+        return;
+    }
+
+    server_unwatch(server, &conn->src);
+    for (int i = 0; i < conn->count; i++) {
+        if (server_submit(server, &conn->items[i].job) < 0) {
+            conn->items[i].status = AVERROR(ETIMEDOUT);
+            conn->pending--;
+        }
+    }
+    if (!conn->pending) {
+        rpc_reply(server, conn);
+    }
+}
+
+static void rpc_read(struct server* server, struct rpc_conn* conn) {
+    for (;;) {
+        ssize_t n = read(conn->src.fd, conn->in + conn->in_len, sizeof(conn->in) - conn->in_len);
+
+        if (n < 0 && errno == EAGAIN) {
+            break;
+        } else if (n <= 0) {
+            rpc_close(server, conn);
+            return;
+        }
+        conn->in_len += n;
+        if (conn->in_len == sizeof(conn->in)) {
+            break;
+        }
+    }
+
+    rpc_process(server, conn);
+}
+
+static void rpc_add_conn(struct server* server, int fd) {
+    struct rpc_conn* conn = calloc(1, sizeof(*conn));
+
+    if (!conn) {
+        close(fd);
+        return;
+    }
+    conn->src = (struct poll_source){ .kind = POLL_RPC_CONN, .fd = fd };
+    if (server_watch(server, &conn->src, EPOLLIN | EPOLLRDHUP) < 0) {
+        close(fd);
+        free(conn);
+    }
+}
+
+static void rpc_accept(struct server* server) {
+    int fd;
+
+    while ((fd = accept4(server->rpc_listen.fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        rpc_add_conn(server, fd);
+    }
+    server_check_accept(server);
+}
+
+static int rpc_listen(const char* path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0 ||
+        bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(fd, SERVER_LISTEN_BACKLOG) < 0) {
+        fprintf(stderr, "Could not listen on %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    return fd;
+}
+
+/* Connection kinds on the channel from the cluster router */
+#define CLUSTER_HTTP 'H'
+#define CLUSTER_RPC 'R'
+
+/**
+ * Receive the connections the router hands this worker process. Returns -1 once the router
+ * has gone away.
+ */
+static int server_channel(struct server* server) {
+    for (;;) {
+        union {
+            struct cmsghdr align;
+            char buf[CMSG_SPACE(sizeof(int))];
+        } control;
+        char kind;
+        struct iovec iov = { &kind, 1 };
+        struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf, .msg_controllen = sizeof(control.buf) };
+        struct cmsghdr* cmsg;
+        ssize_t n;
+        int fd;
+
+        n = recvmsg(server->channel.fd, &msg, MSG_CMSG_CLOEXEC);
+        if (n < 0 && errno == EAGAIN) {
+            return 0;
+        } else if (n <= 0) {
+            return -1;
+        }
+        if (!(cmsg = CMSG_FIRSTHDR(&msg)) || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+
+        if (kind == CLUSTER_HTTP) {
+            http_add_conn(server, fd);
+        } else {
+            rpc_add_conn(server, fd);
+        }
+    }
+}
+
+/**
+ * Run a server process: the event loop and its decode workers. It serves connections
+ * accepted on the listening sockets given, and those handed over on channel_fd when it is a
+ * cluster worker; unused ones are -1.
+ */
+static int server_main(const struct server_config* config, int http_fd, int rpc_fd, int channel_fd) {
+    struct server server = { .config = *config };
+    struct epoll_event events[SERVER_MAX_EVENTS];
+    struct rlimit nofile;
+    sigset_t signals;
+
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.cond, NULL);
+    for (int i = 0; i < PRIORITY_COUNT; i++) {
+        server.pending_tail[i] = &server.pending[i];
+    }
+    server.idle_workers = config->workers;
+    server.route_cost[ROUTE_PLAYLIST] = INITIAL_PLAYLIST_COST;
+    server.route_cost[ROUTE_SEGMENT] = INITIAL_SEGMENT_COST;
+    server.route_cost[ROUTE_FMP4_SEGMENT] = INITIAL_SEGMENT_COST;
+    server.route_cost[ROUTE_THUMBNAIL] = INITIAL_THUMBNAIL_COST;
+    server.frame_cost = INITIAL_FRAME_COST;
+
+    /*
+     * Every cached input holds a descriptor. Take as many as we are allowed and leave at
+     * least half of them for connections and response bodies.
+     */
+    pthread_mutex_init(&server.inputs.lock, NULL);
+    if (getrlimit(RLIMIT_NOFILE, &nofile) == 0) {
+        nofile.rlim_cur = nofile.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &nofile);
+        getrlimit(RLIMIT_NOFILE, &nofile);
+        if (nofile.rlim_cur != RLIM_INFINITY && config->cache_entries > nofile.rlim_cur / 2) {
+            fprintf(stderr, "Input cache limited to %d entries by the descriptor limit\n", (int)(nofile.rlim_cur / 2));
+            server.inputs.max_entries = nofile.rlim_cur / 2;
+        } else {
+            server.inputs.max_entries = config->cache_entries;
+        }
+    }
+    server.inputs.max_size = config->cache_size;
+    pthread_mutex_init(&server.decoders.lock, NULL);
+    server.decoders.max_entries = config->decoders;
+
+    if ((server.epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+        (server.event.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        fprintf(stderr, "Could not create event loop: %s\n", strerror(errno));
+        return 1;
+    }
+    server.event.kind = POLL_EVENT;
+    server_watch(&server, &server.event, EPOLLIN);
+
+    /* SIGUSR1 dumps the counters */
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    if ((server.signal.fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) {
+        fprintf(stderr, "Could not create signalfd: %s\n", strerror(errno));
+        return 1;
+    }
+    server.signal.kind = POLL_SIGNAL;
+    server_watch(&server, &server.signal, EPOLLIN);
+
+    if (http_fd >= 0) {
+        server.http_listen = (struct poll_source){ .kind = POLL_HTTP_LISTEN, .fd = http_fd };
+        server_watch(&server, &server.http_listen, EPOLLIN);
+    }
+    if (rpc_fd >= 0) {
+        server.rpc_listen = (struct poll_source){ .kind = POLL_RPC_LISTEN, .fd = rpc_fd };
+        server_watch(&server, &server.rpc_listen, EPOLLIN);
+    }
+    if (channel_fd >= 0) {
+        server.channel = (struct poll_source){ .kind = POLL_CHANNEL, .fd = channel_fd };
+        server_watch(&server, &server.channel, EPOLLIN);
+    }
+
+    server_claim_metrics_shard(&server);
+    for (int i = 0; i < config->workers; i++) {
+        pthread_t thread;
+
+        if (pthread_create(&thread, NULL, server_worker, &server) != 0) {
+            fprintf(stderr, "Could not start worker\n");
+            return 1;
+        }
+        pthread_detach(thread);
+    }
+
+    for (;;) {
+        int n = epoll_wait(server.epoll_fd, events, SERVER_MAX_EVENTS, -1);
+
+        if (n < 0 && errno != EINTR) {
+            fprintf(stderr, "epoll_wait failed: %s\n", strerror(errno));
+            return 1;
+        }
+
+        for (int i = 0; i < n; i++) {
+            struct poll_source* src = events[i].data.ptr;
+            int hangup = events[i].events & (EPOLLERR | EPOLLHUP);
+
+            switch (src->kind) {
+                case POLL_EVENT:
+                    server_complete(&server);
+                    break;
+                case POLL_SIGNAL:
+                    server_signal(&server);
+                    break;
+                case POLL_HTTP_LISTEN:
+                    http_accept(&server);
+                    break;
+                case POLL_RPC_LISTEN:
+                    rpc_accept(&server);
+                    break;
+                case POLL_CHANNEL:
+                    if (server_channel(&server) < 0) {
+                        return 0;
+                    }
+                    break;
+                case POLL_HTTP_CONN:
+                    if (hangup) {
+                        http_close(&server, container_of(src, struct http_conn, src));
+                    } else if (events[i].events & EPOLLOUT) {
+                        http_write(&server, container_of(src, struct http_conn, src));
+                    } else {
+                        http_read(&server, container_of(src, struct http_conn, src));
+                    }
+                    break;
+                case POLL_RPC_CONN:
+                    if (hangup) {
+                        rpc_close(&server, container_of(src, struct rpc_conn, src));
+                    } else if (events[i].events & EPOLLOUT) {
+                        rpc_write(&server, container_of(src, struct rpc_conn, src));
+                    } else {
+                        rpc_read(&server, container_of(src, struct rpc_conn, src));
+                    }
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+}
+
+/*
+ * NUMA placement
+ *
+ * With --numa each cluster process is bound to one node, round robin by process index: its
+ * event loop, decode workers and the decoder threads they start run on the node's CPUs, and
+ * the memory they allocate (frame pools, cached inputs and decoders) prefers the node. The
+ * router's consistent hashing sends an asset to the same process, so to the node that
+ * already holds its cached contexts. Nodes come from /sys/devices/system/node, limited to
+ * the CPUs we are allowed to run on.
+ */
+#define NUMA_MAX_NODES 64
+#define NUMA_NODE_PATH "/sys/devices/system/node"
+
+struct numa_node {
+    int id;
+    cpu_set_t cpus;
+};
+
+/* Parse a kernel CPU list, such as "0-3,8-11" */
+static int parse_cpulist(const char* list, cpu_set_t* cpus) {
+    CPU_ZERO(cpus);
+
+    while (*list && *list != '\n') {
+        char* end;
+        long first = strtol(list, &end, 10);
+        long last = first;
+
+        if (end == list) {
+            return -1;
+        }
+        if (*end == '-') {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if (end == list) {
+                return -1;
+            }
+        }
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET(cpu, cpus);
+        }
+        list = *end == ',' ? end + 1 : end;
+    }
+
+    return 0;
+}
+
+/**
+ * Fill nodes with the NUMA nodes that have CPUs we may use. Returns how many, 0 when the
+ * machine does not say.
+ */
+static int numa_nodes(struct numa_node* nodes) {
+    cpu_set_t allowed;
+    int count = 0;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        return 0;
+    }
+
+    for (int id = 0; id < NUMA_MAX_NODES; id++) {
+        char path[64];
+        char list[1024];
+        FILE* f;
+
+        snprintf(path, sizeof(path), NUMA_NODE_PATH "/node%d/cpulist", id);
+        if (!(f = fopen(path, "r"))) {
+            continue;
+        }
+        if (fgets(list, sizeof(list), f) && parse_cpulist(list, &nodes[count].cpus) == 0) {
+            CPU_AND(&nodes[count].cpus, &nodes[count].cpus, &allowed);
+            if (CPU_COUNT(&nodes[count].cpus) > 0) {
+                nodes[count++].id = id;
+            }
+        }
+        fclose(f);
+    }
+
+    return count;
+}
+
+/**
+ * Run the calling thread, and the threads it starts from now on, on node's CPUs, and have
+ * their allocations prefer its memory.
+ */
+static int numa_bind(const struct numa_node* node) {
+    unsigned long mask = 1UL << node->id;
+
+    if (sched_setaffinity(0, sizeof(node->cpus), &node->cpus) < 0) {
+        fprintf(stderr, "Could not bind to node %d's CPUs: %s\n", node->id, strerror(errno));
+        return -1;
+    }
+    /* Preferred rather than bound: a full node spills over instead of failing allocations */
+    if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask, sizeof(mask) * 8 + 1) < 0) {
+        fprintf(stderr, "Could not bind to node %d's memory: %s\n", node->id, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Decode workers for each of sharing processes on node: its CPUs, within the container's */
+static int numa_node_workers(const struct numa_node* node, int sharing) {
+    return FFMAX(1, FFMIN(CPU_COUNT(&node->cpus), available_cpus()) / sharing);
+}
+
+/**
+ * Bind process index of processes to the node it falls on, round robin, and set workers to
+ * its share of that node's CPUs. Nothing to do on a machine with one node.
+ */
+static int numa_bind_index(int index, int processes, int* workers) {
+    struct numa_node nodes[NUMA_MAX_NODES];
+    int count = numa_nodes(nodes);
+    int sharing;
+
+    if (count < 2) {
+        return 0;
+    }
+
+    sharing = processes / count + (index % count < processes % count);
+    *workers = numa_node_workers(&nodes[index % count], sharing);
+
+    return numa_bind(&nodes[index % count]);
+}
+
+/* Bind to the node with the given id, for batch runs started one per node */
+static int numa_bind_id(int id) {
+    struct numa_node nodes[NUMA_MAX_NODES];
+    int count = numa_nodes(nodes);
+
+    for (int i = 0; i < count; i++) {
+        if (nodes[i].id == id) {
+            return numa_bind(&nodes[i]);
+        }
+    }
+    fprintf(stderr, "No NUMA node %d with usable CPUs\n", id);
+
+    return -1;
+}
+
+/*
+ * Cluster
+ *
+ * With --processes N the server runs as N worker processes, each a complete server with its
+ * own decode workers, behind a router process that owns the listening sockets. The router
+ * peeks at the first request on each new connection, picks a worker by consistent hashing of
+ * the asset, and passes the connection to it with SCM_RIGHTS; it stays with that worker from
+ * then on. A title's cached inputs and decoders therefore live in one process, and a crashed
+ * worker takes only its own connections with it. The router restarts it in the same place on
+ * the ring, after a delay that doubles while it keeps dying soon after starting.
+ */
+
+#define CLUSTER_VNODES 64
+/* Restart delay after a worker process dies, doubled for each quick death in a row */
+#define CLUSTER_RESTART_DELAY_MS 100
+#define CLUSTER_RESTART_MAX_DELAY_MS 30000
+/* A worker process that ran for this long was not crash looping */
+#define CLUSTER_STABLE_MS 10000
+/* How long a new connection has to send its first request before it is dropped */
+#define CLUSTER_ROUTE_TIMEOUT_MS 10000
+
+struct cluster_worker {
+    /* 0 while waiting to be restarted */
+    pid_t pid;
+    int channel;
+    int64_t started;
+    int quick_exits;
+    /* av_gettime_relative() time to restart at, 0 if running */
+    int64_t restart_at;
+};
+
+struct cluster_point {
+    uint64_t hash;
+    int worker;
+};
+
+struct cluster {
+    struct server_config config;
+    int epoll_fd;
+    struct poll_source http_listen;
+    struct poll_source rpc_listen;
+    struct poll_source signal;
+    struct cluster_worker* workers;
+    struct cluster_point* ring;
+    int points;
+    /* Connections waiting to be routed, oldest first */
+    struct cluster_conn* conns_head;
+    struct cluster_conn* conns_tail;
+};
+
+/* A connection whose first request has not fully arrived yet */
+struct cluster_conn {
+    struct poll_source src;
+    /* av_gettime_relative() time it is dropped at if still not routed */
+    int64_t expires;
+    struct cluster_conn* prev;
+    struct cluster_conn* next;
+};
+
+/* Finalizer from splitmix64; FNV-1a alone spreads short, similar keys poorly over the ring */
+static uint64_t mix64(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+static int cluster_point_compare(const void* a, const void* b) {
+    const struct cluster_point* pa = a;
+    const struct cluster_point* pb = b;
+
+    return pa->hash < pb->hash ? -1 : pa->hash > pb->hash;
+}
+
+static void cluster_build_ring(struct cluster* cluster) {
+    cluster->points = 0;
+    for (int i = 0; i < cluster->config.processes; i++) {
+        for (int v = 0; v < CLUSTER_VNODES; v++) {
+            uint64_t key[2] = { i, v };
+
+            cluster->ring[cluster->points++] = (struct cluster_point){ mix64(fnv1a(key, sizeof(key), FNV1A_INIT)), i };
+        }
+    }
+    qsort(cluster->ring, cluster->points, sizeof(*cluster->ring), cluster_point_compare);
+}
+
+/**
+ * The worker owning an asset: the first point on the ring at or after the asset's hash.
+ */
+static int cluster_pick(struct cluster* cluster, const char* asset, size_t len) {
+    uint64_t hash = mix64(fnv1a(asset, len, FNV1A_INIT));
+    int low = 0;
+    int high = cluster->points;
+
+    while (low < high) {
+        int mid = (low + high) / 2;
+
+        if (cluster->ring[mid].hash < hash) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return cluster->ring[low % cluster->points].worker;
+}
 
-    exit(1);
+static int cluster_spawn(struct cluster* cluster, int index) {
+    int sv[2];
+    pid_t pid;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+        fprintf(stderr, "Could not create worker channel: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if ((pid = fork()) < 0) {
+        fprintf(stderr, "Could not start worker process: %s\n", strerror(errno));
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    } else if (pid == 0) {
+        sigset_t signals;
+
+        /* Nothing of the router's but the shared cache and this channel */
+        for (int i = 0; i < cluster->config.processes; i++) {
+            if (cluster->workers[i].channel >= 0) {
+                close(cluster->workers[i].channel);
+            }
+        }
+        close(cluster->epoll_fd);
+        close(cluster->signal.fd);
+        if (cluster->http_listen.fd >= 0) {
+            close(cluster->http_listen.fd);
+        }
+        if (cluster->rpc_listen.fd >= 0) {
+            close(cluster->rpc_listen.fd);
+        }
+        close(sv[0]);
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGCHLD);
+        sigprocmask(SIG_UNBLOCK, &signals, NULL);
+        fcntl(sv[1], F_SETFL, O_NONBLOCK);
+
+        cluster->config.process_index = index;
+        if (cluster->config.numa) {
+            int workers = cluster->config.workers;
+
+            if (numa_bind_index(index, cluster->config.processes, &workers) < 0) {
+                exit(1);
+            }
+            /* Sized for the largest node, so never more than there are metrics shards for */
+            if (cluster->config.numa_workers) {
+                cluster->config.workers = FFMIN(workers, cluster->config.workers);
+            }
+        }
+        exit(server_main(&cluster->config, -1, -1, sv[1]));
+    }
+
+    close(sv[1]);
+    cluster->workers[index].pid = pid;
+    cluster->workers[index].channel = sv[0];
+    cluster->workers[index].started = av_gettime_relative();
+    cluster->workers[index].restart_at = 0;
+
+    return 0;
 }
 
-static AVFormatContext* open_input_file(char* filename) {
-    AVFormatContext* ctx = NULL;
-    int ret;
-    if((ret = avformat_open_input(&ctx, filename, NULL, NULL)) < 0) {
-        fprintf(stderr, "Could not open %s: %s\n", filename, av_err2str(ret));
-        exit(1);
+/**
+ * Schedule the restart of a worker process that exited or could not be started. The delay
+ * doubles with every exit within CLUSTER_STABLE_MS of starting, so a worker that dies on
+ * startup does not turn the router into a fork loop.
+ */
+static void cluster_schedule_restart(struct cluster_worker* worker) {
+    int64_t now = av_gettime_relative();
+    int64_t delay;
+
+    if (worker->started && now - worker->started >= CLUSTER_STABLE_MS * 1000LL) {
+        worker->quick_exits = 0;
+    } else {
+        worker->quick_exits++;
     }
+    delay = FFMIN((int64_t)CLUSTER_RESTART_DELAY_MS << FFMIN(FFMAX(worker->quick_exits - 1, 0), 20), CLUSTER_RESTART_MAX_DELAY_MS);
 
-    if((ret = avformat_find_stream_info(ctx, NULL)) < 0) {
-        fprintf(stderr, "Could not find codec parameters for %s: %s\n", filename, av_err2str(ret));
-        exit(1);
+    worker->pid = 0;
+    worker->started = 0;
+    worker->restart_at = now + delay * 1000;
+    fprintf(stderr, "restarting in %" PRId64 " ms\n", delay);
+}
+
+/**
+ * Reap exited worker processes and schedule their replacements; forward SIGUSR1 so every
+ * process prints its counters.
+ */
+static void cluster_signal(struct cluster* cluster) {
+    struct signalfd_siginfo info;
+    pid_t pid;
+    int status;
+
+    while (read(cluster->signal.fd, &info, sizeof(info)) == sizeof(info)) {
+        if (info.ssi_signo == SIGUSR1) {
+            shm_cache_print_stats(cluster->config.shm_cache);
+            for (int i = 0; i < cluster->config.processes; i++) {
+                if (cluster->workers[i].pid > 0) {
+                    kill(cluster->workers[i].pid, SIGUSR1);
+                }
+            }
+        }
     }
 
-    return ctx;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (int i = 0; i < cluster->config.processes; i++) {
+            if (cluster->workers[i].pid != pid) {
+                continue;
+            }
+            if (WIFSIGNALED(status)) {
+                fprintf(stderr, "Worker process %d killed by signal %d, ", i, WTERMSIG(status));
+            } else {
+                fprintf(stderr, "Worker process %d exited with status %d, ", i, WEXITSTATUS(status));
+            }
+            close(cluster->workers[i].channel);
+            cluster->workers[i].channel = -1;
+            cluster_schedule_restart(&cluster->workers[i]);
+        }
+    }
 }
 
-static int find_best_stream(AVFormatContext* ctx, enum AVMediaType type) {
-    int best_stream;
+static void cluster_close(struct cluster* cluster, struct cluster_conn* conn) {
+    if (conn->prev) {
+        conn->prev->next = conn->next;
+    } else {
+        cluster->conns_head = conn->next;
+    }
+    if (conn->next) {
+        conn->next->prev = conn->prev;
+    } else {
+        cluster->conns_tail = conn->prev;
+    }
+    epoll_ctl(cluster->epoll_fd, EPOLL_CTL_DEL, conn->src.fd, NULL);
+    close(conn->src.fd);
+    free(conn);
+}
 
-    best_stream = av_find_best_stream(ctx, type, -1, -1, NULL, 0);
-    if (best_stream < 0) {
-        fprintf(stderr, "Could not find stream of type %s\n", av_get_media_type_string(type));
-        exit(1);
+/**
+ * Restart the worker processes that are due and drop connections that have not sent a
+ * routable request in time. Returns the epoll_wait() timeout until the next of these, or -1.
+ */
+static int cluster_timers(struct cluster* cluster) {
+    int64_t now = av_gettime_relative();
+    int64_t next = INT64_MAX;
+
+    for (int i = 0; i < cluster->config.processes; i++) {
+        struct cluster_worker* worker = &cluster->workers[i];
+
+        if (worker->restart_at && worker->restart_at <= now) {
+            fprintf(stderr, "Restarting worker process %d\n", i);
+            if (cluster_spawn(cluster, i) < 0) {
+                fprintf(stderr, "Worker process %d could not be started, ", i);
+                cluster_schedule_restart(worker);
+            }
+        }
+        if (worker->restart_at) {
+            next = FFMIN(next, worker->restart_at);
+        }
     }
 
-    return best_stream;
+    while (cluster->conns_head && cluster->conns_head->expires <= now) {
+        cluster_close(cluster, cluster->conns_head);
+    }
+    if (cluster->conns_head) {
+        next = FFMIN(next, cluster->conns_head->expires);
+    }
+
+    return next == INT64_MAX ? -1 : (int)FFMIN((next - now + 999) / 1000, INT_MAX);
 }
 
 /**
- * Seek to the specified timestamp. This will seek to the closest key frame that is before or
- * equal to the specified timestamp.
- *
- * The timestamp is in AV_TIME_BASE units
+ * Find the asset of the first request on a connection without consuming it. Returns 1 with
+ * the asset in asset and its length in *len, 0 if more data is needed, negative if the
+ * connection should be dropped. Requests without a usable asset go by whatever they have.
  */
-static void seek_to_timestamp(AVFormatContext* ctx, AVCodecContext* dec_ctx, int64_t max_timestamp) {
-    int ret;
+static int cluster_peek(struct cluster_conn* conn, char* buf, size_t size, const char** asset, size_t* len) {
+    ssize_t n = recv(conn->src.fd, buf, size - 1, MSG_PEEK);
 
-    if((ret = avformat_seek_file(ctx, -1, 0, max_timestamp, max_timestamp, 0)) < 0) {
-        fprintf(stderr, "Could not seek\n");
-        exit(1);
+    if (n < 0 && errno == EAGAIN) {
+        return 0;
+    } else if (n <= 0) {
+        return -1;
+    }
+    buf[n] = 0;
+
+    if (conn->src.kind == POLL_ROUTE_HTTP) {
+        char* line_end = strstr(buf, "\r\n");
+        char* path;
+        char* end;
+        int64_t number;
+
+        if (!line_end) {
+            if (n < size - 1) {
+                return 0;
+            }
+            *asset = buf;
+            *len = n;
+            return 1;
+        }
+        *line_end = 0;
+        if (!(path = strchr(buf, ' '))) {
+            *asset = buf;
+            *len = line_end - buf;
+            return 1;
+        }
+        if ((end = strchr(++path, ' '))) {
+            *end = 0;
+        }
+        if (http_parse_route(path, (char**)asset, &number) == ROUTE_NONE) {
+            *asset = path;
+        }
+        *len = strlen(*asset);
+        return 1;
+    } else {
+        struct rpc_header header;
+        struct rpc_request request;
+
+        if (n < sizeof(header)) {
+            return 0;
+        }
+        memcpy(&header, buf, sizeof(header));
+        if (header.magic != RPC_MAGIC || !header.count) {
+            *asset = "";
+            *len = 0;
+            return 1;
+        }
+        if (n < sizeof(header) + sizeof(request)) {
+            return 0;
+        }
+        memcpy(&request, buf + sizeof(header), sizeof(request));
+        if (sizeof(header) + sizeof(request) + request.asset_len > size - 1) {
+            *asset = "";
+            *len = 0;
+            return 1;
+        }
+        if (n < sizeof(header) + sizeof(request) + request.asset_len) {
+            return 0;
+        }
+        *asset = buf + sizeof(header) + sizeof(request);
+        *len = request.asset_len;
+        return 1;
     }
 }
 
 /**
- * Convert frame the specified timebase to AV_TIME_BASE
+ * Hand a connection to its worker process once its first request can be routed.
  */
-static inline int64_t to_av_timebase(int64_t timestamp, AVRational timebase) {
-    return av_rescale_q(timestamp, timebase, (AVRational){1, AV_TIME_BASE});
+static void cluster_route(struct cluster* cluster, struct cluster_conn* conn) {
+    char buf[HTTP_MAX_HEADER];
+    const char* asset;
+    size_t len;
+    int ret;
+
+    if ((ret = cluster_peek(conn, buf, sizeof(buf), &asset, &len)) == 0) {
+        return;
+    }
+
+    if (ret > 0) {
+        struct cluster_worker* worker = &cluster->workers[cluster_pick(cluster, asset, len)];
+        union {
+            struct cmsghdr align;
+            char buf[CMSG_SPACE(sizeof(int))];
+        } control;
+        char kind = conn->src.kind == POLL_ROUTE_HTTP ? CLUSTER_HTTP : CLUSTER_RPC;
+        struct iovec iov = { &kind, 1 };
+        struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf, .msg_controllen = sizeof(control.buf) };
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &conn->src.fd, sizeof(int));
+
+        /* A worker that is restarting or not keeping up loses the connection */
+        if (worker->channel < 0 || sendmsg(worker->channel, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+            fprintf(stderr, "Could not hand connection to worker process: %s\n",
+                    worker->channel < 0 ? "restarting" : strerror(errno));
+        }
+    }
+
+    cluster_close(cluster, conn);
 }
 
+static void cluster_accept(struct cluster* cluster, struct poll_source* listen_src, enum poll_kind kind) {
+    int fd;
 
-static void pgm_save(unsigned char *buf, int wrap, int xsize, int ysize,
-                     char *filename)
-{
-    FILE *f;
-    int i;
+    while ((fd = accept4(listen_src->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        struct cluster_conn* conn = calloc(1, sizeof(*conn));
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP | EPOLLET };
 
-    f = fopen(filename,"w");
-    fprintf(f, "P5\n%d %d\n%d\n", xsize, ysize, 255);
-    for (i = 0; i < ysize; i++)
-        fwrite(buf + i * wrap, 1, xsize, f);
-    fclose(f);
+        if (!conn) {
+            close(fd);
+            continue;
+        }
+        conn->src = (struct poll_source){ .kind = kind, .fd = fd, .watched = 1 };
+        conn->expires = av_gettime_relative() + CLUSTER_ROUTE_TIMEOUT_MS * 1000LL;
+        ev.data.ptr = &conn->src;
+        /* Edge triggered: peeking leaves the data readable, so wait for more to arrive */
+        if (epoll_ctl(cluster->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            close(fd);
+            free(conn);
+            continue;
+        }
+        conn->prev = cluster->conns_tail;
+        if (cluster->conns_tail) {
+            cluster->conns_tail->next = conn;
+        } else {
+            cluster->conns_head = conn;
+        }
+        cluster->conns_tail = conn;
+        cluster_route(cluster, conn);
+    }
+}
+
+static int cluster_main(const struct server_config* config, int http_fd, int rpc_fd) {
+    struct cluster cluster = { .config = *config };
+    struct epoll_event events[SERVER_MAX_EVENTS];
+    sigset_t signals;
+
+    cluster.workers = calloc(config->processes, sizeof(*cluster.workers));
+    cluster.ring = calloc(config->processes * CLUSTER_VNODES, sizeof(*cluster.ring));
+    if (!cluster.workers || !cluster.ring) {
+        fprintf(stderr, "Could not allocate cluster\n");
+        return 1;
+    }
+    for (int i = 0; i < config->processes; i++) {
+        cluster.workers[i].channel = -1;
+    }
+    cluster_build_ring(&cluster);
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &signals, NULL);
+    if ((cluster.epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+        (cluster.signal.fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) {
+        fprintf(stderr, "Could not create event loop: %s\n", strerror(errno));
+        return 1;
+    }
+    cluster.http_listen = (struct poll_source){ .kind = POLL_HTTP_LISTEN, .fd = http_fd };
+    cluster.rpc_listen = (struct poll_source){ .kind = POLL_RPC_LISTEN, .fd = rpc_fd };
+    cluster.signal.kind = POLL_SIGNAL;
+
+    for (int i = 0; i < config->processes; i++) {
+        if (cluster_spawn(&cluster, i) < 0) {
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < 3; i++) {
+        struct poll_source* src = (struct poll_source*[]){ &cluster.http_listen, &cluster.rpc_listen, &cluster.signal }[i];
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = src };
+
+        if (src->fd >= 0 && epoll_ctl(cluster.epoll_fd, EPOLL_CTL_ADD, src->fd, &ev) < 0) {
+            fprintf(stderr, "Could not watch listener: %s\n", strerror(errno));
+            return 1;
+        }
+    }
+
+    for (;;) {
+        int n = epoll_wait(cluster.epoll_fd, events, SERVER_MAX_EVENTS, cluster_timers(&cluster));
+
+        if (n < 0 && errno != EINTR) {
+            fprintf(stderr, "epoll_wait failed: %s\n", strerror(errno));
+            return 1;
+        }
+
+        for (int i = 0; i < n; i++) {
+            struct poll_source* src = events[i].data.ptr;
+
+            switch (src->kind) {
+                case POLL_SIGNAL:
+                    cluster_signal(&cluster);
+                    break;
+                case POLL_HTTP_LISTEN:
+                    cluster_accept(&cluster, src, POLL_ROUTE_HTTP);
+                    break;
+                case POLL_RPC_LISTEN:
+                    cluster_accept(&cluster, src, POLL_ROUTE_RPC);
+                    break;
+                case POLL_ROUTE_HTTP:
+                case POLL_ROUTE_RPC:
+                    cluster_route(&cluster, container_of(src, struct cluster_conn, src));
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+}
+
+static int serve(const char* http_address, const char* rpc_path, struct server_config* config) {
+    int http_fd = -1;
+    int rpc_fd = -1;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    if (config->shm_cache_size && !(config->shm_cache = shm_cache_create(config->shm_cache_size))) {
+        return 1;
+    }
+    /* One shard for each worker and the event loop of every process */
+    if (!(config->metrics = metrics_create(config->processes, config->workers + 1))) {
+        return 1;
+    }
+    if ((http_address && (http_fd = http_listen(http_address)) < 0) ||
+        (rpc_path && (rpc_fd = rpc_listen(rpc_path)) < 0)) {
+        return 1;
+    }
+
+    fprintf(stderr, "serving %s on %s%s%s with %d workers", config->root,
+            http_address ? http_address : "", http_address && rpc_path ? " and " : "",
+            rpc_path ? rpc_path : "", config->workers);
+    if (config->processes > 1) {
+        fprintf(stderr, " in each of %d processes\n", config->processes);
+        return cluster_main(config, http_fd, rpc_fd);
+    }
+    fprintf(stderr, "\n");
+
+    return server_main(config, http_fd, rpc_fd, -1);
 }
 
+static int serve_main(int argc, char** argv) {
+    struct server_config config = {
+        .root = ".",
+        .duration = 5,
+        .timescale = 1,
+        .workers = available_cpus(),
+        .mem_budget = -1,
+        .cache_entries = 256,
+        .cache_size = 256 * 1024 * 1024,
+        .decoders = -1,
+        .processes = 1,
+        .shm_cache_size = 64 * 1024 * 1024,
+    };
+    const char* http_address = NULL;
+    const char* rpc_path = NULL;
+    int workers_set = 0;
+    int64_t memory_limit = container_limits()->memory;
+
+    /* Caches take a bounded share of a container's memory */
+    if (memory_limit) {
+        config.cache_size = FFMIN(config.cache_size, memory_limit / 8);
+        config.shm_cache_size = FFMIN(config.shm_cache_size, memory_limit / 16);
+    }
+
+    static struct option long_options[] = {
+        {"http", required_argument, 0, OPT_HTTP},
+        {"unix", required_argument, 0, OPT_UNIX},
+        {"root", required_argument, 0, OPT_ROOT},
+        {"workers", required_argument, 0, OPT_WORKERS},
+        {"duration", required_argument, 0, 'd'},
+        {"timescale", required_argument, 0, 't'},
+        {"mem-budget", required_argument, 0, OPT_MEM_BUDGET},
+        {"deadline", required_argument, 0, OPT_DEADLINE},
+        {"cache-entries", required_argument, 0, OPT_CACHE_ENTRIES},
+        {"cache-size", required_argument, 0, OPT_CACHE_SIZE},
+        {"decoders", required_argument, 0, OPT_DECODERS},
+        {"processes", required_argument, 0, OPT_PROCESSES},
+        {"shm-cache", required_argument, 0, OPT_SHM_CACHE},
+        {"numa", no_argument, 0, OPT_NUMA},
+        {"profile", required_argument, 0, OPT_PROFILE},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0},
+    };
+    int option;
+    while ((option = getopt_long(argc, argv, "d:t:h?", long_options, NULL)) != -1) {
+        switch (option) {
+            case OPT_HTTP:
+                http_address = optarg;
+                break;
+            case OPT_UNIX:
+                rpc_path = optarg;
+                break;
+            case OPT_ROOT:
+                config.root = optarg;
+                break;
+            case OPT_WORKERS:
+                config.workers = atoi(optarg);
+                workers_set = 1;
+                break;
+            case 'd':
+                config.duration = atoi(optarg);
+                break;
+            case 't':
+                config.timescale = atoi(optarg);
+                break;
+            case OPT_MEM_BUDGET:
+                config.mem_budget = parse_mem_budget(optarg);
+                break;
+            case OPT_DEADLINE:
+                config.deadline = atoi(optarg);
+                break;
+            case OPT_CACHE_ENTRIES:
+                config.cache_entries = atoi(optarg);
+                break;
+            case OPT_CACHE_SIZE:
+                config.cache_size = (int64_t)atoi(optarg) * 1024 * 1024;
+                break;
+            case OPT_DECODERS:
+                config.decoders = atoi(optarg);
+                break;
+            case OPT_PROCESSES:
+                config.processes = atoi(optarg);
+                break;
+            case OPT_SHM_CACHE:
+                config.shm_cache_size = (int64_t)atoi(optarg) * 1024 * 1024;
+                break;
+            case OPT_NUMA:
+                config.numa = 1;
+                break;
+            case OPT_PROFILE:
+                profile_path = optarg;
+                break;
+            case 'h':
+            case '?':
+                usage(argv[0]);
+                break;
+        }
+    }
+
+    if ((!http_address && !rpc_path) || argc != optind || config.workers < 1 || config.processes < 1) {
+        usage(argv[0]);
+    }
+    if (config.numa) {
+        struct numa_node nodes[NUMA_MAX_NODES];
+        int count = numa_nodes(nodes);
+
+        /* At least a process per node, and by default as many workers as the node has CPUs */
+        if (count > 1 && config.processes < count) {
+            config.processes = count;
+        }
+        /* Each process sizes its own workers once bound; this is the most any of them has */
+        if (count > 1 && !workers_set) {
+            config.workers = 1;
+            for (int i = 0; i < count && i < config.processes; i++) {
+                int sharing = config.processes / count + (i < config.processes % count);
+
+                config.workers = FFMAX(config.workers, numa_node_workers(&nodes[i], sharing));
+            }
+            config.numa_workers = 1;
+        }
+        if (count < 2) {
+            fprintf(stderr, "Only one NUMA node, --numa has no effect\n");
+        }
+    }
+    if (config.decoders < 0) {
+        config.decoders = config.workers;
+    }
+    /* Half a container's memory is shared by the requests that can run at once */
+    if (config.mem_budget < 0) {
+        config.mem_budget = memory_limit / 2 / ((int64_t)config.workers * config.processes);
+    }
+    if (memory_limit) {
+        fprintf(stderr, "Container memory limit of %" PRId64 " MiB: cache=%" PRId64 "MiB;shm_cache=%" PRId64 "MiB;mem_budget=%" PRId64 "MiB\n",
+                memory_limit >> 20, config.cache_size >> 20, config.shm_cache_size >> 20, config.mem_budget >> 20);
+    }
+
+    av_register_all();
+
+    return serve(http_address, rpc_path, &config);
+}
 
 int main(int argc, char** argv) {
-    AVFormatContext* input_ctx;
-    AVCodecContext* dec_ctx;
-    AVCodec* codec;
-    AVPacket packet = {0};
+    struct request req = {0};
 
     char* input_filename;
     int duration = 5;
@@ -92,14 +7249,52 @@ int main(int argc, char** argv) {
     int segment = 0;
     int64_t start_timestamp;
     int64_t end_timestamp;
-    int best_video_stream = 0;
-    int best_audio_stream = 0;
-    int ret;
+    int print_stats_flag = 0;
+    const char* trace_filename = NULL;
+    int perf_counters_flag = 0;
+    int numa_node = -1;
+    double best_near = -1;
+    double window = 2;
+    const char* crop_arg = NULL;
+    struct crop_rect crop;
+    int64_t start;
+    int64_t write_start;
+
+    if (argc > 1 && !strcmp(argv[1], "serve")) {
+        return serve_main(argc - 1, argv + 1);
+    }
+    if (argc > 1 && !strcmp(argv[1], "costmap")) {
+        return costmap_main(argc - 1, argv + 1);
+    }
+    if (argc > 1 && !strcmp(argv[1], "autotune")) {
+        return autotune_main(argc - 1, argv + 1);
+    }
+    if (argc > 1 && !strcmp(argv[1], "thumbnails")) {
+        return thumbnails_main(argc - 1, argv + 1);
+    }
+    if (argc > 1 && !strcmp(argv[1], "scenes")) {
+        return scenes_main(argc - 1, argv + 1);
+    }
+    if (argc > 1 && !strcmp(argv[1], "detect")) {
+        return detect_main(argc - 1, argv + 1);
+    }
+    if (argc > 1 && !strcmp(argv[1], "cropdetect")) {
+        return cropdetect_main(argc - 1, argv + 1);
+    }
 
     static struct option long_options[] = {
         {"duration", required_argument, 0, 'd'},
         {"timescale", required_argument, 0, 't'},
         {"segment", required_argument, 0, 's'},
+        {"mem-budget", required_argument, 0, OPT_MEM_BUDGET},
+        {"stats", no_argument, 0, OPT_STATS},
+        {"trace", required_argument, 0, OPT_TRACE},
+        {"perf-counters", no_argument, 0, OPT_PERF_COUNTERS},
+        {"numa-node", required_argument, 0, OPT_NUMA_NODE},
+        {"best-near", required_argument, 0, OPT_BEST_NEAR},
+        {"window", required_argument, 0, OPT_WINDOW},
+        {"crop", required_argument, 0, OPT_CROP},
+        {"profile", required_argument, 0, OPT_PROFILE},
         {"help", no_argument, 0, 'h'},
         {0, 0, 0, 0},
     };
@@ -115,6 +7310,33 @@ int main(int argc, char** argv) {
             case 's':
                 segment = atoi(optarg);
                 break;
+            case OPT_MEM_BUDGET:
+                req.budget.limit = parse_mem_budget(optarg);
+                break;
+            case OPT_STATS:
+                print_stats_flag = 1;
+                break;
+            case OPT_TRACE:
+                trace_filename = optarg;
+                break;
+            case OPT_PERF_COUNTERS:
+                perf_counters_flag = 1;
+                break;
+            case OPT_NUMA_NODE:
+                numa_node = atoi(optarg);
+                break;
+            case OPT_BEST_NEAR:
+                best_near = atof(optarg);
+                break;
+            case OPT_WINDOW:
+                window = atof(optarg);
+                break;
+            case OPT_CROP:
+                crop_arg = optarg;
+                break;
+            case OPT_PROFILE:
+                profile_path = optarg;
+                break;
             case 'h':
             case '?':
                 usage(argv[0]);
@@ -122,7 +7344,7 @@ int main(int argc, char** argv) {
         }
     }
 
-    if (argc - optind != 1) {
+    if (argc - optind != 1 || !(window > 0)) {
         usage(argv[0]);
     }
 
@@ -130,89 +7352,78 @@ int main(int argc, char** argv) {
 
     input_filename = argv[optind];
 
-    input_ctx = open_input_file(input_filename);
-
-    best_video_stream = find_best_stream(input_ctx, AVMEDIA_TYPE_VIDEO);
-    best_audio_stream = find_best_stream(input_ctx, AVMEDIA_TYPE_AUDIO);
-
-    av_dump_format(input_ctx, best_video_stream, input_filename, 0);
-    av_dump_format(input_ctx, best_audio_stream, input_filename, 0);
-
-    for (int i = 0; i < input_ctx->nb_streams; i++) {
-        if (i != best_video_stream && i != best_audio_stream) {
-            input_ctx->streams[i]->discard = AVDISCARD_ALL;
-        }
+    if (numa_node >= 0 && numa_bind_id(numa_node) < 0) {
+        exit(1);
     }
-
-    codec = avcodec_find_decoder(input_ctx->streams[best_video_stream]->codecpar->codec_id);
-
-    if (!codec) {
+    if (crop_arg && crop_option(crop_arg, input_filename, &crop) < 0) {
         exit(1);
     }
-
-    dec_ctx = avcodec_alloc_context3(codec);
-
-    ret = avcodec_parameters_to_context(dec_ctx, input_ctx->streams[best_video_stream]->codecpar);
-
-    if (ret < 0) {
+    if (trace_filename && !(trace = trace_open(trace_filename))) {
+        exit(1);
+    }
+    /* Before the decoder's threads exist, so that they inherit the counters */
+    if (perf_counters_flag && !(perf = perf_counters_open())) {
         exit(1);
     }
+    start = trace_now();
 
-    dec_ctx->framerate = input_ctx->streams[best_video_stream]->avg_frame_rate;
+    if (request_open(&req, input_filename, 0) < 0) {
+        exit(1);
+    }
 
-    ret = avcodec_open2(dec_ctx, codec, NULL);
+    av_dump_format(req.input_ctx, req.video_stream, input_filename, 0);
 
-    if (ret < 0) {
-        fprintf(stderr, "Could not open input codec\n");
+    if (request_open_decoder(&req) < 0) {
         exit(1);
     }
+    perf_phase(PERF_SETUP, 0);
 
     start_timestamp = to_av_timebase(segment, (AVRational){duration, timescale});
     end_timestamp = to_av_timebase(segment+1, (AVRational){duration, timescale});
+    if (best_near >= 0) {
+        start_timestamp = best_near * AV_TIME_BASE;
+    }
 
     fprintf(stderr, "start_timestamp=%" PRId64 ";end_timestamp=%" PRId64 "\n", start_timestamp, end_timestamp);
-    seek_to_timestamp(input_ctx, dec_ctx, start_timestamp);
 
     AVFrame* frame = av_frame_alloc();
     if (!frame) {
         fprintf(stderr, "Could not allocate frame\n");
+        exit(1);
     }
 
-    while (ret >= 0) {
-
-        ret = av_read_frame(input_ctx, &packet);
-
-        if (packet.stream_index != best_video_stream) {
-          av_packet_unref(&packet);
-          continue;
-        }
-
-        ret = avcodec_send_packet(dec_ctx, &packet);
-        if (ret < 0) {
-          fprintf(stderr, "Could not send packet\n");
-          exit(1);
-        }
-
-#ifdef DEBUG
-        fprintf(stderr, "packet pts=%" PRId64 ";dts=%" PRId64 "\n", packet.pts, packet.dts);
-#endif
-
-        ret = avcodec_receive_frame(dec_ctx, frame);
-        if (ret == AVERROR(EAGAIN)) {
-          ret = 0;
-        } else if (ret < 0) {
-            fprintf(stderr, "Didn't get frame\n");
-            exit(1);
-        } else {
-          if (av_compare_ts(frame->pts, input_ctx->streams[packet.stream_index]->time_base, start_timestamp, (AVRational){1, AV_TIME_BASE}) >= 0) {
+    if (best_near >= 0 ? request_decode_best_frame(&req, start_timestamp, window * AV_TIME_BASE, frame) < 0
+                       : request_decode_frame(&req, start_timestamp, frame) < 0) {
+        exit(1);
+    }
 
-              fprintf(stderr, "saving frame av base timestamp=%" PRId64 "\n", to_av_timebase(frame->pts, input_ctx->streams[packet.stream_index]->time_base));
-              pgm_save(frame->data[0], frame->linesize[0],
-                  frame->width, frame->height, "test.pgm");
-              exit(0);
-            }
-        }
+    fprintf(stderr, "saving frame av base timestamp=%" PRId64 "\n", to_av_timebase(frame->pts, req.input_ctx->streams[req.video_stream]->time_base));
+    if (crop_arg && apply_crop(frame, &crop) < 0) {
+        exit(1);
+    }
+    write_start = trace_now();
+    pgm_save(frame->data[0], frame->linesize[0],
+        frame->width, frame->height, "test.pgm");
+    perf_phase(PERF_WRITE, 0);
+    if (trace) {
+        trace_event("write", "output", write_start, "\"file\":\"test.pgm\"");
+    }
 
-        av_packet_unref(&packet);
+    av_frame_free(&frame);
+    request_close(&req);
+    if (trace) {
+        trace_event("request", "request", start, "\"segment\":%d", segment);
+        trace_close(trace);
+        trace = NULL;
+    }
+    if (print_stats_flag) {
+        print_stats(&req.stats);
     }
+    if (perf) {
+        perf_counters_print(perf);
+        perf_counters_close(perf);
+        perf = NULL;
+    }
+
+    return 0;
 }